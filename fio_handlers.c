@@ -1,10 +1,108 @@
+#include "fio_handlers.h"
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* ==== per-fd read buffers ---------------------------------------- *
+ * bytes between 'start' and 'end' have been read from the fd but   *
+ * not yet handed out to a caller                                   */
+struct ReadBuffer
+{
+    char data[FIO_BUFFER_SIZE];
+    int start;
+    int end;
+};
+
+static struct ReadBuffer *read_buffers[FIO_MAX_FDS];
+
+/* this function writes 'size' bytes, retrying after short writes   */
+static void write_all(int fd, char *src, int size)
+{
+    int written = 0;
+    while(written < size)
+    {
+        int n = write(fd, src + written, size - written);
+        if(n <= 0)
+            return;
+        written += n;
+    }
+}
+
+/* this function copies 'size' bytes out of the fd's read buffer,   *
+ * refilling the buffer with one read() whenever it runs dry; it    *
+ * returns the number of bytes actually copied (short only at EOF)  */
+static int read_all(int fd, char *dst, int size)
+{
+    int got = 0;
+#ifdef FIO_BYTEWISE
+    // the byte-wise string and int readers do not go through the
+    // buffer, so nothing else may read ahead of them either:
+    bool unbuffered = true;
+#else
+    bool unbuffered = (fd < 0 || fd >= FIO_MAX_FDS);
+#endif
+    if(unbuffered)
+    {
+        // no buffer for this fd, so read straight into dst:
+        while(got < size)
+        {
+            int n = read(fd, dst + got, size - got);
+            if(n <= 0)
+                return got;
+            got += n;
+        }
+        return got;
+    }
+    if(read_buffers[fd] == NULL)
+    {
+        read_buffers[fd] = malloc(sizeof(struct ReadBuffer));
+        // (with no buffer, nothing can be read, as at EOF)
+        if(read_buffers[fd] == NULL)
+            return got;
+        read_buffers[fd]->start = read_buffers[fd]->end = 0;
+    }
+    struct ReadBuffer *buf = read_buffers[fd];
+    while(got < size)
+    {
+        if(buf->start == buf->end)
+        {
+            // buffer is empty; big requests skip the copy entirely:
+            buf->start = buf->end = 0;
+            if(size - got >= FIO_BUFFER_SIZE)
+            {
+                int n = read(fd, dst + got, size - got);
+                if(n <= 0)
+                    return got;
+                got += n;
+                continue;
+            }
+            int n = read(fd, buf->data, FIO_BUFFER_SIZE);
+            if(n <= 0)
+                return got;
+            buf->end = n;
+        }
+        int chunk = buf->end - buf->start;
+        if(chunk > size - got)
+            chunk = size - got;
+        memcpy(dst + got, buf->data + buf->start, chunk);
+        buf->start += chunk;
+        got += chunk;
+    }
+    return got;
+}
+
+#ifdef FIO_BYTEWISE
 
 void write_string(int fd, char *str)
 {
     int i = 0;
     char out_char = str[i];
-    // write characters one at a time until null terminator 
+    // write characters one at a time until null terminator
     // is found
     while(out_char != '\0')
     {
@@ -45,3 +143,465 @@ void read_int(int fd, int *int_to_read)
 {
     read(fd, int_to_read, sizeof(int));
 }
+
+#else
+
+void write_string(int fd, char *str)
+{
+    int length = strlen(str);
+    int size = sizeof(int) + length;
+    // build the length prefix and the text into one frame so that
+    // the whole string costs a single write() call:
+    char small_frame[sizeof(int) + 256];
+    char *frame = (size <= (int)sizeof(small_frame)) ? small_frame : malloc(size);
+    memcpy(frame, &length, sizeof(int));
+    memcpy(frame + sizeof(int), str, length);
+    write_all(fd, frame, size);
+    if(frame != small_frame)
+        free(frame);
+}
+
+void read_string(int fd, char *str, int max_size)
+{
+    int length = 0;
+    if(read_all(fd, (char *)&length, sizeof(int)) < (int)sizeof(int) || length < 0)
+        length = 0;
+    // keep as much of the text as will fit (leaving room for the
+    // null terminator)...
+    int keep = (length < max_size) ? length : max_size - 1;
+    keep = read_all(fd, str, keep);
+    str[keep] = '\0';
+    // ...and throw away the rest so the next read starts in the
+    // right place:
+    char discard[256];
+    length -= keep;
+    while(length > 0)
+    {
+        int chunk = (length < (int)sizeof(discard)) ? length : (int)sizeof(discard);
+        if(read_all(fd, discard, chunk) < chunk)
+            break;
+        length -= chunk;
+    }
+}
+
+void write_int(int fd, int *int_to_write)
+{
+    write_all(fd, (char *)int_to_write, sizeof(int));
+}
+
+void read_int(int fd, int *int_to_read)
+{
+    read_all(fd, (char *)int_to_read, sizeof(int));
+}
+
+#endif
+
+/* this function makes sure there is room for 'size' more bytes    */
+static void reserve(struct OutBuffer *buf, int size)
+{
+    if(buf->size + size <= buf->capacity)
+        return;
+    int capacity = (buf->capacity > 0) ? buf->capacity : FIO_BUFFER_SIZE;
+    while(capacity < buf->size + size)
+        capacity *= 2;
+    buf->data = realloc(buf->data, capacity);
+    buf->capacity = capacity;
+}
+
+void buffer_int(struct OutBuffer *buf, int *int_to_write)
+{
+    reserve(buf, sizeof(int));
+    memcpy(buf->data + buf->size, int_to_write, sizeof(int));
+    buf->size += sizeof(int);
+}
+
+void buffer_string(struct OutBuffer *buf, char *str)
+{
+    buffer_chars(buf, str, strlen(str));
+}
+
+void buffer_chars(struct OutBuffer *buf, char *chars, int length)
+{
+#ifdef FIO_BYTEWISE
+    // add a null terminator, just as write_string would send:
+    reserve(buf, length + 1);
+    memcpy(buf->data + buf->size, chars, length);
+    buf->data[buf->size + length] = '\0';
+    buf->size += length + 1;
+#else
+    // length prefix first, then the text:
+    reserve(buf, sizeof(int) + length);
+    memcpy(buf->data + buf->size, &length, sizeof(int));
+    memcpy(buf->data + buf->size + sizeof(int), chars, length);
+    buf->size += sizeof(int) + length;
+#endif
+}
+
+void write_buffer(int fd, struct OutBuffer *buf)
+{
+    write_all(fd, buf->data, buf->size);
+    buf->size = 0;
+}
+
+void free_buffer(struct OutBuffer *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->size = buf->capacity = 0;
+}
+
+int begin_frame(struct OutBuffer *buf, int opcode, int PID, int request_id)
+{
+    struct FrameHeader hdr = {FRAME_MAGIC, opcode, PID, 0, request_id};
+    int frame_start = buf->size;
+    reserve(buf, sizeof(hdr));
+    memcpy(buf->data + buf->size, &hdr, sizeof(hdr));
+    buf->size += sizeof(hdr);
+    return frame_start;
+}
+
+void end_frame(struct OutBuffer *buf, int frame_start)
+{
+    // the payload is everything packed in after the header:
+    int length = buf->size - frame_start - sizeof(struct FrameHeader);
+    memcpy(buf->data + frame_start + offsetof(struct FrameHeader, length), &length, sizeof(int));
+}
+
+void pack_int(struct OutBuffer *buf, int value)
+{
+    reserve(buf, sizeof(int));
+    memcpy(buf->data + buf->size, &value, sizeof(int));
+    buf->size += sizeof(int);
+}
+
+void pack_string(struct OutBuffer *buf, char *str)
+{
+    pack_chars(buf, str, strlen(str));
+}
+
+void pack_chars(struct OutBuffer *buf, char *chars, int length)
+{
+    reserve(buf, sizeof(int) + length);
+    memcpy(buf->data + buf->size, &length, sizeof(int));
+    memcpy(buf->data + buf->size + sizeof(int), chars, length);
+    buf->size += sizeof(int) + length;
+}
+
+void pack_bytes(struct OutBuffer *buf, void *data, int size)
+{
+    reserve(buf, size);
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+bool unpack_int(struct InBuffer *in, int *value)
+{
+    if(in->size - in->pos < (int)sizeof(int))
+        return false;
+    memcpy(value, in->data + in->pos, sizeof(int));
+    in->pos += sizeof(int);
+    return true;
+}
+
+bool unpack_string(struct InBuffer *in, char *str, int max_size)
+{
+    int length;
+    str[0] = '\0';
+    if(!unpack_int(in, &length) || length < 0 || in->size - in->pos < length)
+        return false;
+    // keep as much as will fit, but always skip the whole string:
+    int keep = (length < max_size) ? length : max_size - 1;
+    memcpy(str, in->data + in->pos, keep);
+    str[keep] = '\0';
+    in->pos += length;
+    return true;
+}
+
+bool unpack_chars(struct InBuffer *in, char **chars, int *length)
+{
+    int start = in->pos;
+    if(!unpack_int(in, length) || *length < 0 || in->size - in->pos < *length)
+    {
+        in->pos = start;
+        return false;
+    }
+    *chars = in->data + in->pos;
+    in->pos += *length;
+    return true;
+}
+
+void write_bytes(int fd, void *src, int size)
+{
+    write_all(fd, src, size);
+}
+
+bool read_bytes(int fd, void *dst, int size)
+{
+    return read_all(fd, dst, size) == size;
+}
+
+bool read_payload(int fd, int length, struct InBuffer *in)
+{
+    if(length < 0)
+        return false;
+    if(length > in->capacity)
+    {
+        in->data = realloc(in->data, length);
+        in->capacity = length;
+    }
+    in->size = length;
+    in->pos = 0;
+    return read_all(fd, in->data, length) == length;
+}
+
+bool read_frame(int fd, struct FrameHeader *hdr, struct InBuffer *in)
+{
+    if(!read_bytes(fd, hdr, sizeof(struct FrameHeader)) || hdr->magic != FRAME_MAGIC)
+        return false;
+    return read_payload(fd, hdr->length, in);
+}
+
+bool read_packet(int fd, struct FrameHeader *hdr, struct InBuffer *in, bool wait)
+{
+    // peek to find out how big the packet is, without taking it:
+    int size = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC | (wait ? 0 : MSG_DONTWAIT));
+    if(size < (int)sizeof(struct FrameHeader))
+    {
+        // end-of-file, error, or a runt packet; throw away the runt:
+        if(size > 0)
+            recv(fd, hdr, sizeof(struct FrameHeader), 0);
+        return false;
+    }
+    int length = size - sizeof(struct FrameHeader);
+    if(length > in->capacity)
+    {
+        in->data = realloc(in->data, length);
+        in->capacity = length;
+    }
+    // scatter the header and payload straight into place:
+    struct iovec parts[2] = {{hdr, sizeof(struct FrameHeader)}, {in->data, length}};
+    if(readv(fd, parts, 2) != size)
+        return false;
+    in->size = length;
+    in->pos = 0;
+    return hdr->magic == FRAME_MAGIC && hdr->length == length;
+}
+
+void write_frame_pieces(int fd, struct OutBuffer *buf, int max_size, int fragment_opcode)
+{
+    struct FrameHeader hdr;
+    memcpy(&hdr, buf->data, sizeof(hdr));
+    char *payload = buf->data + sizeof(hdr);
+    int length = hdr.length;
+    int piece_size = max_size - sizeof(hdr);
+    int sent = 0;
+    do {
+        struct FrameHeader piece_hdr = hdr;
+        piece_hdr.length = length - sent;
+        if(piece_hdr.length > piece_size)
+        {
+            piece_hdr.length = piece_size;
+            piece_hdr.opcode = fragment_opcode;
+        }
+        // gather header and piece into one write so that the piece
+        // arrives as one packet (or one atomic pipe write):
+        struct iovec parts[2] = {{&piece_hdr, sizeof(piece_hdr)}, {payload + sent, piece_hdr.length}};
+        if(writev(fd, parts, 2) <= 0)
+            break;
+        sent += piece_hdr.length;
+    } while(sent < length);
+    buf->size = 0;
+}
+
+bool fio_buffered(int fd)
+{
+    return fd >= 0 && fd < FIO_MAX_FDS && read_buffers[fd] != NULL && read_buffers[fd]->start < read_buffers[fd]->end;
+}
+
+void append_bytes(struct InBuffer *in, void *data, int size)
+{
+    if(in->size + size > in->capacity)
+    {
+        int capacity = (in->capacity > 0) ? in->capacity : FIO_BUFFER_SIZE;
+        while(capacity < in->size + size)
+            capacity *= 2;
+        in->data = realloc(in->data, capacity);
+        in->capacity = capacity;
+    }
+    memcpy(in->data + in->size, data, size);
+    in->size += size;
+}
+
+void free_inbuffer(struct InBuffer *in)
+{
+    free(in->data);
+    in->data = NULL;
+    in->size = in->capacity = in->pos = 0;
+}
+
+void fio_close(int fd)
+{
+    if(fd >= 0 && fd < FIO_MAX_FDS && read_buffers[fd] != NULL)
+    {
+        free(read_buffers[fd]);
+        read_buffers[fd] = NULL;
+    }
+    close(fd);
+}
+
+int fill_inbuffer(int fd, struct InBuffer *in)
+{
+    if(in->capacity - in->size < FIO_BUFFER_SIZE)
+    {
+        int capacity = (in->capacity > 0) ? in->capacity : FIO_BUFFER_SIZE;
+        while(capacity - in->size < FIO_BUFFER_SIZE)
+            capacity *= 2;
+        in->data = realloc(in->data, capacity);
+        in->capacity = capacity;
+    }
+    int n = read(fd, in->data + in->size, in->capacity - in->size);
+    if(n > 0)
+        in->size += n;
+    return n;
+}
+
+bool take_int(struct InBuffer *in, int *value)
+{
+    return unpack_int(in, value);
+}
+
+bool take_string(struct InBuffer *in, char *str, int max_size)
+{
+#ifdef FIO_BYTEWISE
+    // the string runs up to its null terminator:
+    char *end = memchr(in->data + in->pos, '\0', in->size - in->pos);
+    if(end == NULL)
+        return false;
+    int length = end - (in->data + in->pos);
+    int keep = (length < max_size) ? length : max_size - 1;
+    memcpy(str, in->data + in->pos, keep);
+    str[keep] = '\0';
+    in->pos += length + 1;
+    return true;
+#else
+    // the string is framed just like a packed one, so only
+    // the all-or-nothing part needs adding:
+    int start = in->pos;
+    if(unpack_string(in, str, max_size))
+        return true;
+    in->pos = start;
+    return false;
+#endif
+}
+
+bool take_chars(struct InBuffer *in, char **chars, int *length)
+{
+#ifdef FIO_BYTEWISE
+    char *end = memchr(in->data + in->pos, '\0', in->size - in->pos);
+    if(end == NULL)
+        return false;
+    *chars = in->data + in->pos;
+    *length = end - *chars;
+    in->pos += *length + 1;
+    return true;
+#else
+    // (unpack_chars is all-or-nothing already)
+    return unpack_chars(in, chars, length);
+#endif
+}
+
+void compact_inbuffer(struct InBuffer *in)
+{
+    if(in->pos == 0)
+        return;
+    memmove(in->data, in->data + in->pos, in->size - in->pos);
+    in->size -= in->pos;
+    in->pos = 0;
+}
+
+void queue_record(struct OutQueue *q, char *data, int size)
+{
+    reserve(&(q->records), sizeof(int) + size);
+    memcpy(q->records.data + q->records.size, &size, sizeof(int));
+    memcpy(q->records.data + q->records.size + sizeof(int), data, size);
+    q->records.size += sizeof(int) + size;
+}
+
+void queue_frame_pieces(struct OutQueue *q, struct OutBuffer *buf, int max_size, int fragment_opcode)
+{
+    struct FrameHeader hdr;
+    memcpy(&hdr, buf->data, sizeof(hdr));
+    char *payload = buf->data + sizeof(hdr);
+    int length = hdr.length;
+    int piece_size = max_size - sizeof(hdr);
+    int sent = 0;
+    do {
+        struct FrameHeader piece_hdr = hdr;
+        piece_hdr.length = length - sent;
+        if(piece_hdr.length > piece_size)
+        {
+            piece_hdr.length = piece_size;
+            piece_hdr.opcode = fragment_opcode;
+        }
+        // each record is a header and its piece, written in place:
+        int size = sizeof(piece_hdr) + piece_hdr.length;
+        reserve(&(q->records), sizeof(int) + size);
+        char *record = q->records.data + q->records.size;
+        memcpy(record, &size, sizeof(int));
+        memcpy(record + sizeof(int), &piece_hdr, sizeof(piece_hdr));
+        memcpy(record + sizeof(int) + sizeof(piece_hdr), payload + sent, piece_hdr.length);
+        q->records.size += sizeof(int) + size;
+        sent += piece_hdr.length;
+    } while(sent < length);
+    buf->size = 0;
+}
+
+int flush_queue(int fd, struct OutQueue *q, bool packets, bool wait)
+{
+    while(q->pos < q->records.size)
+    {
+        int size;
+        memcpy(&size, q->records.data + q->pos, sizeof(int));
+        char *record = q->records.data + q->pos + sizeof(int);
+        int n = write(fd, record + q->written, size - q->written);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if(!wait)
+                break;
+            // hang on until the fd can take more:
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if(n < 0 || (packets && n != size))
+            return -1;
+        q->written += n;
+        if(q->written == size)
+        {
+            q->pos += sizeof(int) + size;
+            q->written = 0;
+        }
+    }
+    // move what is left up to the front once it has shrunk enough:
+    if(q->pos == q->records.size)
+        q->pos = q->records.size = 0;
+    else if(q->pos > q->records.size / 2)
+    {
+        memmove(q->records.data, q->records.data + q->pos, q->records.size - q->pos);
+        q->records.size -= q->pos;
+        q->pos = 0;
+    }
+    return queued_bytes(q);
+}
+
+int queued_bytes(struct OutQueue *q)
+{
+    return q->records.size - q->pos - q->written;
+}
+
+void clear_queue(struct OutQueue *q)
+{
+    q->records.size = 0;
+    q->pos = 0;
+    q->written = 0;
+}
@@ -1,6 +1,24 @@
 #ifndef FIO_H_INCLUDED
 #define FIO_H_INCLUDED
 
+#include <stdbool.h>
+
+/* ---------------------- STRING ENCODING ON THE WIRE ----------------- *
+ * By default, strings are "framed": each one goes out as an int length *
+ * prefix followed by the characters themselves (no null terminator),   *
+ * in a single write() call. Reads are served out of a per-fd buffer    *
+ * so that a whole batch of ints and strings costs one read() call.     *
+ *                                                                      *
+ * Compiling with -DFIO_BYTEWISE switches back to the original          *
+ * encoding: null-terminated strings written and read one character at  *
+ * a time. Servers and clients must be compiled the same way!           */
+
+/* size of the user-space read buffer kept for each file descriptor     */
+#define FIO_BUFFER_SIZE 4096
+
+/* file descriptors at or above this number are read without buffering */
+#define FIO_MAX_FDS 1024
+
 void write_string(int fd, char *str);
 
 void read_string(int fd, char *str, int max_size);
@@ -9,4 +27,190 @@ void write_int(int fd, int *int_to_write);
 
 void read_int(int fd, int *int_to_read);
 
-#endif
\ No newline at end of file
+/* ==== OUTGOING BUFFERS ------------------------------------------ *
+ * an OutBuffer collects ints and strings (encoded exactly as       *
+ * write_int and write_string would send them) so that a whole      *
+ * multi-part response can go out in a single write() call          */
+struct OutBuffer
+{
+    char *data;
+    int size;
+    int capacity;
+};
+
+/* this function appends an int to the buffer, growing it as needed */
+void buffer_int(struct OutBuffer *buf, int *int_to_write);
+
+/* this function appends a string to the buffer, growing it as      *
+ * needed                                                           */
+void buffer_string(struct OutBuffer *buf, char *str);
+
+/* this function does the same for 'length' characters that need   *
+ * not be null-terminated                                           */
+void buffer_chars(struct OutBuffer *buf, char *chars, int length);
+
+/* this function sends everything in the buffer with one write()    *
+ * and empties it; the buffer's memory is kept for re-use           */
+void write_buffer(int fd, struct OutBuffer *buf);
+
+/* this function releases the memory held by a buffer               */
+void free_buffer(struct OutBuffer *buf);
+
+/* ==== FRAMES ---------------------------------------------------- *
+ * a frame is a fixed-size header followed by 'length' bytes of     *
+ * packed payload. Inside a payload, ints are packed as raw native  *
+ * ints and strings as an int length followed by the characters     *
+ * (whether or not FIO_BYTEWISE is set). Every header starts with   *
+ * FRAME_MAGIC so that a reader can tell a frame apart from the     *
+ * bare ints and strings of the original protocol.                  */
+#define FRAME_MAGIC 0x59414D53
+
+struct FrameHeader
+{
+    int magic;
+    int opcode;
+    int PID;
+    int length;
+    int request_id;
+};
+
+/* an InBuffer holds a payload that has been read in and is being   *
+ * unpacked one field at a time, starting at 'pos'                  */
+struct InBuffer
+{
+    char *data;
+    int size;
+    int capacity;
+    int pos;
+};
+
+/* this function appends a frame header to the buffer and returns   *
+ * its offset; the payload is then packed in after it and the       *
+ * length is filled in by end_frame                                 */
+int begin_frame(struct OutBuffer *buf, int opcode, int PID, int request_id);
+
+/* this function fills in the payload length of the frame that was  *
+ * started at 'frame_start'                                         */
+void end_frame(struct OutBuffer *buf, int frame_start);
+
+/* these functions pack fields into a frame payload                 */
+void pack_int(struct OutBuffer *buf, int value);
+void pack_string(struct OutBuffer *buf, char *str);
+void pack_bytes(struct OutBuffer *buf, void *data, int size);
+/* (a string given as 'length' characters, not null-terminated)     */
+void pack_chars(struct OutBuffer *buf, char *chars, int length);
+
+/* these functions unpack fields from a frame payload; they return  *
+ * false if the payload is too short to hold the field              */
+bool unpack_int(struct InBuffer *in, int *value);
+bool unpack_string(struct InBuffer *in, char *str, int max_size);
+
+/* this function unpacks a string of any length without copying it: *
+ * 'chars' is pointed at its characters inside the payload (they    *
+ * are not null-terminated) and 'length' set to how many there are  */
+bool unpack_chars(struct InBuffer *in, char **chars, int *length);
+
+/* this function writes exactly 'size' bytes with one write() call  *
+ * (more only if the kernel takes them in pieces)                   */
+void write_bytes(int fd, void *src, int size);
+
+/* this function reads exactly 'size' bytes (through the fd's read  *
+ * buffer) and returns false if the fd hit end-of-file first        */
+bool read_bytes(int fd, void *dst, int size);
+
+/* this function reads a 'length'-byte payload into 'in', growing   *
+ * it as needed, and rewinds it for unpacking                       */
+bool read_payload(int fd, int length, struct InBuffer *in);
+
+/* this function reads a whole frame: header first, then payload    */
+bool read_frame(int fd, struct FrameHeader *hdr, struct InBuffer *in);
+
+/* this function reads a whole frame from a packet socket (such as  *
+ * SOCK_SEQPACKET), where each frame arrives as exactly one packet; *
+ * it returns false on end-of-file or if the packet is malformed,   *
+ * and also (with errno set to EAGAIN) if 'wait' is false and no    *
+ * packet is ready yet                                              */
+bool read_packet(int fd, struct FrameHeader *hdr, struct InBuffer *in, bool wait);
+
+/* this function sends the frame held in 'buf' (header at offset 0) *
+ * as one or more frames of at most 'max_size' bytes each, each one *
+ * with a single write; all but the last piece are sent with their  *
+ * opcode changed to 'fragment_opcode'. The buffer is emptied.      */
+void write_frame_pieces(int fd, struct OutBuffer *buf, int max_size, int fragment_opcode);
+
+/* this function tells whether the fd's read buffer is holding      *
+ * bytes that have not been handed out yet (which poll() and        *
+ * friends cannot see)                                              */
+bool fio_buffered(int fd);
+
+/* this function adds raw bytes to the end of an InBuffer, growing  *
+ * it as needed; it is used to stitch fragmented payloads together  */
+void append_bytes(struct InBuffer *in, void *data, int size);
+
+/* this function releases the memory held by an InBuffer            */
+void free_inbuffer(struct InBuffer *in);
+
+/* ==== NON-BLOCKING INPUT ---------------------------------------- *
+ * an event loop cannot wait around for a whole request to arrive,  *
+ * so it reads whatever an fd has ready into an InBuffer and only    *
+ * takes fields out once they are complete                          */
+
+/* this function appends whatever the fd has ready to the end of    *
+ * the InBuffer; it returns the number of bytes read, 0 at          *
+ * end-of-file, or -1 if nothing was ready (or on error)            */
+int fill_inbuffer(int fd, struct InBuffer *in);
+
+/* these functions take an int or a string, encoded just as         *
+ * write_int and write_string send them, from the InBuffer; if the  *
+ * whole field has not arrived yet they return false and leave the  *
+ * InBuffer as it was                                               */
+bool take_int(struct InBuffer *in, int *value);
+bool take_string(struct InBuffer *in, char *str, int max_size);
+
+/* this function takes a string of any length in the same way, but  *
+ * like unpack_chars leaves it where it is in the InBuffer (so it   *
+ * only stays put until the InBuffer is next filled or compacted)   */
+bool take_chars(struct InBuffer *in, char **chars, int *length);
+
+/* this function throws away the bytes that have already been taken *
+ * out of an InBuffer                                               */
+void compact_inbuffer(struct InBuffer *in);
+
+/* ==== OUTBOUND QUEUES ------------------------------------------- *
+ * an OutQueue holds output that a non-blocking fd would not take   *
+ * yet, as a list of records (each one an int length followed by    *
+ * the bytes); records go out in order, and on a packet socket each *
+ * record goes out whole, as exactly one packet                     */
+struct OutQueue
+{
+    struct OutBuffer records;
+    int pos;     // offset of the first record not yet fully written
+    int written; // how much of that record has gone out already
+};
+
+/* this function adds a record to the end of the queue              */
+void queue_record(struct OutQueue *q, char *data, int size);
+
+/* this function queues the frame held in 'buf' just as             *
+ * write_frame_pieces would send it, one record per piece, and      *
+ * empties the buffer                                               */
+void queue_frame_pieces(struct OutQueue *q, struct OutBuffer *buf, int max_size, int fragment_opcode);
+
+/* this function writes as much of the queue as the fd will take    *
+ * (all of it, if 'wait' is set); 'packets' says whether the fd is  *
+ * a packet socket. It returns the number of bytes still queued, or *
+ * -1 if the fd failed                                              */
+int flush_queue(int fd, struct OutQueue *q, bool packets, bool wait);
+
+/* this function returns the number of bytes still queued           */
+int queued_bytes(struct OutQueue *q);
+
+/* this function throws away everything in the queue; its memory    *
+ * is kept for re-use                                               */
+void clear_queue(struct OutQueue *q);
+
+/* closes a file descriptor and throws away anything still sitting in   *
+ * its read buffer, so that a re-used fd number starts out clean        */
+void fio_close(int fd);
+
+#endif
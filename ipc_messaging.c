@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
 
 /* function to interpret priority code as a string                  */
 void pri_str(char * priority_string, int priority_code)
@@ -59,286 +61,1014 @@ void typ_str(char * type_string, int type_code)
     }
 }
 
-/* this function creates a new mailbox, adding it as a node after   *
- * the node specified by 'prev'                                     */
-struct Mailbox * new_mbox(char * mbox_name, struct Mailbox * prev)
+/* this function hashes a mailbox name (FNV-1a)                     */
+unsigned int name_hash(char * name)
+{
+    unsigned int hash = 2166136261u;
+    for(; *name != '\0'; name++)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash;
+}
+
+/* the names are kept by id in chunks that never move: chunk k holds *
+ * NAME_CHUNK << k of them, starting at id NAME_CHUNK * (2^k - 1),    *
+ * so NAME_CHUNKS chunks are room enough for any int id              */
+#define NAME_CHUNK 64
+#define NAME_CHUNKS 26
+
+/* the interning table: the names by id, their hashes by id, and an *
+ * open-addressed index from hash to id + 1 (0 marks an empty slot); *
+ * the mutex keeps threads that look names up or add them out of    *
+ * each other's way, but name_of does without it                    */
+static struct
+{
+    char **chunks[NAME_CHUNKS];
+    unsigned int *hashes;
+    int count;
+    int capacity;
+    int *slots;
+    int size;
+    pthread_mutex_t lock;
+} interned = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* this function returns where the name with a given id is kept     */
+static char ** name_entry(int id, bool add)
+{
+    int k = 31 - __builtin_clz(id / NAME_CHUNK + 1);
+    // (name_of may be reading the chunk pointer as it is stored)
+    char **chunk = __atomic_load_n(&(interned.chunks[k]), __ATOMIC_ACQUIRE);
+    if(chunk == NULL && add)
+    {
+        chunk = malloc((NAME_CHUNK << k) * sizeof(char *));
+        __atomic_store_n(&(interned.chunks[k]), chunk, __ATOMIC_RELEASE);
+    }
+    return chunk + (id - NAME_CHUNK * ((1 << k) - 1));
+}
+
+/* this function returns the index slot that holds a name's id + 1, *
+ * or the empty slot where it would go (the index must not be empty, *
+ * and the caller must hold the lock)                               */
+static int find_slot(char * name, unsigned int hash)
+{
+    int i = hash & (interned.size - 1);
+    for(; interned.slots[i] != 0; i = (i + 1) & (interned.size - 1))
+    {
+        int id = interned.slots[i] - 1;
+        if(interned.hashes[id] == hash && strcmp(*name_entry(id, false), name) == 0)
+            break;
+    }
+    return i;
+}
+
+int find_name(char * name)
+{
+    unsigned int hash = name_hash(name);
+    int id = NO_NAME;
+    pthread_mutex_lock(&(interned.lock));
+    if(interned.size > 0)
+    {
+        int i = find_slot(name, hash);
+        if(interned.slots[i] != 0)
+            id = interned.slots[i] - 1;
+    }
+    pthread_mutex_unlock(&(interned.lock));
+    return id;
+}
+
+int intern_name(char * name)
+{
+    unsigned int hash = name_hash(name);
+    pthread_mutex_lock(&(interned.lock));
+    // keep the index no more than half full (ids do not change):
+    if(2 * (interned.count + 1) > interned.size)
+    {
+        int size = interned.size == 0 ? 64 : 2 * interned.size;
+        int *slots = calloc(size, sizeof(int));
+        for(int id = 0; id < interned.count; id++)
+        {
+            int i = interned.hashes[id] & (size - 1);
+            while(slots[i] != 0)
+                i = (i + 1) & (size - 1);
+            slots[i] = id + 1;
+        }
+        free(interned.slots);
+        interned.slots = slots;
+        interned.size = size;
+    }
+    int i = find_slot(name, hash);
+    if(interned.slots[i] != 0)
+    {
+        pthread_mutex_unlock(&(interned.lock));
+        return interned.slots[i] - 1;
+    }
+    // a new name, then:
+    if(interned.count == interned.capacity)
+    {
+        interned.capacity = interned.capacity == 0 ? 64 : 2 * interned.capacity;
+        interned.hashes = realloc(interned.hashes, interned.capacity * sizeof(unsigned int));
+    }
+    int id = interned.count++;
+    // (the text is in place before any other thread can see the id)
+    __atomic_store_n(name_entry(id, true), strdup(name), __ATOMIC_RELEASE);
+    interned.hashes[id] = hash;
+    interned.slots[i] = id + 1;
+    pthread_mutex_unlock(&(interned.lock));
+    return id;
+}
+
+/* this function returns the text of an interned name               */
+char * name_of(int id)
+{
+    // (neither the chunks nor the names in them ever move, so this
+    // needs no lock; see name_entry)
+    return __atomic_load_n(name_entry(id, false), __ATOMIC_ACQUIRE);
+}
+
+/* this function creates a new mailbox that is not in any table     */
+struct Mailbox * new_mbox(char * mbox_name)
 {
     // make space for a new mailbox:
     struct Mailbox * mbox = malloc(sizeof(struct Mailbox));
     // copy in the mailbox name:
     strcpy(mbox->mbox_name, mbox_name);
+    mbox->hash = name_hash(mbox_name);
     // this is a new mailbox so its message queue should be empty:
     mbox->first_msg = NULL;
-    // make sure the prev pointer works:
-    mbox->prev = prev;
-    // we always add to the end of the list, so
-    // next should be NULL:
-    mbox->next = NULL;
+    mbox->last_msg = NULL;
+    // (its sub-queues are only made when the first message comes in)
+    mbox->queues = NULL;
+    mbox->occupied = 0;
+    mbox->num_msgs = 0;
+    memset(mbox->counts, 0, sizeof(mbox->counts));
+    mbox->odd_msgs = 0;
+    mbox->senders = NULL;
+    mbox->sender_buckets = 0;
+    mbox->num_senders = 0;
+    mbox->next_seq = 0;
+    mbox->fetched = 0;
+    mbox->aged_at = 0;
+    // messages come out oldest first unless the mailbox asks otherwise:
+    mbox->delivery = DELIVERY_FIFO;
+    mbox->aging = 0;
+    // ...and nobody can be waiting on it yet:
+    mbox->first_waiter = NULL;
+    mbox->last_waiter = NULL;
+    mbox->last_multicast = 0;
+    mbox->ttl = 0;
+    mbox->fresh_since = 0;
+    mbox->expired = 0;
     // return the new mailbox:
     return mbox;
 }
 
-/* this function adds a new mailbox to the linked list whose head   *
- * is specified by 'head' and returns the length of the list as an  *
- * integer return value                                             */
-int add_mbox(struct Mailbox * head, char * mbox_name)
+/* a slot of an old table whose mailbox has been moved to the new   *
+ * one (a lookup carries on past it, but stops at an empty slot)    */
+static struct Mailbox moved_marker;
+#define MOVED (&moved_marker)
+
+/* a new table's size, and how many slots of the old table each     *
+ * call moves across while the table is growing                     */
+#define FIRST_TABLE_SIZE 64
+#define MOVE_STEP 8
+
+/* this function sets up an empty mailbox table                     */
+void init_mbox_table(struct MailboxTable * table)
+{
+    table->size = FIRST_TABLE_SIZE;
+    table->slots = calloc(table->size, sizeof(struct Mailbox *));
+    table->count = 0;
+    table->old_slots = NULL;
+    table->old_size = 0;
+    table->next_old = 0;
+}
+
+/* this function puts a mailbox in the first free slot for its hash */
+static void place_mbox(struct Mailbox ** slots, int size, struct Mailbox * mbox)
 {
-    // initialize list length to one (the head):
-    int length = 1;
-    // start at the head of the list and find the tail:
-    struct Mailbox * tail = head;
-    while(tail->next != NULL)
+    int i = mbox->hash & (size - 1);
+    while(slots[i] != NULL)
+        i = (i + 1) & (size - 1);
+    slots[i] = mbox;
+}
+
+/* this function looks for a mailbox in one set of slots            */
+static struct Mailbox * search(struct Mailbox ** slots, int size, char * mbox_name, unsigned int hash)
+{
+    for(int i = hash & (size - 1); slots[i] != NULL; i = (i + 1) & (size - 1))
+        if(slots[i] != MOVED && slots[i]->hash == hash && strcmp(slots[i]->mbox_name, mbox_name) == 0)
+            return slots[i];
+    return NULL;
+}
+
+/* this function moves up to 'step' more slots' worth of mailboxes  *
+ * out of the old table, if the table is growing                    */
+static void move_some(struct MailboxTable * table, int step)
+{
+    if(table->old_slots == NULL)
+        return;
+    for(; step > 0 && table->next_old < table->old_size; step--, table->next_old++)
     {
-        tail = tail->next;
-        length++;
+        struct Mailbox *mbox = table->old_slots[table->next_old];
+        if(mbox != NULL)
+        {
+            place_mbox(table->slots, table->size, mbox);
+            table->old_slots[table->next_old] = MOVED;
+        }
+    }
+    // once everything has moved, the old table can go:
+    if(table->next_old == table->old_size)
+    {
+        free(table->old_slots);
+        table->old_slots = NULL;
+        table->old_size = 0;
+        table->next_old = 0;
     }
-    // now we are at the end of the list, so add the new mbox:
-    tail->next = new_mbox(mbox_name, tail);
-    length++;
-    return length;
 }
 
-/* this function returns the list position of a named mailbox if it *
- * is in the list, or -1 if it is not                               */
-int find_mbox(struct Mailbox * head, char * mbox_name)
+/* this function adds a new mailbox to a table (the name must not   *
+ * be in the table already); it returns the new mailbox             */
+struct Mailbox * add_mbox(struct MailboxTable * table, char * mbox_name)
 {
-    // start the position off at 0 and the current node at the head of the list:
-    int position = 0;
-    struct Mailbox * current = head;
-    // move one position at at time until we run out of list or find the name:
-    while(current != NULL && strcmp(current->mbox_name, mbox_name) != 0)
+    // once the table would be more than half full, start moving into
+    // one twice the size (after finishing any move still going on):
+    if(2 * (table->count + 1) > table->size)
     {
-        current = current->next;
-        position++;
+        move_some(table, table->old_size);
+        table->old_slots = table->slots;
+        table->old_size = table->size;
+        table->next_old = 0;
+        table->size *= 2;
+        table->slots = calloc(table->size, sizeof(struct Mailbox *));
     }
-    // report -1 if we reached the end of the list without finding the name,
-    // else report the list position:
-    if(current == NULL)
-        return -1;
-    else
-        return position;
+    struct Mailbox *mbox = new_mbox(mbox_name);
+    place_mbox(table->slots, table->size, mbox);
+    table->count++;
+    move_some(table, MOVE_STEP);
+    return mbox;
 }
 
-/* this function returns the mailbox with the given mailbox nare,   *
- * or NULL if the mailbox name does not exist                       */
-struct Mailbox * get_mbox(struct Mailbox * head, char * mbox_name)
+/* this function returns the mailbox with the given mailbox name    *
+ * and hash, or NULL if the mailbox name does not exist             */
+struct Mailbox * get_mbox(struct MailboxTable * table, char * mbox_name, unsigned int hash)
 {
-    // start off at the head of the list:
-    struct Mailbox * current = head;
-    // advance one node at a time until position is reached
-    // or we run out of list nodes:
-    while(current != NULL && strcmp(current->mbox_name, mbox_name) != 0)
+    move_some(table, MOVE_STEP);
+    // a mailbox that has not been moved yet is still in the old table:
+    struct Mailbox *mbox = search(table->slots, table->size, mbox_name, hash);
+    if(mbox == NULL && table->old_slots != NULL)
+        mbox = search(table->old_slots, table->old_size, mbox_name, hash);
+    return mbox;
+}
+
+/* the cell for a priority and type: the index of their sub-queue,  *
+ * of their counts, and of their bit in 'occupied'                  */
+#define CELL(priority, type) (((priority) & (NUM_PRIORITIES - 1)) * NUM_TYPES + ((type) & (NUM_TYPES - 1)))
+
+/* whether a code is one that has a cell of its own                  */
+#define OCTAL(code) ((code) >= 0 && (code) < 8)
+
+/* this function returns the sub-queue for a priority and type (the *
+ * mailbox must have its sub-queues already)                        */
+static struct MessageQueue * sub_queue(struct Mailbox * mbox, int priority, int type)
+{
+    return &(mbox->queues[CELL(priority, type)]);
+}
+
+/* the bit for a priority and type's sub-queue in 'occupied'         */
+#define BUCKET_BIT(priority, type) (1ULL << CELL(priority, type))
+
+/* this function returns a mailbox's queue of messages from a given  *
+ * sender, or NULL if there are none                                */
+static struct SenderQueue * find_sender(struct Mailbox * mbox, int sender)
+{
+    if(mbox->senders == NULL)
+        return NULL;
+    struct SenderQueue *from = mbox->senders[sender % mbox->sender_buckets];
+    while(from != NULL && from->sender_id != sender)
+        from = from->next;
+    return from;
+}
+
+/* this function returns a mailbox's queue of messages from a given  *
+ * sender, making an empty one if there is none yet                 */
+static struct SenderQueue * add_sender(struct Mailbox * mbox, int sender)
+{
+    struct SenderQueue *from = find_sender(mbox, sender);
+    if(from != NULL)
+        return from;
+    // keep the chains short by doubling the table as it fills up:
+    if(mbox->num_senders >= mbox->sender_buckets)
     {
-        current = current->next;
+        int buckets = mbox->sender_buckets == 0 ? 8 : 2 * mbox->sender_buckets;
+        struct SenderQueue **table = calloc(buckets, sizeof(struct SenderQueue *));
+        for(int i = 0; i < mbox->sender_buckets; i++)
+            while(mbox->senders[i] != NULL)
+            {
+                struct SenderQueue *moving = mbox->senders[i];
+                mbox->senders[i] = moving->next;
+                moving->next = table[moving->sender_id % buckets];
+                table[moving->sender_id % buckets] = moving;
+            }
+        free(mbox->senders);
+        mbox->senders = table;
+        mbox->sender_buckets = buckets;
     }
-    // return value will now be correct -- either the node with the given 
-    // mailbox name or the value NULL if not found:
-    return current;
+    from = calloc(1, sizeof(struct SenderQueue));
+    from->sender_id = sender;
+    int bucket = sender % mbox->sender_buckets;
+    from->next = mbox->senders[bucket];
+    mbox->senders[bucket] = from;
+    mbox->num_senders++;
+    return from;
 }
 
-/* this function returns the mailbox at the given list position,    *
- * or NULL if the list does not contain that position index         */
-struct Mailbox * get_mbox_at(struct Mailbox * head, int list_posn)
+/* this function throws away a sender queue that has emptied         */
+static void drop_sender(struct Mailbox * mbox, struct SenderQueue * from)
 {
-    // start off at the head of the list and position 0:
-    struct Mailbox * current = head;
-    int position = 0;
-    // advance one node at a time until position is reached
-    // or we run out of list nodes:
-    while(current != NULL && position < list_posn)
+    struct SenderQueue **link = &(mbox->senders[from->sender_id % mbox->sender_buckets]);
+    while(*link != from)
+        link = &((*link)->next);
+    *link = from->next;
+    free(from);
+    mbox->num_senders--;
+}
+
+/* this function tells whether a message matches a RECV or CHECK     */
+static bool matches(struct Message * msg, int priority, int type, int sender)
+{
+    // P = priority match, T = type match, S = sender match
+    bool P = (priority == PRIORITY_ALL || msg->priority == priority);
+    bool T = (type == TYPE_ALL || msg->type == type);
+    bool S = (sender == ANY_SENDER || sender == msg->sender_id);
+    return P && T && S;
+}
+
+/* this function tells whether a message is still within its         *
+ * mailbox's TTL (as of the last expire_first_message), since a     *
+ * stale one that has not been thrown out yet must not be counted   *
+ * or delivered either                                              */
+static bool fresh(struct Mailbox * mbox, struct Message * msg)
+{
+    return msg->arrived >= mbox->fresh_since;
+}
+
+/* this function looks through the sub-queues of priority levels     *
+ * p_lo to p_hi and types t_lo to t_hi for the oldest message that  *
+ * matches; if 'count' is not NULL it also counts every match       */
+static struct Message * scan_sub_queues(struct Mailbox * mbox, int p_lo, int p_hi, int t_lo, int t_hi, int priority, int type, int sender, int *count)
+{
+    struct Message *first = NULL;
+    // the first match in each sub-queue is a candidate, and the one
+    // that arrived earliest wins:
+    for(int p = p_lo; p <= p_hi; p++)
+        for(int t = t_lo; t <= t_hi; t++)
+        {
+            struct Message *current = sub_queue(mbox, p, t)->first;
+            for(; current != NULL; current = current->next_like)
+                if(fresh(mbox, current) && matches(current, priority, type, sender))
+                {
+                    if(first == NULL || current->seq < first->seq)
+                        first = current;
+                    if(count == NULL)
+                        break;
+                    (*count)++;
+                }
+        }
+    return first;
+}
+
+/* this function finds the first message of a given priority and     *
+ * type from a given sender, or else NULL; if 'count' is not NULL it *
+ * also counts all of the messages that match                       */
+static struct Message * find_first(struct Mailbox * mbox, int priority, int type, int sender, int *count)
+{
+    struct Message *first = NULL;
+    if(count != NULL)
+        *count = 0;
+    if(mbox->first_msg == NULL)
+        return NULL;
+    if(sender != ANY_SENDER)
     {
-        current = current->next;
-        position++;
+        // only the sender's own messages can match, and they are
+        // already in order:
+        struct SenderQueue *from = find_sender(mbox, sender);
+        struct Message *current = (from == NULL) ? NULL : from->first;
+        for(; current != NULL; current = current->next_from)
+            if(fresh(mbox, current) && matches(current, priority, type, ANY_SENDER))
+            {
+                if(first == NULL)
+                    first = current;
+                if(count == NULL)
+                    break;
+                (*count)++;
+            }
+        return first;
     }
-    // return value will now be either the node at the given list
-    // position or the value NULL if we ran out of nodes:
-    return current;
+    if(priority == PRIORITY_ALL && type == TYPE_ALL)
+    {
+        // every sub-queue could match, so go through the whole queue
+        // (which already has them all in order):
+        for(struct Message *current = mbox->first_msg; current != NULL; current = current->next)
+            if(fresh(mbox, current) && matches(current, priority, type, sender))
+            {
+                if(first == NULL)
+                    first = current;
+                if(count == NULL)
+                    break;
+                (*count)++;
+            }
+        return first;
+    }
+    // otherwise only one row or column of sub-queues can match (or just
+    // one sub-queue, if both priority and type are given):
+    int p_lo = 0, p_hi = NUM_PRIORITIES - 1, t_lo = 0, t_hi = NUM_TYPES - 1;
+    if(priority != PRIORITY_ALL)
+        p_lo = p_hi = priority & (NUM_PRIORITIES - 1);
+    if(type != TYPE_ALL)
+        t_lo = t_hi = type & (NUM_TYPES - 1);
+    return scan_sub_queues(mbox, p_lo, p_hi, t_lo, t_hi, priority, type, sender, count);
+}
+
+/* the priority level whose sub-queues a message is in               */
+#define LEVEL(msg) ((msg)->priority & (NUM_PRIORITIES - 1))
+
+/* the lowest bit of each priority level's byte in 'occupied'        */
+#define LEVEL_BITS 0x0101010101010101ULL
+
+/* this function returns a bitmap with the lowest bit of priority    *
+ * level p's byte set if the level has messages of the given type    */
+static uint64_t levels_with(uint64_t occupied, int type)
+{
+    if(type != TYPE_ALL)
+        return (occupied >> (type & (NUM_TYPES - 1))) & LEVEL_BITS;
+    // fold each byte's 8 bits down into its lowest one:
+    occupied |= occupied >> 4;
+    occupied |= occupied >> 2;
+    occupied |= occupied >> 1;
+    return occupied & LEVEL_BITS;
+}
+
+/* this function finds the first message of a given type from a      *
+ * given sender in priority order, or else NULL                     */
+static struct Message * find_top(struct Mailbox * mbox, int type, int sender)
+{
+    if(mbox->first_msg == NULL)
+        return NULL;
+    // a message that has been passed over often enough goes first
+    // (it can only be the oldest match, if any is); a backlog that
+    // is all old only gets every 'aging'th turn, though:
+    if(mbox->aging > 0)
+    {
+        struct Message *oldest = find_first(mbox, PRIORITY_ALL, type, sender, NULL);
+        unsigned long since = oldest == NULL ? 0 : oldest->fetched_before;
+        if(since < mbox->aged_at)
+            since = mbox->aged_at;
+        if(oldest != NULL && mbox->fetched - since >= (unsigned long)mbox->aging)
+        {
+            mbox->aged_at = mbox->fetched;
+            return oldest;
+        }
+    }
+    if(sender != ANY_SENDER)
+    {
+        // just pick the highest of the sender's own messages:
+        struct SenderQueue *from = find_sender(mbox, sender);
+        struct Message *top = NULL;
+        struct Message *current = (from == NULL) ? NULL : from->first;
+        for(; current != NULL; current = current->next_from)
+            if(fresh(mbox, current) && matches(current, PRIORITY_ALL, type, ANY_SENDER) && (top == NULL || LEVEL(current) > LEVEL(top)))
+                top = current;
+        return top;
+    }
+    int t_lo = 0, t_hi = NUM_TYPES - 1;
+    if(type != TYPE_ALL)
+        t_lo = t_hi = type & (NUM_TYPES - 1);
+    // go down the levels that have anything, highest first (the first
+    // of them has the message):
+    uint64_t levels = levels_with(mbox->occupied, type);
+    while(levels != 0)
+    {
+        int top = (63 - __builtin_clzll(levels)) / NUM_TYPES;
+        struct Message *msg = scan_sub_queues(mbox, top, top, t_lo, t_hi, PRIORITY_ALL, type, sender, NULL);
+        if(msg != NULL)
+            return msg;
+        levels &= ~(1ULL << (top * NUM_TYPES));
+    }
+    return NULL;
+}
+
+/* this function adds up the cells of a count matrix that match a    *
+ * priority and type (either of which may be ALL)                   */
+static int sum_cells(int * counts, int total, int priority, int type)
+{
+    if(priority == PRIORITY_ALL && type == TYPE_ALL)
+        return total;
+    if(priority != PRIORITY_ALL && type != TYPE_ALL)
+        return counts[CELL(priority, type)];
+    // otherwise it is one row or one column:
+    int sum = 0;
+    if(priority == PRIORITY_ALL)
+        for(int p = 0; p < NUM_PRIORITIES; p++)
+            sum += counts[CELL(p, type)];
+    else
+        for(int t = 0; t < NUM_TYPES; t++)
+            sum += counts[CELL(priority, t)];
+    return sum;
+}
+
+struct Mailbox * next_mbox(struct MailboxTable * table, int * pos)
+{
+    // the new table's slots come first, then the old one's:
+    for(; *pos < table->size + table->old_size; (*pos)++)
+    {
+        struct Mailbox *mbox = (*pos < table->size) ? table->slots[*pos] : table->old_slots[*pos - table->size];
+        if(mbox != NULL && mbox != MOVED)
+        {
+            (*pos)++;
+            return mbox;
+        }
+    }
+    return NULL;
 }
 
 /* this function determines how many messages of the given priority *
- * and type are waiting in a mailbox's message queue                */
-int num_waiting_msgs(struct Mailbox * mbox, int priority, int type, char *sender)
-{
-    // start at head of queue with zero messages:
-    struct Message * current = mbox->first_msg;
-    int count = 0;
-    // traverse the list one node at a time until we reach the end,
-    // noting one more waiting message each time:
-    while(current != NULL)
+ * and type from the given sender (an interned name, or ANY_SENDER) *
+ * are waiting in a mailbox's message queue                         */
+int num_waiting_msgs(struct Mailbox * mbox, int priority, int type, int sender)
+{
+    // a cell lumps together the codes with the same low 3 bits, so if
+    // there are any others about, the messages have to be counted; so
+    // do they while stale ones are still waiting to be thrown out:
+    bool wildcards = (priority == PRIORITY_ALL && type == TYPE_ALL);
+    bool octal = (priority == PRIORITY_ALL || OCTAL(priority)) && (type == TYPE_ALL || OCTAL(type));
+    bool stale = (mbox->first_msg != NULL && !fresh(mbox, mbox->first_msg));
+    if(stale || (!wildcards && (!octal || mbox->odd_msgs > 0)))
     {
-        // P = priority match, T = type match, S = sender match
-        bool P = (priority == PRIORITY_ALL || current->priority == priority);
-        bool T = (type == TYPE_ALL || current->type == type);
-        bool S = (strcmp(sender, "*") == 0 || strcmp(sender, current->sender_mbox) == 0);
-        if( P && T && S )
-            count++;
-        current = current->next;
+        int count;
+        find_first(mbox, priority, type, sender, &count);
+        return count;
     }
-    // 'count' should now be the correct number of messages, or
-    // zero if the message queue is NULL:
-    return count;
+    if(sender == ANY_SENDER)
+        return sum_cells(mbox->counts, mbox->num_msgs, priority, type);
+    struct SenderQueue *from = find_sender(mbox, sender);
+    return (from == NULL) ? 0 : sum_cells(from->counts, from->num_msgs, priority, type);
+}
+
+/* this function takes a message out of its mailbox                */
+static void remove_message(struct Mailbox * mbox, struct Message * current)
+{
+    // take it out of the mailbox's queue...
+    if(current->prev == NULL)
+        mbox->first_msg = current->next;
+    else
+        current->prev->next = current->next;
+    if(current->next == NULL)
+        mbox->last_msg = current->prev;
+    else
+        current->next->prev = current->prev;
+    // ...and out of its sub-queue...
+    struct MessageQueue *queue = sub_queue(mbox, current->priority, current->type);
+    if(current->prev_like == NULL)
+        queue->first = current->next_like;
+    else
+        current->prev_like->next_like = current->next_like;
+    if(current->next_like == NULL)
+        queue->last = current->prev_like;
+    else
+        current->next_like->prev_like = current->prev_like;
+    if(queue->first == NULL)
+        mbox->occupied &= ~BUCKET_BIT(current->priority, current->type);
+    int cell = CELL(current->priority, current->type);
+    mbox->num_msgs--;
+    mbox->counts[cell]--;
+    if(!OCTAL(current->priority) || !OCTAL(current->type))
+        mbox->odd_msgs--;
+    // ...and out of its sender's queue:
+    struct SenderQueue *from = current->from;
+    from->num_msgs--;
+    from->counts[cell]--;
+    if(current->prev_from == NULL)
+        from->first = current->next_from;
+    else
+        current->prev_from->next_from = current->next_from;
+    if(current->next_from == NULL)
+        from->last = current->prev_from;
+    else
+        current->next_from->prev_from = current->prev_from;
+    if(from->first == NULL)
+        drop_sender(mbox, from);
+    current->prev = current->next = current->prev_like = current->next_like = NULL;
+    current->from = NULL;
+    current->prev_from = current->next_from = NULL;
 }
 
 /* this function retrieves the first waiting message of a given     *
  * priority and type then removes that message from the list        */
-struct Message * fetch_first_message(struct Mailbox * mbox, int priority, int type, char *sender)
+struct Message * fetch_first_message(struct Mailbox * mbox, int priority, int type, int sender)
 {
-    // start with the first message in the list
-    struct Message *current = mbox->first_msg;
-    if (current == NULL)
+    struct Message *current;
+    if(mbox->delivery == DELIVERY_PRIORITY && priority == PRIORITY_ALL)
+        current = find_top(mbox, type, sender);
+    else
+        current = find_first(mbox, priority, type, sender, NULL);
+    if(current == NULL)
     {
-        // if we get here, the mailbox is empty, 
+        // if we get here, no qualifying message was found, 
         // so just return the NULL value
         return current;
     }
-    // P = priority match, T = type match, S = sender match
-    bool P = (priority == PRIORITY_ALL || current->priority == priority);
-    bool T = (type == TYPE_ALL || current->type == type);
-    bool S = (strcmp(sender, "*") == 0 || strcmp(sender, current->sender_mbox) == 0);
-    // while we are not at a NULL record, 
-    // and one of the P, T, or S criteria are not met,
-    // progress to the next record
-    while(current != NULL && ( !P || !T || !S ))
-    {
-        current = current->next;
-        if (current == NULL)
-        {
-            // if we get here, no qualifying message was found, 
-            // so just return the NULL value
-            return current;
-        }
-        P = (priority == PRIORITY_ALL || current->priority == priority);
-        T = (type == TYPE_ALL || current->type == type);
-        S = (strcmp(sender, "*") == 0 || strcmp(sender, current->sender_mbox) == 0);
-    }
-    if(current != NULL)
-    {
-        // if we get here, we found a qualifying message, 
-        // so take it out of the list and return it
-        struct Message *prev = current->prev;
-        struct Message *next = current->next;
-        
-        if (prev == NULL)
-        {
-            // if we get here, 'current' is at the start of the list,
-            // so we re-set the first message to 'next':
-            mbox->first_msg = next;
-            return current;
-        }
-        else if (next==NULL)
-        {
-            // if we get here, 'current' is at the end of the list, 
-            // so we set 'prev' to be the new list ender:
-            prev->next = NULL;
-            return current;
-        }
-        else
-        {
-            // if we get here, 'current' is in the middle of the list,
-            // so we stitch together 'prev' and 'next' to edit 'current'
-            // out of the list:
-            prev->next = next;
-            next->prev = prev;
-            return current;
-        }
-    }
+    // if we get here, we found a qualifying message, so take it
+    // out of the mailbox and return it:
+    remove_message(mbox, current);
+    mbox->fetched++;
+    return current;
+}
+
+struct Message * expire_first_message(struct Mailbox * mbox, time_t now)
+{
+    struct Message *oldest = mbox->first_msg;
+    // (times are in whole seconds, so a message gets between ttl and
+    // ttl+1 seconds, never less)
+    mbox->fresh_since = (mbox->ttl > 0) ? now - mbox->ttl : 0;
+    if(oldest == NULL || fresh(mbox, oldest))
+        return NULL;
+    remove_message(mbox, oldest);
+    mbox->expired++;
+    return oldest;
+}
+
+/* a pool's shared state; a free object keeps the link to the next  *
+ * one on its free list at 'link_offset'                             */
+struct Pool
+{
+    size_t object_size;
+    size_t link_offset;
+    int lock;            // guards the spare list
+    void *spare_first;   // free lists that threads have passed on
+    void *spare_last;
+    int spare_count;
+    long slabs;          // (these three are updated atomically)
+    long allocs;
+    long frees;
+};
+
+/* one thread's free list for one pool                              */
+struct FreeList
+{
+    void *first;
+    void *last;
+    int count;
+};
+
+/* objects per slab, and how long a thread's free list may get      *
+ * before it is passed on to the pool                               */
+#define SLAB_OBJECTS 256
+#define SPARE_LIMIT (16 * SLAB_OBJECTS)
+
+static struct Pool message_pool = {.object_size = sizeof(struct Message), .link_offset = offsetof(struct Message, next)};
+static __thread struct FreeList free_messages;
+
+#define LINK(pool, object) (*(void **)((char *)(object) + (pool)->link_offset))
+
+/* this function fills an empty free list, from the pool's spares   *
+ * if it has any and from a new slab if not                          */
+static void refill(struct Pool * pool, struct FreeList * list)
+{
+    while(__atomic_test_and_set(&(pool->lock), __ATOMIC_ACQUIRE))
+        ;
+    list->first = pool->spare_first;
+    list->last = pool->spare_last;
+    list->count = pool->spare_count;
+    pool->spare_first = pool->spare_last = NULL;
+    pool->spare_count = 0;
+    __atomic_clear(&(pool->lock), __ATOMIC_RELEASE);
+    if(list->first != NULL)
+        return;
+    char *slab = malloc(SLAB_OBJECTS * pool->object_size);
+    for(int i = 0; i < SLAB_OBJECTS - 1; i++)
+        LINK(pool, slab + i * pool->object_size) = slab + (i + 1) * pool->object_size;
+    LINK(pool, slab + (SLAB_OBJECTS - 1) * pool->object_size) = NULL;
+    list->first = slab;
+    list->last = slab + (SLAB_OBJECTS - 1) * pool->object_size;
+    list->count = SLAB_OBJECTS;
+    __atomic_add_fetch(&(pool->slabs), 1, __ATOMIC_RELAXED);
+}
+
+/* this function takes an object from a thread's free list          */
+static void * pool_alloc(struct Pool * pool, struct FreeList * list)
+{
+    if(list->first == NULL)
+        refill(pool, list);
+    void *object = list->first;
+    list->first = LINK(pool, object);
+    if(list->first == NULL)
+        list->last = NULL;
+    list->count--;
+    __atomic_add_fetch(&(pool->allocs), 1, __ATOMIC_RELAXED);
+    return object;
+}
+
+/* this function puts an object back on a thread's free list        */
+static void pool_free(struct Pool * pool, struct FreeList * list, void * object)
+{
+    LINK(pool, object) = list->first;
+    if(list->first == NULL)
+        list->last = object;
+    list->first = object;
+    list->count++;
+    __atomic_add_fetch(&(pool->frees), 1, __ATOMIC_RELAXED);
+    if(list->count <= SPARE_LIMIT)
+        return;
+    // too many for one thread to sit on, so pass them all on:
+    while(__atomic_test_and_set(&(pool->lock), __ATOMIC_ACQUIRE))
+        ;
+    LINK(pool, list->last) = pool->spare_first;
+    if(pool->spare_first == NULL)
+        pool->spare_last = list->last;
+    pool->spare_first = list->first;
+    pool->spare_count += list->count;
+    __atomic_clear(&(pool->lock), __ATOMIC_RELEASE);
+    list->first = list->last = NULL;
+    list->count = 0;
+}
+
+/* this function reports how the message pool is doing              */
+void get_pool_stats(struct PoolStats * messages)
+{
+    messages->slabs = __atomic_load_n(&(message_pool.slabs), __ATOMIC_RELAXED);
+    messages->allocs = __atomic_load_n(&(message_pool.allocs), __ATOMIC_RELAXED);
+    messages->frees = __atomic_load_n(&(message_pool.frees), __ATOMIC_RELAXED);
+}
+
+/* this function hands a message that is out of its mailbox back to *
+ * its pool, and frees its body                                     */
+void free_message(struct Message * msg)
+{
+    if(msg->body != NULL)
+        drop_body(msg->body);
+    pool_free(&message_pool, &free_messages, msg);
 }
 
 /* this function creates a new message with the specified priority  *
- * and type, adding it as a node after the node specified by 'prev' */
-struct Message * new_message(int priority, int type, char *sender, struct Message * prev)
+ * and type, not yet in any queue                                   */
+struct Message * new_message(int priority, int type, int sender)
 {
     // make space for a new message:
-    struct Message * msg = malloc(sizeof(struct Message));
+    struct Message * msg = pool_alloc(&message_pool, &free_messages);
     // set the priority and type:
     msg->priority = priority;
     msg->type = type;
     // copy over the sender identity:
-    strcpy(msg->sender_mbox, sender);
-    // this is a new message so its list of lines of text
-    // should be empty:
-    msg->first_line = NULL;
-    // make sure the prev pointer works:
-    msg->prev = prev;
-    // we always add to the end of the list, so
-    // next should be NULL:
-    msg->next = NULL;
+    msg->sender_id = sender;
+    // this is a new message so it has no lines of text yet:
+    msg->num_lines = 0;
+    msg->body = NULL;
+    msg->ring = NULL;
+    // add_message links it in:
+    msg->seq = 0;
+    msg->fetched_before = 0;
+    msg->prev = msg->next = NULL;
+    msg->prev_like = msg->next_like = NULL;
+    msg->from = NULL;
+    msg->prev_from = msg->next_from = NULL;
     // return the new message:
     return msg;
 }
 
 /* this function adds a new message with the specified priority and *
- * type to the message queue whose head is specified by 'head'; it  *
+ * type to the end of a mailbox's message queue (and sub-queue); it *
  * returns the new message                                          */
-struct Message * add_message(struct Mailbox * mbox, int priority, int type, char *sender)
+struct Message * add_message(struct Mailbox * mbox, int priority, int type, int sender)
 {
-    int length;
-    struct Message * tail = mbox->first_msg;
-    if (tail == NULL)
+    // a mailbox only gets its sub-queues once something is sent to it:
+    if(mbox->queues == NULL)
+        mbox->queues = calloc(NUM_PRIORITIES * NUM_TYPES, sizeof(struct MessageQueue));
+    struct Message * msg = new_message(priority, type, sender);
+    msg->seq = mbox->next_seq++;
+    msg->fetched_before = mbox->fetched;
+    msg->arrived = time(NULL);
+    // the new message goes at the end of the whole queue...
+    msg->prev = mbox->last_msg;
+    if(mbox->last_msg == NULL)
+        mbox->first_msg = msg;
+    else
+        mbox->last_msg->next = msg;
+    mbox->last_msg = msg;
+    // ...at the end of its sub-queue...
+    struct MessageQueue *queue = sub_queue(mbox, priority, type);
+    msg->prev_like = queue->last;
+    if(queue->last == NULL)
+        queue->first = msg;
+    else
+        queue->last->next_like = msg;
+    queue->last = msg;
+    mbox->occupied |= BUCKET_BIT(priority, type);
+    int cell = CELL(priority, type);
+    mbox->num_msgs++;
+    mbox->counts[cell]++;
+    if(!OCTAL(priority) || !OCTAL(type))
+        mbox->odd_msgs++;
+    // ...and at the end of its sender's queue:
+    struct SenderQueue *from = add_sender(mbox, sender);
+    from->num_msgs++;
+    from->counts[cell]++;
+    msg->from = from;
+    msg->prev_from = from->last;
+    if(from->last == NULL)
+        from->first = msg;
+    else
+        from->last->next_from = msg;
+    from->last = msg;
+    return msg;
+}
+
+/* this function gives a message a body of 'num_lines' lines, copied *
+ * from 'packed' (which holds at most 'size' bytes of packed lines); *
+ * it returns false, leaving the message without a body, if there   *
+ * are not that many lines there                                    */
+struct Body * new_body(char * packed, int size, int num_lines)
+{
+    // every line takes at least its length, so this also keeps a
+    // bogus line count from asking for a huge block:
+    if(num_lines < 0 || num_lines > size / (int)sizeof(int))
+        return NULL;
+    struct Body *body = malloc(sizeof(struct Body) + num_lines * sizeof(int) + size);
+    int length = 0, i;
+    for(i = 0; i < num_lines; i++)
+    {
+        int line_length;
+        if(size - length < (int)sizeof(int))
+            break;
+        memcpy(&line_length, packed + length, sizeof(int));
+        if(line_length < 0 || size - length - (int)sizeof(int) < line_length)
+            break;
+        body->offsets[i] = length;
+        length += sizeof(int) + line_length;
+    }
+    if(i < num_lines)
     {
-        // if we reach this point we are starting a new list, so...
-        tail = mbox->first_msg = new_message(priority, type, sender, NULL);
-        length = 1;
+        free(body);
+        return NULL;
     }
+    body->refs = 1;
+    body->num_lines = num_lines;
+    body->length = length;
+    memcpy(body_lines(body), packed, length);
+    return body;
+}
+
+char * body_lines(struct Body * body)
+{
+    return (char *)(body->offsets + body->num_lines);
+}
+
+void drop_body(struct Body * body)
+{
+    if(__atomic_sub_fetch(&(body->refs), 1, __ATOMIC_ACQ_REL) == 0)
+        free(body);
+}
+
+bool set_body(struct Message * msg, char * packed, int size, int num_lines)
+{
+    struct Body *body = new_body(packed, size, num_lines);
+    if(body == NULL)
+        return false;
+    msg->body = body;
+    msg->num_lines = num_lines;
+    return true;
+}
+
+void share_body(struct Message * msg, struct Body * body)
+{
+    __atomic_add_fetch(&(body->refs), 1, __ATOMIC_RELAXED);
+    msg->body = body;
+    msg->num_lines = body->num_lines;
+}
+
+/* this function returns where the characters of line 'i' of a      *
+ * message's body are, and sets 'length' to how many there are     */
+char * message_line(struct Message * msg, int i, int * length)
+{
+    char *line = body_lines(msg->body) + msg->body->offsets[i];
+    memcpy(length, line, sizeof(int));
+    return line + sizeof(int);
+}
+
+struct Waiter * add_waiter(struct Mailbox * mbox, int PID, int opcode, int request_id, int priority, int type, int sender, char * sender_name)
+{
+    struct Waiter *waiter = malloc(sizeof(struct Waiter));
+    waiter->PID = PID;
+    waiter->opcode = opcode;
+    waiter->request_id = request_id;
+    waiter->priority = priority;
+    waiter->type = type;
+    waiter->sender = sender;
+    waiter->sender_name = (sender == NO_NAME) ? strdup(sender_name) : NULL;
+    waiter->timer = NULL;
+    // the newest waiter goes to the back of the line:
+    waiter->next = NULL;
+    waiter->prev = mbox->last_waiter;
+    if(mbox->last_waiter == NULL)
+        mbox->first_waiter = waiter;
     else
+        mbox->last_waiter->next = waiter;
+    mbox->last_waiter = waiter;
+    return waiter;
+}
+
+struct Waiter * find_waiter(struct Mailbox * mbox, int priority, int type, int sender)
+{
+    // (usually the first in line will do)
+    struct Waiter *waiter = mbox->first_waiter;
+    for(; waiter != NULL; waiter = waiter->next)
     {
-        // initialize length to 1 (the head)
-        length = 1;
-        // start at the head of the list and find the tail:
-        while(tail->next != NULL)
+        // P = priority match, T = type match, S = sender match
+        bool P = (waiter->priority == PRIORITY_ALL || waiter->priority == priority);
+        bool T = (waiter->type == TYPE_ALL || waiter->type == type);
+        // (a sender that had not connected when the RECV came in
+        // may have by now)
+        if(waiter->sender == NO_NAME && (waiter->sender = find_name(waiter->sender_name)) != NO_NAME)
         {
-            tail = tail->next;
-            length++;
+            free(waiter->sender_name);
+            waiter->sender_name = NULL;
         }
-        // now we are at the end of the list, so add the new message:
-        tail->next = new_message(priority, type, sender, tail);
-        tail = tail->next;
-        length++;
+        bool S = (waiter->sender == ANY_SENDER || waiter->sender == sender);
+        if(P && T && S)
+            break;
     }
-    return tail;
+    return waiter;
 }
 
-/* this function creates and returns a new line of message text     */
-struct Line * new_line(char text[STRING_SIZE])
+void remove_waiter(struct Mailbox * mbox, struct Waiter * waiter)
 {
-    // make space for a new line of text:
-    struct Line * line = malloc(sizeof(struct Line));
-    // copy over the message text:
-    strcpy(line->text, text);
-    // we always add to the end of the list, so
-    // next should be NULL:
-    line->next = NULL;
-    // return the new message:
-    return line;
+    if(waiter->prev == NULL)
+        mbox->first_waiter = waiter->next;
+    else
+        waiter->prev->next = waiter->next;
+    if(waiter->next == NULL)
+        mbox->last_waiter = waiter->prev;
+    else
+        waiter->next->prev = waiter->prev;
+    free(waiter->sender_name);
+    free(waiter);
 }
 
-/* this function adds a line of text to an existing message; it     *
- * returns the number of lines in the message                       */
-int add_line(struct Message * msg, char line[STRING_SIZE])
+/* the topics, by name id (NULL for names that are not topics)      */
+static struct Topic **topics = NULL;
+static int num_topic_ids = 0;
+
+struct Topic * get_topic(int topic_id)
 {
-    int num_lines;
-    if(msg->first_line == NULL)
+    return (topic_id >= 0 && topic_id < num_topic_ids) ? topics[topic_id] : NULL;
+}
+
+int subscribe(int topic_id, int mailbox_id, int priority, int type)
+{
+    if(topic_id >= num_topic_ids)
     {
-        msg->first_line = new_line(line);
-        num_lines = 1;
+        int size = (num_topic_ids > 0) ? num_topic_ids : 64;
+        while(size <= topic_id)
+            size *= 2;
+        topics = realloc(topics, size * sizeof(struct Topic *));
+        memset(topics + num_topic_ids, 0, (size - num_topic_ids) * sizeof(struct Topic *));
+        num_topic_ids = size;
     }
-    else
+    struct Topic *topic = topics[topic_id];
+    if(topic == NULL)
+        topic = topics[topic_id] = calloc(1, sizeof(struct Topic));
+    // a mailbox only subscribes once, so look for it first:
+    int i;
+    for(i = 0; i < topic->count; i++)
+        if(topic->subscriptions[i].mailbox_id == mailbox_id)
+            break;
+    if(i == topic->count)
     {
-        // initialize list length to one (the head of the list)
-        num_lines = 1;
-        // start at the head of the list and find the tail:
-        struct Line * tail = msg->first_line;
-        while(tail->next != NULL)
+        if(topic->count == topic->capacity)
         {
-            tail = tail->next;
-            num_lines++;
+            topic->capacity = (topic->capacity > 0) ? 2 * topic->capacity : 8;
+            topic->subscriptions = realloc(topic->subscriptions, topic->capacity * sizeof(struct Subscription));
         }
-        // now we are at the end of the list, so add the new message:
-        tail->next = new_line(line);
-        num_lines++;
+        topic->count++;
     }
-    msg->num_lines = num_lines;
-    return num_lines;
+    topic->subscriptions[i] = (struct Subscription){mailbox_id, priority, type};
+    return topic->count;
 }
 
+bool unsubscribe(int topic_id, int mailbox_id)
+{
+    struct Topic *topic = get_topic(topic_id);
+    if(topic == NULL)
+        return false;
+    for(int i = 0; i < topic->count; i++)
+        if(topic->subscriptions[i].mailbox_id == mailbox_id)
+        {
+            // (the order of the subscriptions does not matter)
+            topic->subscriptions[i] = topic->subscriptions[--topic->count];
+            return true;
+        }
+    return false;
+}
 
+bool wants(struct Subscription * sub, int priority, int type)
+{
+    return (sub->priority == PRIORITY_ALL || sub->priority == priority) && (sub->type == TYPE_ALL || sub->type == type);
+}
@@ -9,6 +9,10 @@
 #ifndef IPCMSG_H_INCLUDED
 #define IPCMSG_H_INCLUDED
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
 /* ==== define message priorities --------------------------------- *
  * (note that not all values in the octal range have been used;     *
  * space is reserved for other priority levels should future        *
@@ -70,83 +74,344 @@ void pri_str(char * priority_string, int priority_code);
 void typ_str(char * type_string, int type_code);
 
 
-/* ==== define IPC MESSAGE LINES as a linked list ----------------- *
- * Each node is one line of text (up to 120 characters) plus a link *
- * to the next line in the message                                  */
-struct Line
+/* ==== define IPC MESSAGE BODIES -------------------------------- *
+ * A message's lines are kept together in one block, packed just as *
+ * they travel in a frame payload (each line an int length followed *
+ * by its characters, with no null terminator), so that they can go *
+ * out to a receiver in one piece; an array of where each line      *
+ * starts comes first in the same block. Lines can be any length.   *
+ * A body may be shared by several messages (one SEND to many       *
+ * mailboxes only keeps one copy), so it counts its users and goes  *
+ * once the last of them lets go; any thread may share or drop one. */
+struct Body
 {
-    char text[STRING_SIZE];
-    struct Line *next;
+    int refs;            // messages (and others) using it
+    int num_lines;
+    int length;          // bytes of packed lines, which come after...
+    int offsets[];       // ...where each line starts in them
 };
 
+/* this function makes a body of 'num_lines' lines, copied from     *
+ * 'packed' (which holds at most 'size' bytes of packed lines), with *
+ * one user; it returns NULL if there are not that many lines there *
+ * to copy                                                          */
+struct Body * new_body(char * packed, int size, int num_lines);
+
+/* this function returns where a body's packed lines start          */
+char * body_lines(struct Body * body);
+
+/* this function lets go of a body, freeing it if nothing else is   *
+ * using it                                                         */
+void drop_body(struct Body * body);
+
 /* ==== define IPC MESSAGE QUEUE as a linked list ----------------- *
  * Each node is a message. Each message has a sender identity, a    *
- * priority, a message type, a sub-list of message lines, and       *
+ * priority, a message type, a body of message lines (or the place *
+ * in a shared-memory ring where its lines are packed), and         *
  * pointers to the prev. and next messages in the list              */
+struct Ring;
+struct SenderQueue;
+
 struct Message
 {
-    char sender_mbox[STRING_SIZE];
+    int sender_id;       // interned name of the sender's mailbox
     int priority;
     int type;
     int num_lines;
-    struct Line *first_line; 
+    struct Body *body;   // the packed lines (or NULL)
+    struct Ring *ring;   // if set, the lines are packed in this ring...
+    int ring_offset;     // ...at this offset...
+    int ring_length;     // ...and take up this many bytes
+    unsigned long seq;   // order of arrival in the mailbox
+    time_t arrived;      // (for the mailbox's TTL)
+    unsigned long fetched_before; // mailbox's deliveries before it arrived
+
     struct Message *prev;
     struct Message *next;
+    struct Message *prev_like; // the same again, but only through messages
+    struct Message *next_like; // of this message's priority and type
+    struct SenderQueue *from;  // ...and through the messages from this
+    struct Message *prev_from; // message's sender
+    struct Message *next_from;
+};
+
+/* ==== define MESSAGE SUB-QUEUES --------------------------------- *
+ * Besides the one queue of all of its messages, a mailbox keeps a  *
+ * sub-queue for each priority and type, so that a filtered CHECK   *
+ * or RECV only has to look at the messages that can match. Codes   *
+ * are kept in the octal range, so there are 8 x 8 sub-queues (a    *
+ * code outside that range shares the sub-queue of its low 3 bits)  */
+#define NUM_PRIORITIES 8
+#define NUM_TYPES 8
+
+/* ==== define MESSAGE COUNTS ------------------------------------- *
+ * A mailbox also keeps a count of its messages in each of those    *
+ * 8 x 8 cells, and so does each of its sender queues, so that a    *
+ * CHECK is answered from the counts without looking at a message   *
+ * (the counts are only kept in step by add_message and             *
+ * fetch_first_message)                                             */
+#define NUM_CELLS (NUM_PRIORITIES * NUM_TYPES)
+
+struct MessageQueue
+{
+    struct Message *first;
+    struct Message *last;
+};
+
+/* ==== define SENDER QUEUES ------------------------------------- *
+ * A mailbox also keeps the messages from each sender in a queue of *
+ * their own, found through a small hash table on the sender's      *
+ * name, so that a CHECK or RECV for one sender only has to look at *
+ * that sender's messages                                           */
+struct SenderQueue
+{
+    int sender_id;
+    struct Message *first;
+    struct Message *last;
+    struct SenderQueue *next; // next sender in the same hash bucket
+    int num_msgs;             // messages from this sender...
+    int counts[NUM_CELLS];    // ...and how many in each cell
+};
+
+/* ==== define DELIVERY ORDERS ------------------------------------ *
+ * what a RECV for messages of any priority gets first:             */
+
+/* "FIFO" = the oldest matching message (the default)               */
+#define DELIVERY_FIFO       0
+
+/* "PRIORITY" = the oldest matching message of the highest priority *
+ * that has one (INTERRUPT > NORMAL > BATCH > SPAM); if the mailbox *
+ * sets an 'aging' limit, a message that has been passed over by    *
+ * that many deliveries goes next whatever its priority (but only   *
+ * one in every 'aging' deliveries is picked this way)              */
+#define DELIVERY_PRIORITY   1
+
+/* ==== define RECV WAITERS -------------------------------------- *
+ * A RECV that finds nothing to fetch waits on the mailbox with its *
+ * filter until a matching message is sent there. Any number of     *
+ * RECVs (from the clients sharing the mailbox, or pipelined by one *
+ * client) can wait on one mailbox; they are kept in the order they *
+ * started waiting, and a new message goes to the first of them     *
+ * whose filter it matches.                                         */
+struct Waiter
+{
+    int PID;             // client that is waiting...
+    int opcode;          // ...in a RECV (or a timed one)...
+    int request_id;      // ...(v2) with this request id...
+    int priority;        // ...for a message of this priority,
+    int type;            // this type,
+    int sender;          // and from this sender (or ANY_SENDER)...
+    char *sender_name;   // ...whose name, while it has no id (NO_NAME)
+    struct Timer *timer; // the timer on a timed RECV (NULL otherwise)
+    struct Waiter *prev;
+    struct Waiter *next;
 };
 
-/* ==== define IPC MAILBOX LIST as a linked list ------------------ *
- * The mailboxes are held in a hash table, but in case of hash      *
- * collisions, a linked list of mailboxes is kept at each hash      *
- * location. Each node is a mailbox with a message queue and links  *
- * to the prev. and next mailboxes in the list.                     */
+/* ==== define TOPICS -------------------------------------------- *
+ * A topic is a name that mailboxes subscribe to: a message that is *
+ * published to it goes to every subscriber whose filter it passes. *
+ * Topics and mailboxes are both named by interned ids, and a topic *
+ * keeps its subscriptions in one array, so a publish only walks    *
+ * that. Only one thread (the one that publishes) may use topics.   */
+struct Subscription
+{
+    int mailbox_id;      // subscriber...
+    int priority;        // ...wanting messages of this priority
+    int type;            // and this type (or the _ALL codes)
+};
+
+struct Topic
+{
+    int count;
+    int capacity;
+    struct Subscription *subscriptions;
+};
+
+/* ==== define NAME INTERNING ------------------------------------ *
+ * Each mailbox name is kept just once, in a table that gives it a  *
+ * small id, so that messages can hold the id of their sender and   *
+ * compare senders as integers. Ids are never given back, so the    *
+ * text of an interned name stays put (and may be held on to) for   *
+ * as long as the program runs. Any thread may use the table.       */
+
+/* sender "id" that stands for messages from every sender           */
+#define ANY_SENDER -1
+
+/* "id" of a name that has not been interned (which no message can   *
+ * be from, so the mailbox functions are never asked about it)      */
+#define NO_NAME -2
+
+/* this function returns the id of a name, interning it first if it *
+ * has not been seen before; since interned names are kept for good, *
+ * only names that stand for something the server keeps (connected  *
+ * clients' mailboxes and topics) get interned                      */
+int intern_name(char * name);
+
+/* this function returns the id of a name, or NO_NAME if it has not  *
+ * been interned (it never interns it)                              */
+int find_name(char * name);
+
+/* this function returns the text of an interned name               */
+char * name_of(int id);
+
+/* ==== define IPC MAILBOX TABLE as a hash table ----------------- *
+ * The mailboxes are held in a hash table with open addressing:     *
+ * each mailbox caches the hash of its name, and a name that hashes *
+ * to a taken slot goes in the next free one. When the table gets   *
+ * half full, a table twice the size takes over, and the mailboxes  *
+ * are moved across a few at a time by the calls that follow (until *
+ * then a lookup checks both tables), so no one call ever has to    *
+ * re-hash the whole lot.                                           */
 struct Mailbox
 {
     char mbox_name[STRING_SIZE];
+    unsigned int hash;           // name_hash(mbox_name)
     struct Message *first_msg;
-    struct Mailbox *prev;
-    struct Mailbox *next;
+    struct Message *last_msg;
+    struct MessageQueue *queues; // [priority][type], made by the first message
+    uint64_t occupied;           // bit [priority][type] set if its sub-queue is not empty
+    int num_msgs;                // messages in the mailbox...
+    int counts[NUM_CELLS];       // ...and how many in each [priority][type]
+    int odd_msgs;                // ...and how many have a code outside 0-7
+    struct SenderQueue **senders; // hash table of sender queues, or NULL
+    int sender_buckets;          // size of that table
+    int num_senders;             // senders with messages in the mailbox
+    unsigned long next_seq;
+    unsigned long fetched;       // number of messages delivered so far
+    int delivery;                // DELIVERY_FIFO or DELIVERY_PRIORITY
+    int aging;                   // (for DELIVERY_PRIORITY) 0 = no aging
+    unsigned long aged_at;       // 'fetched' when aging last picked a message
+    unsigned long last_multicast; // serial of the last multicast SEND to reach it
+    int ttl;                     // seconds a message may wait (0 = for ever)
+    time_t fresh_since;          // messages that arrived before this are stale
+    long expired;                // messages thrown out for outliving the TTL
+    struct Waiter *first_waiter; // RECVs waiting on this mailbox, oldest
+    struct Waiter *last_waiter;  // first
 };
 
-/* this function creates a new mailbox, adding it as a node after   *
- * the node specified by 'prev'                                     */
-struct Mailbox * new_mbox(char * mbox_name, struct Mailbox * prev);
+struct MailboxTable
+{
+    struct Mailbox **slots;      // NULL where there is no mailbox
+    int size;                    // (always a power of two)
+    int count;                   // mailboxes in the whole table
+    struct Mailbox **old_slots;  // while growing: the table being moved out
+    int old_size;                // of, its size, and how far the move has
+    int next_old;                // got
+};
 
-/* this function adds a new mailbox to the linked list whose head   *
- * is specified by 'head'; it returns the length of the list        */
-int add_mbox(struct Mailbox * head, char * mbox_name);
+/* this function hashes a mailbox name (FNV-1a)                     */
+unsigned int name_hash(char * name);
 
-/* this function returns the list position of a named mailbox if it *
- * is in the list, or -1 if it is not                               */
-int find_mbox(struct Mailbox * head, char * mbox_name);
+/* this function sets up an empty mailbox table                     */
+void init_mbox_table(struct MailboxTable * table);
 
-/* this function returns the mailbox with the given mailbox name,   *
- * or NULL if the mailbox name does not exist                       */
-struct Mailbox * get_mbox(struct Mailbox * head, char * mbox_name);
+/* this function creates a new mailbox that is not in any table     */
+struct Mailbox * new_mbox(char * mbox_name);
 
-/* this function returns the mailbox at the given list position,    *
- * or NULL if the list does not contain that position index         */
-struct Mailbox * get_mbox_at(struct Mailbox * head, int list_posn);
+/* this function adds a new mailbox to a table (the name must not   *
+ * be in the table already); it returns the new mailbox             */
+struct Mailbox * add_mbox(struct MailboxTable * table, char * mbox_name);
+
+/* this function returns the mailbox with the given mailbox name    *
+ * and hash, or NULL if the mailbox name does not exist             */
+struct Mailbox * get_mbox(struct MailboxTable * table, char * mbox_name, unsigned int hash);
+
+/* this function goes through the mailboxes in a table: starting with *
+ * 'pos' at 0, each call returns the next mailbox (or NULL once there *
+ * are no more); the table must not change in the meantime          */
+struct Mailbox * next_mbox(struct MailboxTable * table, int * pos);
 
 /* this function determines how many messages of the given priority *
- * and type are waiting in a mailbox's message queue                */
-int num_waiting_msgs(struct Mailbox * mbox, int priority, int type, char *sender);
+ * and type from the given sender (an interned name, or ANY_SENDER) *
+ * are waiting in a mailbox's message queue                         */
+int num_waiting_msgs(struct Mailbox * mbox, int priority, int type, int sender);
 
 /* this function retrieves the first waiting message of a given     *
- * priority and type then removes that message from the list        */
-struct Message * fetch_first_message(struct Mailbox * mbox, int priority, int type, char *sender);
+ * priority and type then removes that message from the list; which *
+ * message is "first" depends on the mailbox's delivery order       */
+struct Message * fetch_first_message(struct Mailbox * mbox, int priority, int type, int sender);
+
+/* this function removes the oldest message in a mailbox and returns *
+ * it if it has waited longer than the mailbox's TTL by time 'now'  *
+ * (messages arrive in order, so if it has not, none has); it       *
+ * returns NULL otherwise. Either way it notes which messages are   *
+ * stale as of 'now', and until they are thrown out the functions   *
+ * above neither count nor fetch them                               */
+struct Message * expire_first_message(struct Mailbox * mbox, time_t now);
+
+/* ==== define MESSAGE POOLS ------------------------------------- *
+ * Messages do not come straight from malloc: a pool carves them    *
+ * out of slabs of many at a time and keeps the ones handed back on *
+ * a free list per thread, so that getting or freeing one takes no  *
+ * lock (a thread whose list gets too long passes it on to the pool *
+ * for the other threads to use). Slabs are never given back to     *
+ * malloc.                                                          */
+struct PoolStats
+{
+    long slabs;   // slabs carved so far
+    long allocs;  // objects handed out so far...
+    long frees;   // ...and handed back (so allocs - frees are in use)
+};
+
+/* this function reports how the message pool is doing              */
+void get_pool_stats(struct PoolStats * messages);
+
+/* this function hands a message that is out of its mailbox back to *
+ * its pool, and frees its body                                     */
+void free_message(struct Message * msg);
 
 /* this function creates a new message with the specified priority  *
- * and type, adding it as a node after the node specified by 'prev' */
-struct Message * new_message(int priority, int type, char *sender, struct Message * prev);
+ * and type, not yet in any queue                                   */
+struct Message * new_message(int priority, int type, int sender);
 
 /* this function adds a new message with the specified priority and *
- * type to the message queue whose head is specified by 'head'; it  *
+ * type to the end of a mailbox's message queue (and sub-queue); it *
  * returns the new message                                          */
-struct Message * add_message(struct Mailbox * mbox, int priority, int type, char *sender);
-
-/* this function adds a line of text to an existing message; it     *
- * returns the number of lines in the message                       */
-int add_line(struct Message * msg, char line[STRING_SIZE]);
+struct Message * add_message(struct Mailbox * mbox, int priority, int type, int sender);
+
+/* this function gives a message a body of 'num_lines' lines, copied *
+ * from 'packed' (which holds at most 'size' bytes of packed lines); *
+ * it returns false, leaving the message without a body, if there   *
+ * are not that many lines there                                    */
+bool set_body(struct Message * msg, char * packed, int size, int num_lines);
+
+/* this function gives a message a body that other messages may be  *
+ * using as well                                                    */
+void share_body(struct Message * msg, struct Body * body);
+
+/* this function returns where the characters of line 'i' of a      *
+ * message's body are, and sets 'length' to how many there are     */
+char * message_line(struct Message * msg, int i, int * length);
+
+/* this function adds a RECV to the end of a mailbox's waiters and  *
+ * returns it; if the sender is NO_NAME, the waiter keeps a copy of  *
+ * 'sender_name' and looks its id up again each time it is checked  */
+struct Waiter * add_waiter(struct Mailbox * mbox, int PID, int opcode, int request_id, int priority, int type, int sender, char * sender_name);
+
+/* this function returns the first of a mailbox's waiters that a    *
+ * message of the given priority and type from the given sender    *
+ * would satisfy, or NULL if there is none                          */
+struct Waiter * find_waiter(struct Mailbox * mbox, int priority, int type, int sender);
+
+/* this function takes a waiter off its mailbox and frees it         */
+void remove_waiter(struct Mailbox * mbox, struct Waiter * waiter);
+
+/* this function returns the topic with the given name id, or NULL  *
+ * if nothing has ever subscribed to it                             */
+struct Topic * get_topic(int topic_id);
+
+/* this function subscribes a mailbox to a topic (or changes the    *
+ * filter of its subscription) and returns how many subscribers the *
+ * topic has now                                                    */
+int subscribe(int topic_id, int mailbox_id, int priority, int type);
+
+/* this function ends a mailbox's subscription to a topic; it       *
+ * returns false if there was none                                  */
+bool unsubscribe(int topic_id, int mailbox_id);
+
+/* this function tells whether a message of the given priority and  *
+ * type passes a subscription's filter                              */
+bool wants(struct Subscription * sub, int priority, int type);
 
 
 #endif
\ No newline at end of file
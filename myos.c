@@ -1,5 +1,5 @@
 #include "myos_headers.h"
-#include "msg_handlers.h"
+#include "fio_handlers.h"
 #include <stdbool.h>
 #include <time.h>
 
@@ -85,7 +85,7 @@ void disconnectProcess(struct client *my_client)
     // marking this array slot and its file descriptor as UNUSED:
     printf("myOS: disconnecting from client %d.\n", my_client->PID);
     write_string(my_client->fd_outgoing, "DISCONNECTING. Goodbye.");
-    close(my_client->fd_outgoing);
+    fio_close(my_client->fd_outgoing);
     my_client->PID = UNUSED;
     my_client->fd_outgoing = UNUSED;
     // note that we are now connected to one fewer client process:
@@ -191,7 +191,7 @@ int main()
                     {
                         printf("myOS: disconnecting last client and shutting down process server\n");
                         write_string(clients[clientPID].fd_outgoing, "SHUTTING DOWN. Goodbye.");
-                        close(clients[clientPID].fd_outgoing);
+                        fio_close(clients[clientPID].fd_outgoing);
                         connections = 0;
                         running = false;
                     }
@@ -338,8 +338,8 @@ int main()
 
         // if we reach this point there are no current connections, 
         // input will be undefined, so we need to close and re-open server FIFOs
-        close(fd_syscall);
-        close(fd_commchannel);
+        fio_close(fd_syscall);
+        fio_close(fd_commchannel);
     }
 
     // if we reach this point we are done with our FIFO file, so...
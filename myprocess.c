@@ -1,5 +1,5 @@
 #include "myos_headers.h"
-#include "msg_handlers.h"
+#include "fio_handlers.h"
 
 /* ---------- define key communication variables ---------- */
 int fd_incoming, fd_syscall, fd_commchannel; // file descriptors for communication FIFO's
@@ -258,9 +258,9 @@ int main()
     }
 
     /* clean up our files on the way out */
-    close(fd_syscall);
-    close(fd_commchannel);
-    close(fd_incoming);
+    fio_close(fd_syscall);
+    fio_close(fd_commchannel);
+    fio_close(fd_incoming);
     unlink(client_fifo_name);
 
     return 0;
@@ -0,0 +1,162 @@
+#include "ring_buffers.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* the two processes sharing a ring only ever meet in 'head', 'tail' *
+ * and the slot states, so those are read and written atomically:    *
+ * everything written before a release-store is visible to whoever  *
+ * sees the stored value with an acquire-load                        */
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+/* this function maps an open shared-memory object as a ring        */
+static bool map_ring(struct Ring *ring, int fd, int size)
+{
+    void *memory = mmap(NULL, sizeof(struct RingHeader) + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // the mapping outlives the descriptor:
+    close(fd);
+    if(memory == MAP_FAILED)
+        return false;
+    ring->header = memory;
+    ring->data = (char *)memory + sizeof(struct RingHeader);
+    ring->size = size;
+    ring->refs = 0;
+    ring->lock = 0;
+    ring->broken = false;
+    return true;
+}
+
+bool ring_create(struct Ring *ring, char *name, int size)
+{
+    if(size <= 0 || size % RING_ALIGN != 0)
+        return false;
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+    if(fd < 0)
+        return false;
+    if(ftruncate(fd, sizeof(struct RingHeader) + size) < 0)
+        close(fd);
+    else if(map_ring(ring, fd, size))
+    {
+        // a freshly truncated object is all zeroes, so head and tail
+        // both start at 0; only the size needs filling in:
+        ring->header->size = size;
+        return true;
+    }
+    shm_unlink(name);
+    return false;
+}
+
+bool ring_attach(struct Ring *ring, char *name, int size)
+{
+    if(size <= 0 || size % RING_ALIGN != 0)
+        return false;
+    int fd = shm_open(name, O_RDWR, 0);
+    if(fd < 0)
+        return false;
+    // make sure the object really is as big as we were told:
+    struct stat info;
+    if(fstat(fd, &info) < 0 || info.st_size < (off_t)(sizeof(struct RingHeader) + size))
+    {
+        close(fd);
+        return false;
+    }
+    if(!map_ring(ring, fd, size))
+        return false;
+    if(ring->header->size != size)
+    {
+        ring_detach(ring);
+        return false;
+    }
+    return true;
+}
+
+void ring_detach(struct Ring *ring)
+{
+    if(ring->header != NULL)
+        munmap(ring->header, sizeof(struct RingHeader) + ring->size);
+    ring->header = NULL;
+    ring->data = NULL;
+}
+
+void ring_unlink(char *name)
+{
+    shm_unlink(name);
+}
+
+int ring_reserve(struct Ring *ring, int length)
+{
+    int need = sizeof(struct RingSlot) + (length + RING_ALIGN - 1) / RING_ALIGN * RING_ALIGN;
+    if(length < 0 || need > ring->size)
+        return RING_INLINE;
+    unsigned long head = ring->header->head;
+    unsigned long tail = LOAD(ring->header->tail);
+    int offset = head % ring->size;
+    // slots never wrap around, so skip the end of the ring if
+    // this one will not fit there:
+    int skip = (offset + need > ring->size) ? ring->size - offset : 0;
+    if(head + skip + need - tail > (unsigned long)ring->size)
+        return RING_INLINE;
+    if(skip > 0)
+    {
+        struct RingSlot *filler = (struct RingSlot *)(ring->data + offset);
+        filler->length = skip;
+        filler->state = SLOT_SKIP;
+        head += skip;
+        offset = 0;
+    }
+    struct RingSlot *slot = (struct RingSlot *)(ring->data + offset);
+    slot->length = need;
+    slot->state = SLOT_BUSY;
+    STORE(ring->header->head, head + need);
+    return offset + sizeof(struct RingSlot);
+}
+
+char * ring_data(struct Ring *ring, int offset)
+{
+    return ring->data + offset;
+}
+
+bool ring_valid(struct Ring *ring, int offset, int length)
+{
+    int start = offset - (int)sizeof(struct RingSlot);
+    if(LOAD(ring->broken) || start < 0 || start % RING_ALIGN != 0 || length < 0 || offset + length > ring->size)
+        return false;
+    struct RingSlot *slot = (struct RingSlot *)(ring->data + start);
+    return LOAD(slot->state) == SLOT_BUSY && slot->length >= length + (int)sizeof(struct RingSlot);
+}
+
+void ring_release(struct Ring *ring, int offset)
+{
+    struct RingSlot *slot = (struct RingSlot *)(ring->data + offset - sizeof(struct RingSlot));
+    // only one thread at a time gets to move the tail:
+    while(__atomic_test_and_set(&(ring->lock), __ATOMIC_ACQUIRE))
+        ;
+    STORE(slot->state, SLOT_FREE);
+    // now move the tail past every slot that is no longer in use; the
+    // producer can write anything into the headers, so each length
+    // has to keep the slot whole, inside the ring, and short of head:
+    unsigned long tail = ring->header->tail;
+    unsigned long head = LOAD(ring->header->head);
+    bool broken = (head - tail > (unsigned long)ring->size);
+    while(tail < head && !broken)
+    {
+        int at = tail % ring->size;
+        slot = (struct RingSlot *)(ring->data + at);
+        if(LOAD(slot->state) == SLOT_BUSY)
+            break;
+        int length = slot->length;
+        if(length < (int)sizeof(struct RingSlot) || length % RING_ALIGN != 0 ||
+           at + length > ring->size || (unsigned long)length > head - tail)
+            broken = true;
+        else
+            tail += length;
+    }
+    STORE(ring->header->tail, tail);
+    if(broken)
+        STORE(ring->broken, true);
+    __atomic_clear(&(ring->lock), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,105 @@
+#ifndef RING_H_INCLUDED
+#define RING_H_INCLUDED
+
+#include <stdbool.h>
+
+/* ==== SHARED-MEMORY RINGS --------------------------------------- *
+ * A ring is a POSIX shared-memory object that a client and the     *
+ * server both map, so that big message bodies can be handed over   *
+ * without passing through a pipe. Space is handed out in slots:    *
+ * the producer reserves a slot at 'head', fills it in, and tells   *
+ * the other side its offset and length over the usual FIFO or      *
+ * socket; the consumer releases the slot when it is done with it.  *
+ * Slots may be released in any order, but their space is only      *
+ * re-used once every slot ahead of them has been released too.     *
+ *                                                                  *
+ * Each ring has exactly one producer and one consumer, so a client *
+ * sets up two: its send ring carries the bodies it SENDs (the      *
+ * client produces, the server consumes), and the server copies     *
+ * bodies into the receiving client's receive ring when it delivers *
+ * them (the server produces, the client consumes).                 *
+ *                                                                  *
+ * (older C libraries keep shm_open in librt: link with -lrt)       */
+
+/* names of the shared-memory objects for a client's rings; the     *
+ * client picks the names from its host-OS PID                      */
+#define SEND_RING_NAME "/YAMS_%d_send_ring"
+#define RECV_RING_NAME "/YAMS_%d_recv_ring"
+
+/* offset that means "not in the ring; sent inline instead"         */
+#define RING_INLINE -1
+
+/* every slot is this big a multiple of bytes                       */
+#define RING_ALIGN 8
+
+/* the shared part of a ring, at the start of the mapping; 'head'   *
+ * is only ever moved by the producer and 'tail' by the consumer,   *
+ * and both count bytes from the start of time (so head - tail is   *
+ * the number of bytes in use)                                      */
+struct RingHeader
+{
+    int size;
+    int reserved;
+    unsigned long head;
+    unsigned long tail;
+};
+
+/* each slot starts with a length (of the whole slot, padding and   *
+ * all) and a state: busy until released, or a skip marker filling  *
+ * out the end of the ring when a slot would not fit there          */
+struct RingSlot
+{
+    int length;
+    int state;
+};
+
+#define SLOT_FREE 0
+#define SLOT_BUSY 1
+#define SLOT_SKIP 2
+
+/* a process' handle on a mapped ring                               */
+struct Ring
+{
+    struct RingHeader *header;
+    char *data;
+    int size;
+    int refs; // the server's count of connections and messages using it
+    int lock; // held while releasing, for consumers with several threads
+    bool broken; // the producer has scribbled over a slot header
+};
+
+/* this function creates (or re-creates) a ring with 'size' bytes   *
+ * of slot space under the given name and maps it                   */
+bool ring_create(struct Ring *ring, char *name, int size);
+
+/* this function maps an existing ring that was created with 'size' *
+ * bytes of slot space; it fails if the object is not that big      */
+bool ring_attach(struct Ring *ring, char *name, int size);
+
+/* this function unmaps a ring                                      */
+void ring_detach(struct Ring *ring);
+
+/* this function removes a ring's name; processes that have it      *
+ * mapped already can go on using it                                */
+void ring_unlink(char *name);
+
+/* this function reserves a slot for 'length' bytes and returns the *
+ * offset of its data, or RING_INLINE if the ring is too full       */
+int ring_reserve(struct Ring *ring, int length);
+
+/* this function returns a pointer to the data at 'offset'          */
+char * ring_data(struct Ring *ring, int offset);
+
+/* this function tells whether 'offset' and 'length' describe the   *
+ * data of a slot that has been reserved and not yet released (in a *
+ * ring that is not broken)                                         */
+bool ring_valid(struct Ring *ring, int offset, int length);
+
+/* this function releases the slot whose data is at 'offset' and    *
+ * frees up as much space at the tail as it can; threads of the     *
+ * consuming process may release slots at the same time. If a slot  *
+ * header on the way is not one the producer could have written, it *
+ * marks the ring broken and leaves the tail where it is            */
+void ring_release(struct Ring *ring, int offset);
+
+#endif
@@ -0,0 +1,111 @@
+#include "timer_wheel.h"
+#include <string.h>
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN (1UL << (WHEEL_BITS * WHEEL_LEVELS))
+
+void wheel_init(struct TimerWheel *wheel, unsigned long now)
+{
+    memset(wheel, 0, sizeof(struct TimerWheel));
+    wheel->now = now;
+}
+
+/* this function files a timer in the slot for its expiry, which   *
+ * must be after the current tick                                   */
+static void place_timer(struct TimerWheel *wheel, struct Timer *timer)
+{
+    unsigned long delta = timer->expiry - wheel->now;
+    int level = 0;
+    while(level < WHEEL_LEVELS - 1 && delta >= 1UL << (WHEEL_BITS * (level + 1)))
+        level++;
+    struct Timer **slot = &(wheel->slots[level][(timer->expiry >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = *slot;
+    if(*slot != NULL)
+        (*slot)->prev = timer;
+    *slot = timer;
+}
+
+/* this function files a timer under the tick it is due at, or      *
+ * under the last tick of the span if it is due any later           */
+static void arm_timer(struct TimerWheel *wheel, struct Timer *timer)
+{
+    timer->expiry = (timer->due - wheel->now >= WHEEL_SPAN) ? wheel->now + WHEEL_SPAN - 1 : timer->due;
+    place_timer(wheel, timer);
+}
+
+void wheel_add(struct TimerWheel *wheel, struct Timer *timer, unsigned long expiry)
+{
+    if(expiry <= wheel->now)
+        expiry = wheel->now + 1;
+    timer->due = expiry;
+    arm_timer(wheel, timer);
+    wheel->count++;
+}
+
+void wheel_remove(struct TimerWheel *wheel, struct Timer *timer)
+{
+    if(timer->slot == NULL)
+        return;
+    if(timer->prev == NULL)
+        *(timer->slot) = timer->next;
+    else
+        timer->prev->next = timer->next;
+    if(timer->next != NULL)
+        timer->next->prev = timer->prev;
+    timer->slot = NULL;
+    wheel->count--;
+}
+
+/* this function moves the timers in one slot of a level down to   *
+ * the levels below, now that the wheel has come round to it       */
+static void cascade(struct TimerWheel *wheel, int level)
+{
+    struct Timer **slot = &(wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+    struct Timer *timer = *slot;
+    *slot = NULL;
+    while(timer != NULL)
+    {
+        struct Timer *next = timer->next;
+        place_timer(wheel, timer);
+        timer = next;
+    }
+}
+
+struct Timer * wheel_advance(struct TimerWheel *wheel, unsigned long now)
+{
+    struct Timer *first = NULL, *last = NULL;
+    // with nothing pending, there is nothing to step through:
+    if(wheel->count == 0 && now > wheel->now)
+        wheel->now = now;
+    while(wheel->now < now)
+    {
+        wheel->now++;
+        // each level comes round once the one below has wrapped:
+        for(int level = 1; level < WHEEL_LEVELS && (wheel->now & ((1UL << (WHEEL_BITS * level)) - 1)) == 0; level++)
+            cascade(wheel, level);
+        struct Timer **slot = &(wheel->slots[0][wheel->now & WHEEL_MASK]);
+        while(*slot != NULL)
+        {
+            struct Timer *timer = *slot;
+            wheel_remove(wheel, timer);
+            // (one that is due beyond the span goes round again)
+            if(timer->due > wheel->now)
+            {
+                arm_timer(wheel, timer);
+                wheel->count++;
+                continue;
+            }
+            timer->next = NULL;
+            if(last == NULL)
+                first = timer;
+            else
+                last->next = timer;
+            last = timer;
+        }
+        if(wheel->count == 0 && now > wheel->now)
+            wheel->now = now;
+    }
+    return first;
+}
@@ -0,0 +1,62 @@
+#ifndef TIMER_WHEEL_H_INCLUDED
+#define TIMER_WHEEL_H_INCLUDED
+
+#include <stdbool.h>
+
+/* ==== TIMER WHEELS ---------------------------------------------- *
+ * A timer wheel keeps timers that go off after a whole number of   *
+ * ticks, so that adding one, cancelling one, and finding the ones  *
+ * that have gone off each cost the same however many are pending.  *
+ * The wheel has several levels of slots: a timer goes in the level *
+ * whose span of ticks its expiry falls in, and when a level comes  *
+ * round to one of its slots, the timers in that slot move down to  *
+ * the finer level below; only the bottom level's timers go off.    *
+ *                                                                  *
+ * A wheel is not shared between threads.                           */
+
+/* each level has 2^WHEEL_BITS slots, so the wheel as a whole spans *
+ * 2^(WHEEL_BITS * WHEEL_LEVELS) ticks; a timer due any later than  *
+ * that is filed at the end of the span, and filed again from there *
+ * until it is due                                                  */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/* a pending timer; the wheel only looks at 'expiry' and the links, *
+ * and the rest says what the timer is for                          */
+struct Timer
+{
+    unsigned long due;    // tick at which it goes off...
+    unsigned long expiry; // ...or the one it is filed under, if sooner
+    int kind;
+    int PID;
+    int request_id;
+    void *waiter;         // (a timed RECV's) waiter, kept by its shard
+    struct Timer **slot;  // the slot it is in (NULL if in none)
+    struct Timer *prev;
+    struct Timer *next;
+};
+
+struct TimerWheel
+{
+    unsigned long now;    // the last tick that has been handled
+    int count;            // timers pending
+    struct Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/* this function sets up an empty wheel at tick 'now'               */
+void wheel_init(struct TimerWheel *wheel, unsigned long now);
+
+/* this function sets a timer to go off at tick 'expiry' (or at the *
+ * next tick, if that has been and gone), however far off it is     */
+void wheel_add(struct TimerWheel *wheel, struct Timer *timer, unsigned long expiry);
+
+/* this function cancels a pending timer                            */
+void wheel_remove(struct TimerWheel *wheel, struct Timer *timer);
+
+/* this function moves the wheel on to tick 'now' and returns the   *
+ * timers that have gone off on the way (linked by 'next', earliest *
+ * first), which are no longer in the wheel                         */
+struct Timer * wheel_advance(struct TimerWheel *wheel, unsigned long now);
+
+#endif
@@ -1,65 +1,123 @@
 #include "yams_headers.h"
 #include "fio_handlers.h"
 #include "ipc_messaging.h"
+#include "ring_buffers.h"
+#include <sys/socket.h>
+#include <sys/un.h>
 
 /* ---------- define key communication variables ---------- */
-int fd_incoming, fd_syscall, fd_commchannel; // file descriptors for communication FIFO's
+int fd_incoming, fd_syscall; // file descriptors for communication FIFO's (or both our socket)
+int transport = TRANSPORT_FIFO; // how we talk to the process server
+int max_frame_size = MAX_FRAME_SIZE; // largest frame we send in one piece
 int my_linux_PID, my_client_PID; // host OS and process server PID's
 char client_fifo_name[STRING_SIZE]; // filename for our client FIFO
-char response_string[STRING_SIZE * 2]; // server response string
 int response_int; // server response integer
+int next_request_id = 1; // id of the next request we send to the server
+struct OutBuffer params = {NULL, 0, 0}; // packed parameters of the request being built
+struct OutBuffer frame = {NULL, 0, 0}; // outgoing request frame(s)
+struct InBuffer reply = {NULL, 0, 0, 0}; // payload of the server's latest reply frame
+struct InBuffer piece = {NULL, 0, 0, 0}; // one packet of a reply that came in pieces
+struct Ring send_ring, recv_ring; // shared-memory rings for big message bodies...
+bool use_rings = false;           // ...if the server agreed to use them
 
-/* this function sends a system call to the process server  */    
-void send(int syscall_code)
+/* this function reads the server's next reply frame into   *
+ * 'reply'; on a socket, a big reply arrives as FRAGMENT    *
+ * frames ahead of the last piece, so stitch them together  */
+bool read_reply(struct FrameHeader *hdr)
 {
-    // send system call and PID to process server:
-    printf("<- Sending syscall %03o to process server\n", syscall_code);
-    write_int(fd_syscall, &syscall_code);
-    write_int(fd_syscall, &my_client_PID);
-    // wait for the server to issue a "lock" before we proceed:
-    read_int(fd_incoming, &response_int);
+    if(transport == TRANSPORT_FIFO)
+        return read_frame(fd_incoming, hdr, &reply);
+    reply.size = 0;
+    do {
+        if(!read_packet(fd_incoming, hdr, &piece, true))
+            return false;
+        append_bytes(&reply, piece.data, piece.size);
+    } while(hdr->opcode == SYSCALL_FRAGMENT);
+    hdr->length = reply.size;
+    reply.pos = 0;
+    return true;
 }
 
-/* this function reads a response string from the IPC       *
- * server and echoes the response to the console            */
-void read_string_and_echo()
+/* this function sends a system call to the process server  *
+ * along with the parameters that have been packed into     *
+ * 'params', then waits for the server's reply frame; it    *
+ * returns the status code at the start of the reply and    *
+ * leaves the rest of the reply in 'reply' for unpacking    */
+int call_server(int syscall_code)
 {
-    // read and echo server response:
-    read_string(fd_incoming, response_string, STRING_SIZE * 2);
-    printf("-> Server sent response: %s\n", response_string);
+    printf("<- Sending syscall %03o to process server\n", syscall_code);
+    int request_id = next_request_id++;
+    // each frame must fit in one atomic write to the syscall FIFO (or
+    // one packet on the socket), so a big payload goes out as FRAGMENT
+    // frames ahead of the last piece:
+    int frame_start = begin_frame(&frame, syscall_code, my_client_PID, request_id);
+    pack_bytes(&frame, params.data, params.size);
+    end_frame(&frame, frame_start);
+    write_frame_pieces(fd_syscall, &frame, max_frame_size, SYSCALL_FRAGMENT);
+    params.size = 0;
+    // now wait for the reply to this request:
+    struct FrameHeader hdr;
+    int status = STATUS_ERROR;
+    if(!read_reply(&hdr) || hdr.request_id != request_id || !unpack_int(&reply, &status))
+        printf("-> Server sent a malformed reply\n");
+    return status;
 }
 
-/* this function reads an integer response code from the    *
- * IPC server and echoes the response to the console        */
-void read_int_and_echo()
+/* this function explains a non-OK status code              */
+void print_status(int status)
 {
-    // read and echo server response:
-    read_int(fd_incoming, &response_int);
-    printf("-> Server sent response: %d\n", response_int);
+    switch (status)
+    {
+    case STATUS_OK:
+        printf("-> Server sent response: OK\n");
+        break;
+    case STATUS_UNKNOWN_SYSCALL:
+        printf("-> Server returned an error: unknown system call\n");
+        break;
+    case STATUS_BAD_REQUEST:
+        printf("-> Server returned an error: malformed request\n");
+        break;
+    case STATUS_DROPPED:
+        printf("-> Server dropped the message: this client is too far behind\n");
+        break;
+    case STATUS_TIMEOUT:
+        printf("-> Server gave up: the time ran out\n");
+        break;
+    default:
+        printf("-> Server returned error code %d\n", status);
+        break;
+    }
 }
 
 /* this function reads input from the user and sends it as  *
- * a message to the IPC server                              */
-void send_message()
+ * a message to the IPC server (or, with SYSCALL_PUBLISH, to *
+ * a topic)                                                 */
+void send_message(int syscall_code)
 {
     /* syscall SEND                             *
      * parameters: C-string: mailbox,           *
      * int: priority                            *
      * int: message type                        *
      * int: number of C-strings to send         *
-     * list of C-strings: messages themselves   */ 
+     * list of C-strings: messages themselves   *
+     * (a list of mailboxes separated by commas, *
+     * or a pattern, makes it a SEND_MULTI)     */ 
 
     char mbox_name[STRING_SIZE];
     char input;
     int priority, type, lines;
     // ask user to specify destination mailbox:
-    printf("Enter name of mailbox to send to: ");
+    bool publish = (syscall_code == SYSCALL_PUBLISH);
+    if(publish)
+        printf("Enter name of topic to publish to: ");
+    else
+        printf("Enter name of mailbox to send to (or several, separated by commas; or a pattern): ");
     scanf("%s", mbox_name);
     // enter a data validation loop for message priority:
     bool bad_data = true;
     while(bad_data)
     {
-        printf("Message priority [(B)ATCH, (N)ORMAL, (I)NTERRUPT]? ");
+        printf("Message priority [(S)PAM, (B)ATCH, (N)ORMAL, (I)NTERRUPT]? ");
         //clear residual newline character:
         scanf("%c", &input);
         //now get actual data:
@@ -67,6 +125,10 @@ void send_message()
         bad_data = false;
         switch (input)
         {
+        case 's':
+        case 'S':
+            priority = PRIORITY_SPAM;
+            break;
         case 'b':
         case 'B':
             priority = PRIORITY_BATCH;
@@ -119,39 +181,95 @@ void send_message()
             break;
         }
     }
-    // send what we have of the sys call params so far:
-    printf("<- sending message to: %s with priority %d and type %d\n", mbox_name, priority, type);
-    write_string(fd_commchannel, mbox_name);
-    write_int(fd_commchannel, &priority);
-    write_int(fd_commchannel, &type);
-    // read and echo server response:
-    read_string_and_echo();
+    // pack what we have of the sys call params so far:
+    bool multicast = (!publish && strpbrk(mbox_name, ",*?[") != NULL);
+    if(multicast)
+    {
+        pack_int(&params, priority);
+        pack_int(&params, type);
+        // one string per target (split up in a copy, since the whole
+        // list is wanted for the message below):
+        char targets[STRING_SIZE];
+        strcpy(targets, mbox_name);
+        int num_targets = 0, targets_offset = params.size;
+        pack_int(&params, 0);
+        for(char *target = strtok(targets, ","); target != NULL; target = strtok(NULL, ","))
+        {
+            pack_string(&params, target);
+            num_targets++;
+        }
+        memcpy(params.data + targets_offset, &num_targets, sizeof(int));
+    }
+    else
+    {
+        pack_string(&params, mbox_name);
+        pack_int(&params, priority);
+        pack_int(&params, type);
+    }
+    // the line count goes next, but we do not know it yet,
+    // so leave room for it and fill it in at the end:
+    int count_offset = params.size;
+    pack_int(&params, 0);
     
     printf("Now enter your message, one line at a time, blank line to end:\n");
     lines = 0;
-    char send_string[STRING_SIZE];
+    // lines may be any length, so getline() grows this as needed:
+    char *send_string = NULL;
+    size_t send_size = 0;
+    ssize_t length;
     // clear the trailing newline character from the input buffer:
-    fgets(send_string, STRING_SIZE, stdin);
+    getline(&send_string, &send_size, stdin);
     do {
         printf("LINE %d: ", ++lines);
-        fgets(send_string, STRING_SIZE, stdin);
+        length = getline(&send_string, &send_size, stdin);
         // strip trailing newline character:
-        send_string[strlen(send_string)-1] = '\0';
-        write_string(fd_commchannel, send_string);
-    } while(strlen(send_string) > 0);
+        if(length > 0 && send_string[length - 1] == '\n')
+            length--;
+        if(length > 0)
+            pack_chars(&params, send_string, length);
+    } while(length > 0);
+    free(send_string);
     // we actually over-count lines by one because of the
     // last empty line, so...
     lines--;
-    printf("Sent %d message lines to server\n", lines);
-    read_string_and_echo();            
+    memcpy(params.data + count_offset, &lines, sizeof(int));
+    printf("<- sending message to: %s with priority %d and type %d\n", mbox_name, priority, type);
+    // a big message goes into our send ring, and the server only
+    // gets told where to find it:
+    // (the body of a multicast or PUBLISH always goes inline)
+    if(multicast)
+        syscall_code = SYSCALL_SEND_MULTI;
+    int body_start = count_offset + sizeof(int);
+    int body_length = params.size - body_start;
+    int offset = RING_INLINE;
+    if(use_rings && syscall_code == SYSCALL_SEND && body_length >= RING_THRESHOLD)
+        offset = ring_reserve(&send_ring, body_length);
+    if(offset != RING_INLINE)
+    {
+        memcpy(ring_data(&send_ring, offset), params.data + body_start, body_length);
+        params.size = body_start;
+        pack_int(&params, offset);
+        pack_int(&params, body_length);
+        syscall_code = SYSCALL_SEND_SHARED;
+        printf("<- message lines (%d bytes) are in the shared ring at offset %d\n", body_length, offset);
+    }
+    int status = call_server(syscall_code);
+    int reached;
+    if(syscall_code != SYSCALL_SEND && status == STATUS_OK && unpack_int(&reply, &reached))
+        printf("-> Server delivered %d message lines to %d mailboxes\n", lines, reached);
+    else if(syscall_code == SYSCALL_SEND && status == STATUS_OK && unpack_int(&reply, &lines))
+        printf("-> Server received %d message lines\n", lines);
+    else
+        print_status(status);
 }
 
 void check_messages()
 {
-    /* send syscall CONFIGURE                       *
+    /* send syscall CHECK                           *
      * parameters:                                  *
      * int: priority level                          *
-     * int: message type                            */
+     * int: message type                            *
+     * C-string: sender mailbox                     */
     char input;
     int priority, type;
     char sender[STRING_SIZE];
@@ -183,8 +301,8 @@ void check_messages()
         priority = PRIORITY_ALL;
         break;
     }
-    //send requested priority to server:
-    write_int(fd_commchannel, &priority);
+    //pack requested priority:
+    pack_int(&params, priority);
     
     printf("Check for messages of what type [(I)NFO, RE(Q)UEST, (S)TATUS, (R)ESULT, (A)LL]? ");
     //clear residual newline character:
@@ -213,24 +331,49 @@ void check_messages()
         type = TYPE_ALL;
         break;
     }
-    //send requested message type to server:
-    write_int(fd_commchannel, &type);
+    //pack requested message type:
+    pack_int(&params, type);
 
     printf("Check for messages from what sender mailbox [type '*' for all]? ");
     scanf("%s", sender);
-    write_string(fd_commchannel, sender);
+    pack_string(&params, sender);
 
-    printf("<- Sent CHECK(%d, %d, %s) request to server\n", priority, type, sender);
+    printf("<- Sending CHECK(%d, %d, %s) request to server\n", priority, type, sender);
     // read and echo server response:
-    read_string_and_echo();
+    int count;
+    int status = call_server(SYSCALL_CHECK);
+    if(status == STATUS_OK && unpack_int(&reply, &count))
+    {
+        char pri[SHORT_STRING], typ[SHORT_STRING];
+        pri_str(pri, priority);
+        typ_str(typ, type);
+        printf("-> You have %d messages of priority %s and type %s from sender %s\n", count, pri, typ, sender);
+    }
+    else
+        print_status(status);
 }
 
-void fetch_message()
+/* this function asks how long a timed call may wait, and     *
+ * packs that ahead of its other parameters                   */
+void ask_timeout(int syscall_code)
 {
-    /* send syscall FETCH                           *
-     * parameters:                                  *
+    int timeout;
+    if(syscall_code != SYSCALL_JOINPID_TIMED && syscall_code != SYSCALL_WAIT_TIMED && syscall_code != SYSCALL_RECV_TIMED)
+        return;
+    printf("Give up after how many milliseconds? ");
+    scanf("%d", &timeout);
+    pack_int(&params, timeout);
+}
+
+/* this function asks the user which messages to receive and  *
+ * packs the filter (priority, type, sender) into the params; *
+ * subscriptions have no sender, so 'with_sender' may be false */
+void ask_filter(char *what, bool with_sender)
+{
+    /* the filter is:                               *
      * int: priority level                          *
-     * int: message type                            */
+     * int: message type                            *
+     * C-string: sender mailbox                     */
     char input;
     int priority, type;
     char sender[STRING_SIZE];
@@ -262,8 +405,8 @@ void fetch_message()
         priority = PRIORITY_ALL;
         break;
     }
-    //send requested priority to server:
-    write_int(fd_commchannel, &priority);
+    //pack requested priority:
+    pack_int(&params, priority);
     
     printf("Receive message of what type? [(I)NFO, RE(Q)UEST, (S)TATUS, (R)ESULT, (A)LL] ");
     //clear residual newline character:
@@ -292,31 +435,49 @@ void fetch_message()
         type = TYPE_ALL;
         break;
     }
-    //send requested message type to server:
-    write_int(fd_commchannel, &type);
+    //pack requested message type:
+    pack_int(&params, type);
 
+    if(!with_sender)
+    {
+        printf("<- Sending %s(%d, %d) request to server\n", what, priority, type);
+        return;
+    }
     printf("Receive message from what sender mailbox [type '*' for all]? ");
     scanf("%s", sender);
-    write_string(fd_commchannel, sender);
-
+    pack_string(&params, sender);
 
-    printf("<- Sent FETCH(%d, %d, %s) request to server\n", priority, type, sender);
+    printf("<- Sending %s(%d, %d, %s) request to server\n", what, priority, type, sender);
+}
 
-    /* response takes the following form                                    *
+/* this function prints the next message in the server's reply */
+void print_message()
+{
+    /* a message takes the following form                                   *
      * - int: priority                                                      *
      * - int: message type                                                  *
      * - C-string: sender mailbox name                                      *
      * - int: number of lines                                               *
      * - (n) C-strings: the message                                         */
     // read response from the server:
-    int num_lines;
-    char pri[SHORT_STRING], typ[SHORT_STRING];
-    read_int(fd_incoming, &priority);
+    int priority, type, num_lines;
+    char pri[SHORT_STRING], typ[SHORT_STRING], sender[STRING_SIZE];
+    unpack_int(&reply, &priority);
     pri_str(pri, priority);
-    read_int(fd_incoming, &type);
+    unpack_int(&reply, &type);
     typ_str(typ, type);
-    read_string(fd_incoming, sender, STRING_SIZE);
-    read_int(fd_incoming, &num_lines);
+    unpack_string(&reply, sender, STRING_SIZE);
+    if(!unpack_int(&reply, &num_lines))
+        num_lines = 0;
+    // with the rings in use, the lines may be waiting in our receive ring:
+    struct InBuffer *lines = &reply;
+    struct InBuffer shared = {NULL, 0, 0, 0};
+    int offset = RING_INLINE, length = 0;
+    if(use_rings && unpack_int(&reply, &offset) && offset != RING_INLINE && unpack_int(&reply, &length))
+    {
+        shared = (struct InBuffer){ring_data(&recv_ring, offset), length, 0, 0};
+        lines = &shared;
+    }
     if (num_lines == 0)
     {
         printf("-> Your mailbox contained an empty message:\n");
@@ -332,16 +493,66 @@ void fetch_message()
         printf("====----\n");
         for (int i = 0; i < num_lines; i++)
         {
-            char message_line[STRING_SIZE];
-            read_string(fd_incoming, message_line, STRING_SIZE);
-            printf("%s\n", message_line);
+            char *message_line = "";
+            int length = 0;
+            unpack_chars(lines, &message_line, &length);
+            printf("%.*s\n", length, message_line);
         }
         printf("====----\n");
     }
+    // we are done with the lines, so the server may re-use their slot:
+    if(lines == &shared)
+        ring_release(&recv_ring, offset);
 }
 
-int main()
+void fetch_message(int syscall_code)
 {
+    /* send syscall FETCH                           *
+     * parameters: the filter (see ask_filter)      *
+     * (RECV_TIMED: a timeout in ms first)          */
+    ask_timeout(syscall_code);
+    ask_filter("FETCH", true);
+    int status = call_server(syscall_code);
+    if(status == STATUS_OK)
+        print_message();
+    else
+        print_status(status);
+}
+
+void fetch_batch()
+{
+    /* send syscall RECV_BATCH                      *
+     * parameters: the filter (see ask_filter)      *
+     * int: most messages to receive                *
+     * int: byte budget (0 = none)                  */
+    int max_msgs, max_bytes, num_msgs;
+    printf("Receive how many messages at most? ");
+    scanf("%d", &max_msgs);
+    printf("Stop after how many bytes of them [0 for no limit]? ");
+    scanf("%d", &max_bytes);
+    ask_filter("FETCH BATCH", true);
+    pack_int(&params, max_msgs);
+    pack_int(&params, max_bytes);
+    int status = call_server(SYSCALL_RECV_BATCH);
+    if(status != STATUS_OK || !unpack_int(&reply, &num_msgs))
+    {
+        print_status(status);
+        return;
+    }
+    printf("-> Server sent %d messages\n", num_msgs);
+    for(int i = 0; i < num_msgs; i++)
+        print_message();
+}
+
+int main(int argc, char *argv[])
+{
+    // "yams socket" talks to the server over its socket instead of the FIFOs:
+    if(argc > 1 && strcmp(argv[1], "socket") == 0)
+    {
+        transport = TRANSPORT_SOCKET;
+        max_frame_size = MAX_PACKET_SIZE;
+    }
+
     // greet the user
     printf("-~= Welcome to Yet Another Messaging Service =~-\n");
     
@@ -350,35 +561,96 @@ int main()
     printf("Enter your mailbox name with no spaces: ");
     scanf("%s", mailbox_name);
     
-    // open FIFO for reading incoming connections:
-    printf("YAMS client: opening syscall FIFO at %s\n", SERVER_FIFO_1);
-    fd_syscall = open(SERVER_FIFO_1, O_WRONLY);
-    printf("YAMS client: opening comm-channel FIFO at %s\n", SERVER_FIFO_1);
-    fd_commchannel = open(SERVER_FIFO_2, O_WRONLY);
-
     // get PID for sending to server:
     my_linux_PID = getpid();
     srand(my_linux_PID);
 
-    // modify client FIFO name with PID and create FIFO:
-    sprintf(client_fifo_name, CLIENT_FIFO, my_linux_PID);
-    mkfifo(client_fifo_name, FIFO_MODE);
+    if(transport == TRANSPORT_FIFO)
+    {
+        // open FIFO for reading incoming connections:
+        printf("YAMS client: opening syscall FIFO at %s\n", SERVER_FIFO_1);
+        fd_syscall = open(SERVER_FIFO_1, O_WRONLY);
+
+        // modify client FIFO name with PID and create FIFO:
+        sprintf(client_fifo_name, CLIENT_FIFO, my_linux_PID);
+        mkfifo(client_fifo_name, FIFO_MODE);
+    }
+    else
+    {
+        // our one socket connection carries requests and replies alike:
+        printf("YAMS client: connecting to server socket at %s\n", SERVER_SOCKET);
+        struct sockaddr_un address = {.sun_family = AF_UNIX};
+        strncpy(address.sun_path, SERVER_SOCKET, sizeof(address.sun_path) - 1);
+        fd_syscall = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        if(connect(fd_syscall, (struct sockaddr *)&address, sizeof(address)) < 0)
+        {
+            printf("YAMS client: could not connect to process server at %s\n", SERVER_SOCKET);
+            return -1;
+        }
+        fd_incoming = fd_syscall;
+    }
+
+    // set up the shared-memory rings for big messages (the server
+    // sends everything inline if this does not work out):
+    char send_ring_name[STRING_SIZE], recv_ring_name[STRING_SIZE];
+    sprintf(send_ring_name, SEND_RING_NAME, my_linux_PID);
+    sprintf(recv_ring_name, RECV_RING_NAME, my_linux_PID);
+    int ring_size = 0;
+    if(ring_create(&send_ring, send_ring_name, RING_SIZE) && ring_create(&recv_ring, recv_ring_name, RING_SIZE))
+        ring_size = RING_SIZE;
 
-    /* send CONNECT syscall                         *
-     * parameters: int: PID, C-string: mailbox name */
+    /* send CONNECT syscall as a v2 frame           *
+     * header: host-OS PID                          *
+     * parameters: int: protocol version,           *
+     * C-string: mailbox name,                      *
+     * int: size of each shared-memory ring         */
     printf("YAMS client: logging into process server\n");
     int syscall_code = SYSCALL_CONNECT;
-    write(fd_syscall, &syscall_code, sizeof(int));
-    write(fd_syscall, &my_linux_PID, sizeof(int));
-    write_string(fd_commchannel, mailbox_name);
+    struct OutBuffer connect_frame = {NULL, 0, 0};
+    int frame_start = begin_frame(&connect_frame, SYSCALL_CONNECT, my_linux_PID, 0);
+    pack_int(&connect_frame, PROTOCOL_VERSION);
+    pack_string(&connect_frame, mailbox_name);
+    pack_int(&connect_frame, ring_size);
+    end_frame(&connect_frame, frame_start);
+    write_frame_pieces(fd_syscall, &connect_frame, max_frame_size, SYSCALL_FRAGMENT);
+    free_buffer(&connect_frame);
     
-    // open FIFO for reading incoming connections:
-    printf("YAMS client: creating and opening client FIFO at %s\n", client_fifo_name);
-    fd_incoming = open(client_fifo_name, O_RDONLY);
+    if(transport == TRANSPORT_FIFO)
+    {
+        // open FIFO for reading incoming connections:
+        printf("YAMS client: creating and opening client FIFO at %s\n", client_fifo_name);
+        fd_incoming = open(client_fifo_name, O_RDONLY);
+    }
 
     // read and report server connection:
-    read_int(fd_incoming, &my_client_PID);
+    struct FrameHeader hdr;
+    int status = STATUS_ERROR, version = PROTOCOL_V1, rings_mapped = 0;
+    if(read_reply(&hdr))
+    {
+        unpack_int(&reply, &status);
+        unpack_int(&reply, &my_client_PID);
+        unpack_int(&reply, &version);
+        unpack_int(&reply, &rings_mapped);
+    }
+    // the server has the rings mapped by now (or never will), so
+    // their names can go:
+    ring_unlink(send_ring_name);
+    ring_unlink(recv_ring_name);
+    use_rings = (ring_size > 0 && rings_mapped);
+    if(status != STATUS_OK || version != PROTOCOL_V2)
+    {
+        printf("YAMS client: process server refused the connection (status %d, protocol v%d)\n", status, version);
+        fio_close(fd_syscall);
+        if(transport == TRANSPORT_FIFO)
+        {
+            fio_close(fd_incoming);
+            unlink(client_fifo_name);
+        }
+        return -1;
+    }
     printf("YAMS client: process server confirmed connection and gave me PID #%d.\n", my_client_PID);
+    if(use_rings)
+        printf("YAMS client: big messages will go through shared memory\n");
 
     // now that server is connected, go into input-action loop:
     while (syscall_code != SYSCALL_EXIT && syscall_code != SYSCALL_SHUTDOWN)
@@ -388,23 +660,20 @@ int main()
         printf("Enter a system call (%d = ping server, ", SYSCALL_PING);
         printf("%d = disconnect and exit, %d = kill server and exit,\n", SYSCALL_EXIT, SYSCALL_SHUTDOWN);
         printf("%d = send message, %d = check for messages, ", SYSCALL_SEND, SYSCALL_CHECK);
-        printf("%d = fetch first message, %d = configure mailbox,\n", SYSCALL_RECV, SYSCALL_CONFIGURE);
+        printf("%d = fetch first message, %d = fetch many messages,\n", SYSCALL_RECV, SYSCALL_RECV_BATCH);
+        printf("%d = configure mailbox, %d = subscribe to topic, ", SYSCALL_CONFIGURE, SYSCALL_SUBSCRIBE);
+        printf("%d = unsubscribe, %d = publish to topic,\n", SYSCALL_UNSUBSCRIBE, SYSCALL_PUBLISH);
         printf("%d = get PID, %d = get age, %d = join PID, ", SYSCALL_GETPID, SYSCALL_GETAGE, SYSCALL_JOINPID);
-        printf("%d = wait PID, %d = signal PID): ", SYSCALL_WAIT, SYSCALL_SIGNAL);
+        printf("%d = wait PID, %d = signal PID,\n", SYSCALL_WAIT, SYSCALL_SIGNAL);
+        printf("%d = fetch with timeout, %d = join with timeout, %d = wait with timeout): ", SYSCALL_RECV_TIMED, SYSCALL_JOINPID_TIMED, SYSCALL_WAIT_TIMED);
         // read user's choice:
         scanf("%d", &syscall_code);
         printf("\n--------------------------------------------------------------------------------\n\n");
-        
-        // send system call and PID to process server:
-        send(syscall_code);
 
         // set up some more communication variables:
         char key[STRING_SIZE/2], value[STRING_SIZE/2]; // key-value pairs for CONFIGURE syscall
         char send_string[STRING_SIZE]; // several syscalls require sending a string
         int send_int; // several syscalls send an integer parameter
-        char send_char;
-        bool bad_data = false;
-        int response_int; // response code from server
 
         // now respond to the user's choice more specifically:
         switch(syscall_code)
@@ -414,23 +683,27 @@ int main()
                  * no parameters         */
                 printf("Killing server and quitting client. Good-bye!\n");
                 // read and echo server response:
-                read_string_and_echo();
+                print_status(call_server(syscall_code));
                 break;
             case SYSCALL_EXIT:
                 /* send syscall DISCONNECT *
                  * no parameters           */
                 printf("Disconnecting from server and quitting client. Good-bye!\n");
                 // read and echo server response:
-                read_string_and_echo();
+                print_status(call_server(syscall_code));
                 break;
             case SYSCALL_PING:
                 /* send syscall PING                         *
                  * one parameter: int (here chosen randomly) */
                 send_int = rand();
                 printf("<- Sending ping with code %d\n", send_int);
-                write_int(fd_commchannel, &send_int);
+                pack_int(&params, send_int);
                 // read and echo server response:
-                read_string_and_echo();
+                status = call_server(syscall_code);
+                if(status == STATUS_OK && unpack_int(&reply, &response_int))
+                    printf("-> Server bounced back PING code %d\n", response_int);
+                else
+                    print_status(status);
                 break;
             case SYSCALL_CONFIGURE:
                 // ask user to specify number of settings:
@@ -440,11 +713,8 @@ int main()
                  * parameters:                                  *
                  * int: # of settings,                          *
                  * list of C-string pairs: settings themselves  */ 
-                printf("<- Sending CONFIGURE %d request to server\n", send_int);
-                write_int(fd_commchannel, &send_int);
-                // read and echo server response:
-                read_string_and_echo();
-                // now handle the individual settings:
+                pack_int(&params, send_int);
+                // now gather the individual settings:
                 for(int i = 1; i <= send_int; i++)
                 {
                     // prompt for the setting name (key):
@@ -453,60 +723,107 @@ int main()
                     // prompt for the setting value:
                     printf("value #%d: ", i);
                     scanf("%s", value);
-                    // build and send a send-string:
+                    // build and pack a send-string:
                     sprintf(send_string, "%s:%s", key, value);
                     printf("<- Configuring %s\n", send_string);
-                    write_string(fd_commchannel, send_string);
-                    // read and echo server response:
-                    read_string_and_echo();
+                    pack_string(&params, send_string);
+                }
+                printf("<- Sending CONFIGURE %d request to server\n", send_int);
+                // read and echo server response:
+                status = call_server(syscall_code);
+                if(status == STATUS_OK && unpack_int(&reply, &response_int))
+                {
+                    printf("-> Server received %d settings\n", response_int);
+                    if(unpack_int(&reply, &response_int))
+                        printf("-> Mailbox has had %d messages expire\n", response_int);
                 }
-                printf("Sent %d settings to server\n", send_int);
+                else
+                    print_status(status);
                 break; 
             case SYSCALL_SEND:
-                send_message();
+            case SYSCALL_PUBLISH:
+                send_message(syscall_code);
+                break;
+            case SYSCALL_SUBSCRIBE:
+            case SYSCALL_UNSUBSCRIBE:
+                /* send syscall (UN)SUBSCRIBE              *
+                 * parameters: C-string: topic             *
+                 * (SUBSCRIBE) the filter, with no sender  */
+                printf("Enter name of topic: ");
+                scanf("%s", send_string);
+                pack_string(&params, send_string);
+                if(syscall_code == SYSCALL_SUBSCRIBE)
+                    ask_filter("SUBSCRIBE", false);
+                else
+                    printf("<- Sending UNSUBSCRIBE request to server\n");
+                status = call_server(syscall_code);
+                if(status == STATUS_OK && unpack_int(&reply, &response_int))
+                    printf("-> Topic %s has %d subscribers\n", send_string, response_int);
+                else
+                    print_status(status);
                 break;
             case SYSCALL_CHECK:
                 check_messages();
                 break;
             case SYSCALL_RECV:
-                fetch_message();
+            case SYSCALL_RECV_TIMED:
+                fetch_message(syscall_code);
+                break;
+            case SYSCALL_RECV_BATCH:
+                fetch_batch();
                 break;
             case SYSCALL_GETPID:
                 /* send syscall GETPID                     *
                  * no parameters                           */
-                printf("<- Sent GETPID request to server\n");
-                read_int(fd_incoming, &response_int);
-                printf("This process' PID is %d\n", response_int);
+                printf("<- Sending GETPID request to server\n");
+                status = call_server(syscall_code);
+                if(status == STATUS_OK && unpack_int(&reply, &response_int))
+                    printf("This process' PID is %d\n", response_int);
+                else
+                    print_status(status);
                 break;
             case SYSCALL_GETAGE:
-                /* send syscall GETPID                     *
+                /* send syscall GETAGE                     *
                  * no parameters                           */
-                printf("<- Sent GETAGE request to server\n");
-                read_int(fd_incoming, &response_int);
-                printf("This process' age is %d seconds\n", response_int);
+                printf("<- Sending GETAGE request to server\n");
+                status = call_server(syscall_code);
+                if(status == STATUS_OK && unpack_int(&reply, &response_int))
+                    printf("This process' age is %d seconds\n", response_int);
+                else
+                    print_status(status);
                 break;
             case SYSCALL_JOINPID:
+            case SYSCALL_JOINPID_TIMED:
                 /* send syscall JOINPID                    *
-                 * one parameter: int PID to join          */
+                 * one parameter: int PID to join          *
+                 * (JOINPID_TIMED: a timeout in ms first)  */
+                ask_timeout(syscall_code);
                 printf("What process ID do you want to JOIN? ");
                 scanf("%d", &send_int);
                 printf("<- Telling server to wake me up when process %d EXITs\n", send_int);
-                write_int(fd_commchannel, &send_int);
-                read_int(fd_incoming, &response_int);
-                if(response_int < 0)
+                pack_int(&params, send_int);
+                status = call_server(syscall_code);
+                if(status == STATUS_TIMEOUT)
+                    print_status(status);
+                else if(status != STATUS_OK)
                     printf("-> Server returned an error: invalid PID\n");
                 else
                     printf("-> Process %d has EXITed successfully\n", send_int);
                 break;
             case SYSCALL_WAIT:
+            case SYSCALL_WAIT_TIMED:
                 /* send syscall WAIT                       *
-                 * one parameter: int PIT to wait for      */
+                 * one parameter: int PIT to wait for      *
+                 * (WAIT_TIMED: a timeout in ms first)     */
+                ask_timeout(syscall_code);
                 printf("What process ID do you want to WAIT for a SIGNAL from? ");
                 scanf("%d", &send_int);
                 printf("<- Telling server to wake me up on a SIGNAL form process %d\n", send_int);
-                write_int(fd_commchannel, &send_int);
-                read_int(fd_incoming, &response_int);
-                if(response_int < 0)
+                pack_int(&params, send_int);
+                status = call_server(syscall_code);
+                if(status == STATUS_TIMEOUT)
+                    print_status(status);
+                else if(status != STATUS_OK)
                     printf("-> Server returned an error: invalid PID\n");
                 else
                     printf("-> Process %d has SIGNALed successfully\n", send_int);
@@ -517,9 +834,8 @@ int main()
                 printf("What process ID do you want to send a SIGNAL to? ");
                 scanf("%d", &send_int);
                 printf("<- Telling server to SIGNAL process #%d\n", send_int);
-                write_int(fd_commchannel, &send_int);
-                read_int(fd_incoming, &response_int);
-                if(response_int < 0)
+                pack_int(&params, send_int);
+                if(call_server(syscall_code) != STATUS_OK)
                     printf("-> Server returned an error: specified process was not WAITing for a SIGNAL\n");
                 else
                     printf("-> Process %d has received the SIGNAL successfully\n", send_int);
@@ -527,15 +843,17 @@ int main()
             default:
                 printf("%d is not a valid system call\n", syscall_code);
                 // read and echo server response:
-                read_string_and_echo();
+                print_status(call_server(syscall_code));
         }
     }
 
     /* clean up our files on the way out */
-    close(fd_syscall);
-    close(fd_commchannel);
-    close(fd_incoming);
-    unlink(client_fifo_name);
+    fio_close(fd_syscall);
+    if(transport == TRANSPORT_FIFO)
+    {
+        fio_close(fd_incoming);
+        unlink(client_fifo_name);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
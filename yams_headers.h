@@ -9,6 +9,7 @@
 #include <stdio.h> 
 #include <stdlib.h>
 #include <string.h> 
+#include <limits.h>
 
 /* -------------------------------------------------------------------- *
  * ----------       YAMS: Yet Another Messaging System        --------- *
@@ -23,9 +24,11 @@
  * requests and system calls and a dedicated client FIFO for each       *
  * client process, using the client's host-OS PID as a naming key.      *
  * Each client process is assigned a unique PID for purposes of         *
- * identifying it within the set of client processes, and also as an    *
- * index into the array of current client records. Each client also     *
- * provides an IPC mailbox name as a C-string of up to 255 characters.  */
+ * identifying it within the set of client processes: the slot of its   *
+ * record in the server's client table, with a generation number above  *
+ * it so that a PID is not re-used as soon as its client goes away (see *
+ * MAX_CLIENTS). Each client also provides an IPC mailbox name as a    *
+ * C-string of up to 255 characters.                                    */
 
 /* ---------------------- DEFINE FIFO FILES HERE ---------------------- */
 /* The first (syscall) FIFO is used to receive system calls from client *
@@ -33,7 +36,8 @@
  * to that processs for sending IPC messages; this way 'stray' system   *
  * calls from other processes will not get mixed in with the IPC        *
  * messages being sent by the client who made the syscall we are        *
- * currently handling                                                   */ 
+ * currently handling (version 2 clients send whole requests on the     *
+ * syscall FIFO instead; see DEFINE PROTOCOL VERSIONS below)            */ 
 #define SERVER_FIFO_1 "YAMSD_syscall_fifo"
 #define SERVER_FIFO_2 "YAMSD_comm_channel_fifo"
 /* Each client gets its own "return address" in the form of a FIFO that *
@@ -44,34 +48,122 @@
 /* read from and write to the necessary FIFO files                      */
 #define FIFO_MODE 0666
 
+/* --------------------- DEFINE SOCKET TRANSPORT HERE ------------------ */
+/* Instead of the FIFOs, a v2 client may connect to the server through  *
+ * a Unix-domain SOCK_SEQPACKET socket bound at this path. Each client  *
+ * gets its own connection, which carries its requests and the replies  *
+ * to them; every frame travels as exactly one packet, so message       *
+ * boundaries come for free, and the server learns right away when a    *
+ * client goes away.                                                    */
+#define SERVER_SOCKET "YAMSD_socket"
+/* client transports, chosen when the client starts up                  */
+#define TRANSPORT_FIFO 0
+#define TRANSPORT_SOCKET 1
+
 /* -------------------- DEFINE SOME STANDARD SIZES -------------------- */
-/* For the purposes of this demonstration program, a small array size   *
- * for the connected client manager and the mailbox hash table is large *
- * enough to show proof-of-concept. For a full-scale deployment that    *
- * might need to handle hundreds of processes, we might choose a much   *
- * larger number for LIST_SIZE, we might implement a hash table with    *
- * linked lists like we do for mailboxes here, or we might use a        *
- * dynamically-allocated array that we can copy into a larger array     *
- * when space gets tight, a la the implementation of vector in C++      */
-#define LIST_SIZE 64
+/* The server's client table starts out empty and grows CLIENT_CHUNK   *
+ * records at a time as clients connect, up to MAX_CLIENTS of them at   *
+ * once; a client that CONNECTs after that is turned away with          *
+ * STATUS_FULL (the mailbox tables grow too; see ipc_messaging.h)       */
+#define CLIENT_CHUNK 256
+#define MAX_CLIENTS 65536
+
+/* ------------------- DEFINE PROTOCOL VERSIONS HERE ------------------ */
+/* Version 1 is the original protocol: a bare int syscall code and PID  *
+ * on the syscall FIFO, parameters as loose ints and C-strings on the   *
+ * comm-channel FIFO, and human-readable C-string replies.              *
+ *                                                                      *
+ * Version 2 wraps every request and every reply in a binary frame      *
+ * (see struct FrameHeader in fio_handlers.h): the header carries the   *
+ * syscall code, the client PID, the payload length and a request id,   *
+ * and the payload carries the same parameters as version 1, packed in *
+ * the same order. A client asks for version 2 by sending its CONNECT   *
+ * as a frame; the server answers with the version it will use. Each    *
+ * reply frame echoes the syscall code and request id of the request it *
+ * answers, and its payload always starts with an int status code       *
+ * (one of the STATUS_ codes below) followed by the typed fields listed *
+ * under "v2 response" for each system call.                            *
+ *                                                                      *
+ * v2 requests travel whole on the syscall FIFO, so they need no "lock" *
+ * and never touch the comm-channel FIFO. A frame of at most            *
+ * MAX_FRAME_SIZE bytes goes out in a single write(), which the kernel  *
+ * will not interleave with any other client's writes. A request whose  *
+ * payload is too big for that is split up: all but the last piece are  *
+ * sent as FRAGMENT frames carrying the same request id, and the last   *
+ * piece is sent under the real syscall code; the server stitches the   *
+ * payload back together before handling the request.                   */
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+#define PROTOCOL_VERSION PROTOCOL_V2
+
+/* the largest frame that can be written to a FIFO atomically           */
+#define MAX_FRAME_SIZE PIPE_BUF
+/* the largest frame sent as one packet on a socket connection; bigger  *
+ * payloads are split into FRAGMENT frames just as they are on the      *
+ * FIFOs (and this goes for replies as well as requests)                */
+#define MAX_PACKET_SIZE 65536
+/* the largest payload the server will put back together from FRAGMENT  *
+ * frames; it answers a request that grows any bigger with              *
+ * STATUS_BAD_REQUEST (once its last piece arrives) and throws the      *
+ * pieces away                                                          */
+#define MAX_REQUEST_SIZE (16 << 20)
+
+/* --------------------- DEFINE SHARED-MEMORY RINGS -------------------- */
+/* A v2 client may also set up a pair of shared-memory rings (see       *
+ * ring_buffers.h) before it CONNECTs, so that big message bodies skip  *
+ * the pipes: it writes the packed lines of a big SEND into its send    *
+ * ring and sends only their offset and length with SEND_SHARED, and    *
+ * the server copies them straight into the receiver's receive ring     *
+ * when it delivers them. RING_SIZE is the size of each ring.           */
+#define RING_SIZE (1 << 20)
+/* bodies of fewer bytes than this are cheaper to send inline           */
+#define RING_THRESHOLD MAX_FRAME_SIZE
+
+/* status codes that start every v2 reply                               */
+#define STATUS_OK 0
+#define STATUS_ERROR -1
+#define STATUS_UNKNOWN_SYSCALL -2
+#define STATUS_BAD_REQUEST -3
+#define STATUS_DROPPED -4 // the reply was a SPAM message, and was dropped
+#define STATUS_FULL -5 // (CONNECT) the server cannot take any more clients
+#define STATUS_TIMEOUT -6 // (timed calls) the time ran out first
 
 /* -------------------- DEFINE SYSTEM CALLS HERE ---------------------- */
 
-/* unless otherwise noted, IPC server responds to all sys calls with a  *
- * single C-string status message                                       */
+/* unless otherwise noted, IPC server responds to all v1 sys calls with *
+ * a single C-string status message, and to all v2 sys calls with a    *
+ * status-only reply frame                                              */
 
 /* - octal codes starting with 0 are for connection and disconnection - */
 
 /* CONNECT initiates new connection; it takes two parameters:           *
  * - int: host-OS PID of the client process                             *
- * - C-string: mailbox name.                                            */
+ * - C-string: mailbox name.                                            *
+ * v1 response:                                                         *
+ * - int: PID (-1 if the server has no room for another client)         *
+ * a v2 CONNECT frame carries the host-OS PID in its header and sends   *
+ * its payload along with the header on the syscall FIFO:               *
+ * - int: highest protocol version the client speaks                    *
+ * - C-string: mailbox name                                             *
+ * - int: size of each of the client's rings (optional; 0 = none)       *
+ * v2 response:                                                         *
+ * - int: PID                                                           *
+ * - int: protocol version the server will use                          *
+ * - int: 1 if the server mapped the client's rings, 0 if not           *
+ * (or STATUS_FULL, with nothing after it, if it has no room)           */
 #define SYSCALL_CONNECT 000
 
 /* PING checks connection status by "bouncing" a one-byte               *
  * "packet" off the server; it takes one parameter:                     *
- * - int: arbitrary number that is "bounced" back to the client         */
+ * - int: arbitrary number that is "bounced" back to the client         *
+ * v2 response:                                                         *
+ * - int: the same number                                               */
 #define SYSCALL_PING 001
 
+/* FRAGMENT carries one piece of a v2 request payload that was too big  *
+ * to send in a single frame (see above); it gets no response           */
+#define SYSCALL_FRAGMENT 005
+
 /* DISCONNECT closes client FIFO only; it takes one parameter:          *
  * - int: PID of the client process                                     */
 #define SYSCALL_EXIT 006
@@ -84,32 +176,49 @@
 
 /* GETPID simply requests the client process's PID;                     *
  * (no parameters)                                                      *
- * response:                                                            *
+ * response (v2: after the status code):                                *
  * - int: PID                                                           */
 #define SYSCALL_GETPID 010
 
 /* GETAGE requests the number of seconds the client has been "running"  *
  * (i.e., connected to the process server);                             *
  * (no parameters)                                                      *
- * response:                                                            *
+ * response (v2: after the status code):                                *
  * - int: age of process in seconds                                     */
 #define SYSCALL_GETAGE 011
 
 /* JOINPID puts a process on hold (by blocking as it waits to read a    *
  * response on its client FIFO) until the specified process EXIT's      *
- * - int: PID of process to JOIN                                        */
+ * - int: PID of process to JOIN                                        *
+ * response: int 0 (v2: STATUS_OK) once the process EXIT's, or int -1   *
+ * (v2: STATUS_ERROR) right away if the PID is invalid                  */
 #define SYSCALL_JOINPID 012
 
 /* WAIT puts a process on hold (by blocking as it waits to read a       *
  * response on its client FIFO) until the specified process responds    *
  * with a SIGNAL call                                                   *
- * - int: PID of process to WAIT for                                    */
+ * - int: PID of process to WAIT for                                    *
+ * response: same as JOINPID                                            */
 #define SYSCALL_WAIT 013
 
 /* SIGNAL sends a message to a WAITing process                          *
- * - int: PID of process to SIGNAL to                                   */
+ * - int: PID of process to SIGNAL to                                   *
+ * response: int 0 (v2: STATUS_OK) if the process was WAITing for us,   *
+ * or int -1 (v2: STATUS_ERROR) if not                                  */
 #define SYSCALL_SIGNAL 014
 
+/* JOINPID_TIMED and WAIT_TIMED (v2 only) are JOINPID and WAIT that     *
+ * give up after a while; each takes one more parameter, ahead of the   *
+ * others:                                                              *
+ * - int: timeout in milliseconds (0 gives up straight away unless the  *
+ *   call can be answered at once; a negative one is refused with       *
+ *   STATUS_BAD_REQUEST)                                                *
+ * response: as for JOINPID and WAIT, or STATUS_TIMEOUT (with nothing   *
+ * after it) if the time runs out first; timeouts are counted in ticks  *
+ * of 10 milliseconds and rounded up, so they may run a tick over       */
+#define SYSCALL_JOINPID_TIMED 015
+#define SYSCALL_WAIT_TIMED 016
+
 
 /* ---- octal codes starting with 2 are for interprocess messaging ---- */
 
@@ -120,7 +229,15 @@
  * - int: priority                                                      *
  * - int: message type                                                  *
  * - (n) C-strings: the message                                         *
- * - one empty C-string as a message terminator                         */
+ * - one empty C-string as a message terminator                         *
+ * in v2 the line count is sent instead of the terminator:              *
+ * - C-string: destination mailbox name                                 *
+ * - int: priority                                                      *
+ * - int: message type                                                  *
+ * - int: number of lines                                               *
+ * - (n) C-strings: the message                                         *
+ * v2 response:                                                         *
+ * - int: number of lines received                                      */
 #define SYSCALL_SEND 020
 
 /* CHECK queries the server to find out how many C-strings of a given   *
@@ -131,30 +248,150 @@
  * CHECK takes these parameters:                                        *
  * - int: priority to check for                                         *
  * - int: message type to check for                                     *
- * - C-string: sender mailbox name to check for                         */
+ * - C-string: sender mailbox name to check for                         *
+ * v2 response:                                                         *
+ * - int: number of matching messages                                   */
 #define SYSCALL_CHECK 021
 
 /* RECV gets the first message of the given priority, message type, and *
  * sender mailbox waiting in the client's mailbox and removes it from   *
  * the message queue; if no qualifying message is waiting, nothing is   *
- * returned and the client blocks.                                      *
+ * returned and the client blocks. Clients blocked on the same mailbox *
+ * are served in the order they blocked: a message goes to the first   *
+ * of them whose RECV it matches.                                       *
  *                                                                      *
  * RECV takes these parameters:                                         *
  * - int: priority                                                      *
  * - int: message type                                                  *
  * - C-string: sender mailbox name                                      *
- * response takes the following form                                    *
+ * response takes the following form (v2: after the status code)        *
  * - int: priority                                                      *
  * - int: message type                                                  *
  * - C-string: sender mailbox name                                      *
  * - int: number of lines                                               *
- * - (n) C-strings: the message                                         */
+ * - (n) C-strings: the message                                         *
+ * clients with rings get one more int before the message: RING_INLINE  *
+ * if the lines follow as usual, or else the offset of the packed lines *
+ * in their receive ring followed by an int giving their length in      *
+ * bytes (the client releases the slot once it has read them)           *
+ * a v2 client that has asked for "overflow:drop-spam" may get          *
+ * STATUS_DROPPED instead, with nothing after it, if the message was    *
+ * SPAM and the client had fallen too far behind to take it             */
 #define SYSCALL_RECV 022
 
 /* CONFIGURE sets mailbox parameters -- the user sets as many           *
  * C-string key-value pairs as they like; takes these param's:          *
  * - int: number of parameters to set                                   *
- * - (n) C-strings with format "key:value"                              */
+ * - (n) C-strings with format "key:value"                              *
+ * v2 response:                                                         *
+ * - int: number of settings received                                   *
+ * - int: number of messages the server has thrown out of the client's  *
+ *   mailbox so far for outliving its TTL (see "ttl" below)             *
+ * the server understands these keys (and ignores any others):          *
+ * - "outbound:<bytes>": how much output the server may hold for this   *
+ *   client when it does not read its replies fast enough               *
+ * - "overflow:<policy>": what happens when the client is further       *
+ *   behind than that -- "block" (the server waits for it to catch up;  *
+ *   the default), "drop-spam" (SPAM messages are dropped instead of    *
+ *   delivered; anything else still waits), or "disconnect"             *
+ * - "delivery:<order>": which message a RECV for any priority gets     *
+ *   from the client's mailbox -- "fifo" (the oldest match; the         *
+ *   default) or "priority" (the oldest match of the highest priority)  *
+ * - "aging:<n>": with "delivery:priority", the oldest message goes     *
+ *   next once n messages have been delivered since it arrived and      *
+ *   since aging last picked one (0 = never)                           *
+ * - "ttl:<seconds>": how long a message may wait in the client's       *
+ *   mailbox before the server throws it out (0 = for ever; the         *
+ *   default)                                                           */
 #define SYSCALL_CONFIGURE 023
 
+/* SEND_SHARED is SEND for a v2 client whose packed message lines are   *
+ * already sitting in its send ring; it takes these parameters:         *
+ * - C-string: destination mailbox name                                 *
+ * - int: priority                                                      *
+ * - int: message type                                                  *
+ * - int: number of lines                                               *
+ * - int: offset of the packed lines in the client's send ring          *
+ * - int: length of the packed lines in bytes                           *
+ * the server releases the slot once the message has been delivered    *
+ * v2 response: same as SEND                                            */
+#define SYSCALL_SEND_SHARED 024
+
+/* SEND_MULTI (v2 only) is SEND to several mailboxes at once: the       *
+ * lines are sent once, and every mailbox gets a copy that shares them  *
+ * (a mailbox named more than once still gets only one); it takes these *
+ * parameters:                                                          *
+ * - int: priority                                                      *
+ * - int: message type                                                  *
+ * - int: number of targets                                             *
+ * - (n) C-strings: the targets; a target containing any of "*?[" is a  *
+ *   pattern (as for fnmatch) that reaches every mailbox whose name     *
+ *   matches it, and which exists already -- any other target is a      *
+ *   mailbox name, created if need be                                   *
+ * - int: number of lines                                               *
+ * - (n) C-strings: the message                                         *
+ * v2 response:                                                         *
+ * - int: number of mailboxes that got the message                      */
+#define SYSCALL_SEND_MULTI 025
+
+/* RECV_BATCH (v2 only) drains a mailbox: it returns as many of the     *
+ * messages that match as RECV would have returned one at a time (in    *
+ * the same order), up to a count and a byte budget, in one reply. It   *
+ * never blocks: with no match, it returns no messages (a client that   *
+ * wants to wait for the first one can RECV it). It takes these         *
+ * parameters:                                                          *
+ * - int: priority                                                      *
+ * - int: message type                                                  *
+ * - C-string: sender mailbox name                                      *
+ * - int: most messages to return                                       *
+ * - int: byte budget -- no more messages are added once the reply has  *
+ *   this many bytes of them (0 for no budget; the first message always *
+ *   goes, however big it is)                                           *
+ * v2 response:                                                         *
+ * - int: number of messages                                            *
+ * - (n) messages, each one just like a RECV response (ring offsets     *
+ *   and all)                                                           */
+#define SYSCALL_RECV_BATCH 026
+
+/* SUBSCRIBE (v2 only) subscribes the client's mailbox to a topic: a    *
+ * message PUBLISHed to the topic is then filed in the mailbox, as if   *
+ * it had been SENT there, whenever its priority and type pass the      *
+ * subscription's filter. A mailbox subscribes to a topic just once (a  *
+ * second SUBSCRIBE changes the filter), and stays subscribed after its *
+ * clients disconnect, just as its messages stay. It takes these        *
+ * parameters:                                                          *
+ * - C-string: topic name                                               *
+ * - int: priority (or PRIORITY_ALL)                                    *
+ * - int: message type (or TYPE_ALL)                                    *
+ * v2 response:                                                         *
+ * - int: number of mailboxes subscribed to the topic                   */
+#define SYSCALL_SUBSCRIBE 027
+
+/* UNSUBSCRIBE (v2 only) ends the mailbox's subscription to a topic;    *
+ * it takes these parameters:                                           *
+ * - C-string: topic name                                               *
+ * v2 response:                                                         *
+ * - int: number of mailboxes still subscribed to the topic, or         *
+ *   STATUS_ERROR (with nothing after it) if the mailbox was not        *
+ *   subscribed                                                         */
+#define SYSCALL_UNSUBSCRIBE 030
+
+/* PUBLISH (v2 only) sends a message to every mailbox subscribed to a   *
+ * topic (that wants it); like SEND_MULTI, the lines are kept once for  *
+ * all of them. It takes these parameters:                              *
+ * - C-string: topic name                                               *
+ * - int: priority                                                      *
+ * - int: message type                                                  *
+ * - int: number of lines                                               *
+ * - (n) C-strings: the message                                         *
+ * v2 response:                                                         *
+ * - int: number of mailboxes that got the message                      */
+#define SYSCALL_PUBLISH 031
+
+/* RECV_TIMED (v2 only) is RECV that gives up after a while, just as    *
+ * JOINPID_TIMED does: it takes the timeout in milliseconds ahead of    *
+ * RECV's parameters, and returns STATUS_TIMEOUT if no message came in  *
+ * time                                                                 */
+#define SYSCALL_RECV_TIMED 032
+
 #endif
\ No newline at end of file
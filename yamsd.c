@@ -1,353 +1,2746 @@
 #include "yams_headers.h"
 #include "fio_handlers.h"
 #include "ipc_messaging.h"
+#include "ring_buffers.h"
+#include "timer_wheel.h"
 #include <time.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 /* mark unused Client records as unused by setting their PID's and FD's *
  * to an illegal number (-1)                                            */
 #define UNUSED -1
 
 /*   -----~~~~~===== define necessary global variables =====~~~~~-----  */
-int nextPID = 0;     // next available client process PID
 int fd_syscall, fd_commchannel; // file pointers for incoming server FIFOs
-int syscall_code;    // most recent incoming system call code
+int fd_listen;       // socket that SOCK_SEQPACKET clients connect to
+int fd_epoll;        // event loop that watches all of the above
+bool *new_sockets = NULL; // which fds are accepted sockets that have not sent CONNECT yet...
+int new_sockets_size = 0; // ...out of this many
 int connections = 0; // how many connected client processes
 bool running = true; // whether the process server is supposed to
                      // still be running
 
+/* output to a client goes out without waiting; whatever its fd will    *
+ * not take yet waits in its outbound queue; once that holds more than  *
+ * the client's limit, the client's overflow policy kicks in for the    *
+ * next reply (see CONFIGURE)                                           */
+#define OUTBOUND_LIMIT (256 * 1024)
+#define OVERFLOW_BLOCK 0
+#define OVERFLOW_DROP_SPAM 1
+#define OVERFLOW_DISCONNECT 2
+#define OVERFLOW_POLICIES 3
+
 /* create a structure to store client process information, sort of a
    process control block in miniature                                   */
 struct Client {
-    int PID;
+    int PID;        // slot and generation (see get_client), or UNUSED (atomic)
+    int slot;       // (fixed when the slot is made)
+    int generation; // how often the slot has been given back
+    int next_free;  // next slot on the free list...
+    int next_disconnecting; // ...or the list of clients to disconnect
     time_t start_time;
-    char mailbox_name[STRING_SIZE];
+    char *mailbox_name; // interned, so it stays put (see intern_name)
+    int mailbox_id;     // ...and its id
     char fifo_name[STRING_SIZE];
-    int fd_outgoing;
+    int transport;  // TRANSPORT_FIFO or TRANSPORT_SOCKET
+    int fd_outgoing; // client FIFO, or the client's socket (which we also read)
     int join_PID;
     int wait_PID;
-    int recv_wait_priority;
-    int recv_wait_type;
-    char recv_wait_sender[STRING_SIZE];
-} clients[LIST_SIZE];
+    struct Timer *timer; // times out the JOINPID or WAIT, if it was timed
+    unsigned long open_by; // tick by which a FIFO client must have opened its FIFO
+    int protocol;   // protocol version agreed on at CONNECT
+    int opcode;     // syscall code of the client's current (or pending) request
+    int request_id; // v2 request id of that request, echoed in the reply
+    struct InBuffer fragments; // v2 payload pieces collected so far...
+    int fragments_id;          // ...and the request id they belong to
+    bool fragments_refused;    // (that request outgrew MAX_REQUEST_SIZE)
+    struct Ring *send_ring;    // the client's shared-memory rings, if any
+    struct Ring *recv_ring;
+    struct OutQueue outbound;  // output the client has not taken yet...
+    int outbound_limit;        // ...how much of it we may hold...
+    int overflow_policy;       // ...and what happens when there is more (atomic)
+    int overflows[OVERFLOW_POLICIES]; // how often each policy kicked in
+    bool watching_output;      // whether we wait for room on fd_outgoing
+    bool disconnecting;        // to be disconnected once the event is over
+    bool behind;               // whether the queue is past its limit (for the shards)
+    int pending_jobs;          // jobs of this client's that the shards are still on
+    bool closing;              // disconnected, but the shards are not done with it yet (atomic)
+};
+
+/* the client table grows a chunk of CLIENT_CHUNK slots at a time, up   *
+ * to MAX_CLIENTS; chunks never move once made, so a shard can go on    *
+ * using a client's record while the main thread adds more. A client's  *
+ * PID is its slot with the slot's generation above it, so that a PID   *
+ * held on to after its client has gone is not mistaken for that of     *
+ * the next client in the same slot. Free slots are handed out longest- *
+ * free first.                                                          *
+ *                                                                      *
+ * Only the main thread writes the table. The shards read a client's    *
+ * record while they answer it: its mailbox, protocol and rings are set *
+ * before its PID is stored (with release, see STORE) and stay put      *
+ * until the slot is released, which waits for the shards to be done    *
+ * with the client (see pending_jobs). The fields that change under the *
+ * shards -- client_slots, PID, closing and overflow_policy -- are only *
+ * read and written with LOAD and STORE where the other side may be     *
+ * looking.                                                             */
+#define CLIENT_SLOT_BITS 16
+#define SLOT(PID) ((PID) & ((1 << CLIENT_SLOT_BITS) - 1))
+#define GENERATION_MASK 0x7fff // (so that PIDs are never negative)
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+struct Client *client_chunks[MAX_CLIENTS / CLIENT_CHUNK];
+int client_slots = 0;  // slots in the chunks made so far
+int first_free = UNUSED, last_free = UNUSED;
+int first_disconnecting = UNUSED; // to go once the current event is over
+
+/* the following function returns the record of the client with a      *
+ * given PID (which must be in a slot that has been made)               */
+struct Client * get_client(int PID)
+{
+    int slot = SLOT(PID);
+    return &(client_chunks[slot / CLIENT_CHUNK][slot % CLIENT_CHUNK]);
+}
+
+/* how often each overflow policy has kicked in, over all clients       */
+int overflow_totals[OVERFLOW_POLICIES];
+
+/* timed JOINPIDs, WAITs, and RECVs run out in a timer wheel that the   *
+ * main loop turns; a tick is TIMER_TICK milliseconds                   */
+#define TIMER_TICK 10
+struct TimerWheel timers;
+
+/* a FIFO client opens its end of its FIFO only after it has sent its   *
+ * CONNECT, so the server tries the FIFO again each tick for up to      *
+ * FIFO_OPEN_TIMEOUT milliseconds before it gives up on the client      */
+#define FIFO_OPEN_TIMEOUT 2000
+
+/* a system call as read from the syscall FIFO or a client socket; v2   *
+ * parameters arrive all at once as a packed payload, while v1 ones     *
+ * come one at a time over the comm-channel FIFO and are packed the     *
+ * same way as they arrive, so that handlers need not tell them apart   */
+struct Request {
+    int protocol;
+    int opcode;
+    int PID;
+    int request_id;
+    int length;
+    struct InBuffer params;
+} request = {0, 0, 0, 0, 0, {NULL, 0, 0, 0}};
+
+/* the event loop reads whatever the server FIFOs have ready into these *
+ * and only takes requests out of them once they have arrived whole     */
+struct InBuffer syscall_input = {NULL, 0, 0, 0};
+struct InBuffer comm_input = {NULL, 0, 0, 0};
+
+/* v1 system calls have to take turns on the comm-channel FIFO, so each *
+ * waits in this queue until the one ahead of it has all its parameters *
+ * in; meanwhile v2 requests, which carry their parameters with them,   *
+ * carry on as usual                                                    */
+#define V1_QUEUE_SIZE 64 // (to start with; it doubles when full)
+struct V1Call {
+    int opcode;
+    int PID;          // client PID (host-OS PID for a CONNECT)
+    int step;         // how many parameters have arrived so far
+    int count;        // CONFIGURE: settings to expect; SEND: lines so far
+    int count_offset; // SEND: where the line count goes in v1_params
+    int priority;     // SEND: for the go-ahead message
+    int type;
+    char mbox_name[STRING_SIZE];
+} *v1_calls = NULL;
+int v1_first = 0, v1_count = 0, v1_capacity = 0;
+bool v1_active = false; // whether the first call in line holds the "lock"
+struct OutBuffer v1_params = {NULL, 0, 0}; // its parameters, packed as v2 would
+
+/* things the event loop watches, as tagged in each epoll event         */
+#define WATCH_SYSCALL 0
+#define WATCH_COMMCHANNEL 1
+#define WATCH_LISTEN 2
+#define WATCH_NEW_SOCKET 3
+#define WATCH_CLIENT_SOCKET 4
+#define WATCH_CLIENT_FIFO 5
+#define WATCH_ANSWERS 6
+#define EVENT_BATCH 64
+
+/* outgoing responses are gathered here before being written (each     *
+ * thread has its own)                                                  */
+__thread struct OutBuffer out_buffer = {NULL, 0, 0};
+__thread int reply_start; // offset of the v2 reply frame being built in out_buffer
+
+/* the mailboxes are split into shards by hash code, and each shard is  *
+ * owned by a worker thread that carries out every SEND, RECV, and      *
+ * CHECK on its mailboxes; the main thread does all of the I/O, hands   *
+ * each of those requests to the shard that owns the mailbox it is      *
+ * about, and sends out whatever the shard hands back                   */
+#define MAX_SHARDS 64
+
+/* a shard with mailboxes that have a TTL sweeps them for messages that *
+ * have waited too long every EXPIRY_PERIOD seconds; between jobs it    *
+ * looks at no more than EXPIRY_MBOXES mailboxes and throws out no more *
+ * than EXPIRY_SLICE messages, so that the sweep never holds a job up   *
+ * for long. A CHECK or RECV throws out no more than EXPIRY_SLICE of    *
+ * its own mailbox's either and leaves any more to the sweep, though it *
+ * counts and delivers none of them meanwhile                           */
+#define EXPIRY_PERIOD 1
+#define EXPIRY_MBOXES 64
+#define EXPIRY_SLICE 256
+
+/* a multicast SEND goes to every shard that owns one of its targets,  *
+ * and they all share one copy of the body; whichever shard finishes    *
+ * last answers the sender and lets go of the body                      */
+struct Multicast {
+    struct Body *body;
+    unsigned long serial; // (so that no mailbox gets the message twice)
+    int shards_left;
+    int delivered;        // mailboxes reached so far
+};
+unsigned long multicasts = 0; // serials handed out so far
+
+/* the job that tells a shard that a timed RECV has run out of time     *
+ * (not a system call, so it has a code no client uses)                 */
+#define JOB_TIMEOUT 0777
+
+/* a request handed to a shard, with its own copy of the parameters     */
+struct Job {
+    struct Request req;
+    struct Multicast *cast; // the multicast this is part of, if any
+    struct Timer *timer;    // the timer on a timed RECV or a JOB_TIMEOUT
+    struct Job *next;
+};
+
+/* output that a shard has produced for a client, or (if 'finished')    *
+ * word that the shard is done with one of that client's jobs, or (if   *
+ * 'cancel') word that a timed RECV is over and its timer can go        */
+struct Answer {
+    int PID;
+    bool finished;
+    bool forced; // goes out even if the client is too far behind
+    struct Timer *cancel;
+    bool timed_out; // (with 'cancel') the timer's JOB_TIMEOUT is over too
+    int size;
+    struct Answer *next;
+    char data[];
+};
+
+struct Shard {
+    pthread_t thread;
+    pthread_mutex_t lock;  // guards the job and answer lists
+    pthread_cond_t wakeup; // signalled when a job comes in
+    struct Job *first_job, *last_job;
+    struct Answer *first_answer, *last_answer;
+    bool stopping;
+    struct MailboxTable mboxes; // the mailboxes that this shard owns
+    int expiring;               // how many of them have a TTL
+    int expiry_pos;             // where the sweep has got to (see next_mbox)
+    time_t next_expiry;         // when the next sweep starts
+    long expired;               // messages thrown out, over all its mailboxes
+} shards[MAX_SHARDS];
+int num_shards;
+int fd_answers; // the shards poke this eventfd when they have answers
+__thread struct Shard *my_shard = NULL; // (NULL in the main thread)
+__thread struct Request *my_job = NULL; // the request the shard is on
+__thread struct Waiter *my_waiter = NULL; // the waiting RECV it is answering, if any
+
+/* the following function picks the shard that owns a mailbox (from  *
+ * the hash mixed up again, so that the bits which choose the shard are *
+ * not the same ones that choose a slot in the shard's own table)       */
+int mbox_shard(unsigned int hash)
+{
+    return ((hash * 2654435761u) >> 16) % num_shards;
+}
+
+/* the following function registers a new mailbox and returns       *
+ * a pointer to it                                                  */
+struct Mailbox * register_mbox(char *mbox_name)
+{
+    unsigned int hash = name_hash(mbox_name);
+    struct Mailbox *mbox = get_mbox(&(my_shard->mboxes), mbox_name, hash);
+    if(mbox == NULL)
+    {
+        mbox = add_mbox(&(my_shard->mboxes), mbox_name);
+        printf("YAMSD: new mailbox %s created with hash %08x (%d in this shard)\n", mbox_name, hash, my_shard->mboxes.count);
+    }
+    else
+        printf("YAMSD: mailbox %s already registered with hash %08x\n", mbox_name, hash);
+    return mbox;
+}
+
+/* the following function takes the next whole system call out of what *
+ * has been read from the syscall FIFO; v1 clients send a bare syscall  *
+ * code followed by their PID, while v2 clients send a frame header     *
+ * that starts with FRAME_MAGIC and brings its payload along; it        *
+ * returns false if the rest of the request has not arrived yet         */
+bool take_request(struct Request *req)
+{
+    struct InBuffer *in = &syscall_input;
+    int start = in->pos;
+    int first_int;
+    if(!take_int(in, &first_int))
+        return false;
+    if(first_int == FRAME_MAGIC)
+    {
+        struct FrameHeader hdr;
+        in->pos = start;
+        if(in->size - in->pos < (int)sizeof(hdr))
+            return false;
+        memcpy(&hdr, in->data + in->pos, sizeof(hdr));
+        if(hdr.length < 0 || hdr.length > MAX_FRAME_SIZE)
+        {
+            // there is no telling where the next request starts now:
+            printf("YAMSD: discarding syscall FIFO input after a bad frame header\n");
+            in->pos = in->size;
+            return false;
+        }
+        if(in->size - in->pos < (int)sizeof(hdr) + hdr.length)
+            return false;
+        in->pos += sizeof(hdr);
+        req->protocol = PROTOCOL_V2;
+        req->opcode = hdr.opcode;
+        req->PID = hdr.PID;
+        req->request_id = hdr.request_id;
+        req->length = hdr.length;
+        req->params.size = 0;
+        append_bytes(&(req->params), in->data + in->pos, hdr.length);
+        req->params.pos = 0;
+        in->pos += hdr.length;
+        return true;
+    }
+    if(!take_int(in, &(req->PID)))
+    {
+        in->pos = start;
+        return false;
+    }
+    req->protocol = PROTOCOL_V1;
+    req->opcode = first_int;
+    req->request_id = 0;
+    req->length = 0;
+    req->params.size = 0;
+    req->params.pos = 0;
+    return true;
+}
+
+/* the following function reads the next system call from a client     *
+ * socket, where every v2 frame arrives as one packet; it returns false *
+ * if the client has gone away (or sent something that is not a frame) */
+bool read_socket_request(int fd, struct Request *req)
+{
+    struct FrameHeader hdr;
+    if(!read_packet(fd, &hdr, &(req->params), false))
+        return false;
+    req->protocol = PROTOCOL_V2;
+    req->opcode = hdr.opcode;
+    req->PID = hdr.PID;
+    req->request_id = hdr.request_id;
+    req->length = hdr.length;
+    return true;
+}
+
+/* the following function files away one FRAGMENT of a v2 request     *
+ * payload; pieces left over from an earlier, unfinished request are    *
+ * thrown away, and so is a payload that grows past MAX_REQUEST_SIZE    */
+void collect_fragment(struct Client *my_client, struct Request *req)
+{
+    if(my_client->fragments_id != req->request_id)
+    {
+        my_client->fragments.size = 0;
+        my_client->fragments_id = req->request_id;
+        my_client->fragments_refused = false;
+    }
+    if(my_client->fragments_refused)
+        return;
+    if(my_client->fragments.size + req->params.size > MAX_REQUEST_SIZE)
+    {
+        printf("YAMSD: request %d from client %d is more than %d bytes long; throwing it away\n", req->request_id, req->PID, MAX_REQUEST_SIZE);
+        free_inbuffer(&(my_client->fragments));
+        my_client->fragments_refused = true;
+        return;
+    }
+    append_bytes(&(my_client->fragments), req->params.data, req->params.size);
+}
+
+/* the following function puts a fragmented v2 payload back together   *
+ * once its last piece (sent under the real syscall code) has arrived;  *
+ * it returns false if the request was too big to keep                  */
+bool finish_fragments(struct Client *my_client, struct Request *req)
+{
+    if(my_client->fragments_refused && my_client->fragments_id == req->request_id)
+    {
+        my_client->fragments_id = UNUSED;
+        my_client->fragments_refused = false;
+        return false;
+    }
+    if(my_client->fragments.size == 0)
+        return true;
+    if(my_client->fragments_id == req->request_id)
+    {
+        // add the last piece, then swap buffers so that the request
+        // holds the whole payload and the client keeps the spare:
+        append_bytes(&(my_client->fragments), req->params.data, req->params.size);
+        struct InBuffer whole = my_client->fragments;
+        my_client->fragments = req->params;
+        req->params = whole;
+        req->params.pos = 0;
+        req->length = req->params.size;
+    }
+    my_client->fragments.size = 0;
+    my_client->fragments_id = UNUSED;
+    return true;
+}
+
+/* the following functions read the next parameter of a request from  *
+ * its payload (v1 parameters are packed the same way as they come in  *
+ * on the comm-channel FIFO; see collect_v1_params)                    */
+void get_int(struct Request *req, int *value)
+{
+    if(!unpack_int(&(req->params), value))
+        *value = UNUSED;
+}
+
+void get_string(struct Request *req, char *str, int max_size)
+{
+    unpack_string(&(req->params), str, max_size);
+}
+
+/* the following function tells whether 'PID' belongs to a client that *
+ * is connected                                                         */
+bool live(int PID)
+{
+    return PID >= 0 && SLOT(PID) < LOAD(client_slots) && LOAD(get_client(PID)->PID) == PID && !LOAD(get_client(PID)->closing);
+}
+
+/* the following function puts an answer at the end of this shard's     *
+ * list and pokes the main thread                                       */
+void queue_answer(struct Answer *answer)
+{
+    pthread_mutex_lock(&(my_shard->lock));
+    if(my_shard->last_answer == NULL)
+        my_shard->first_answer = answer;
+    else
+        my_shard->last_answer->next = answer;
+    my_shard->last_answer = answer;
+    pthread_mutex_unlock(&(my_shard->lock));
+    uint64_t one = 1;
+    write(fd_answers, &one, sizeof(one));
+}
+
+/* the following function hands whatever is in out_buffer back to the   *
+ * main thread as an answer for client 'PID' (run by a shard)           */
+void post_answer(int PID, bool finished, bool forced)
+{
+    struct Answer *answer = malloc(sizeof(struct Answer) + out_buffer.size);
+    answer->PID = PID;
+    answer->finished = finished;
+    answer->forced = forced;
+    answer->cancel = NULL;
+    answer->timed_out = false;
+    answer->size = out_buffer.size;
+    answer->next = NULL;
+    memcpy(answer->data, out_buffer.data, out_buffer.size);
+    out_buffer.size = 0;
+    queue_answer(answer);
+}
+
+/* the following function asks the main thread to stop the timer on a   *
+ * timed RECV that is over, or (if 'timed_out') tells it that the       *
+ * timer's JOB_TIMEOUT is done with it (run by a shard)                 */
+void post_cancel(int PID, struct Timer *timer, bool timed_out)
+{
+    struct Answer *answer = malloc(sizeof(struct Answer));
+    answer->PID = PID;
+    answer->finished = false;
+    answer->forced = false;
+    answer->cancel = timer;
+    answer->timed_out = timed_out;
+    answer->size = 0;
+    answer->next = NULL;
+    queue_answer(answer);
+}
+
+/* the following function hands a request to a shard (as part of the   *
+ * multicast 'cast', or NULL)                                           */
+void post_to_shard(struct Shard *shard, struct Request *req, struct Multicast *cast, struct Timer *timer)
+{
+    struct Job *job = malloc(sizeof(struct Job));
+    job->req = *req;
+    job->cast = cast;
+    job->timer = timer;
+    // the request's parameters are only lent to us, so take a copy:
+    job->req.params.data = malloc(req->params.size > 0 ? req->params.size : 1);
+    memcpy(job->req.params.data, req->params.data, req->params.size);
+    job->req.params.capacity = req->params.size;
+    job->next = NULL;
+    get_client(req->PID)->pending_jobs++;
+    pthread_mutex_lock(&(shard->lock));
+    if(shard->last_job == NULL)
+        shard->first_job = job;
+    else
+        shard->last_job->next = job;
+    shard->last_job = job;
+    pthread_cond_signal(&(shard->wakeup));
+    pthread_mutex_unlock(&(shard->lock));
+}
+
+/* the following function hands a request to the shard that owns the   *
+ * mailbox 'mbox_name'                                                  */
+void post_job(struct Request *req, char *mbox_name)
+{
+    post_to_shard(&(shards[mbox_shard(name_hash(mbox_name))]), req, NULL, NULL);
+}
+
+/* ...and the same for a timed RECV, or the JOB_TIMEOUT that ends it,   *
+ * along with the RECV's timer                                          */
+void post_timed_job(struct Request *req, char *mbox_name, struct Timer *timer)
+{
+    post_to_shard(&(shards[mbox_shard(name_hash(mbox_name))]), req, NULL, timer);
+}
+
+/* the following function has the event loop watch 'fd' for 'events';   *
+ * each event carries the fd, what kind of thing it is, and who owns it */
+void watch(int fd, int kind, int owner, int events)
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.u64 = ((uint64_t)fd << 32) | ((uint64_t)kind << 16) | (uint64_t)owner;
+    if(epoll_ctl(fd_epoll, EPOLL_CTL_ADD, fd, &event) < 0 && errno == EEXIST)
+        epoll_ctl(fd_epoll, EPOLL_CTL_MOD, fd, &event);
+}
+
+/* the following function has the event loop wait for room on a        *
+ * client's fd_outgoing while there is output queued for it            */
+void watch_output(struct Client *my_client, bool on)
+{
+    if(my_client->watching_output == on)
+        return;
+    my_client->watching_output = on;
+    if(my_client->transport == TRANSPORT_SOCKET)
+        watch(my_client->fd_outgoing, WATCH_CLIENT_SOCKET, my_client->slot, on ? EPOLLIN | EPOLLOUT : EPOLLIN);
+    else if(on)
+        watch(my_client->fd_outgoing, WATCH_CLIENT_FIFO, my_client->slot, EPOLLOUT);
+    else
+        epoll_ctl(fd_epoll, EPOLL_CTL_DEL, my_client->fd_outgoing, NULL);
+}
+
+/* the following function tells whether a client has fallen too far    *
+ * behind to be sent more output right away                             */
+bool falling_behind(struct Client *my_client)
+{
+    return queued_bytes(&(my_client->outbound)) >= my_client->outbound_limit;
+}
+
+/* the following function has a client disconnected once the event     *
+ * being handled is over, when nobody is in the middle of answering it  */
+void disconnect_later(struct Client *my_client)
+{
+    if(my_client->disconnecting)
+        return;
+    my_client->disconnecting = true;
+    my_client->next_disconnecting = first_disconnecting;
+    first_disconnecting = my_client->slot;
+}
+
+/* the following function writes as much of a client's outbound queue   *
+ * as its fd will take (all of it, if 'wait' is set); a client whose fd *
+ * has failed is marked for disconnection                               */
+void flush_output(struct Client *my_client, bool wait)
+{
+    int left = flush_queue(my_client->fd_outgoing, &(my_client->outbound), my_client->transport == TRANSPORT_SOCKET, wait);
+    if(left < 0)
+    {
+        printf("YAMSD: lost connection to client %d while writing to it\n", my_client->PID);
+        clear_queue(&(my_client->outbound));
+        disconnect_later(my_client);
+        left = 0;
+    }
+    watch_output(my_client, left > 0);
+    __atomic_store_n(&(my_client->behind), falling_behind(my_client), __ATOMIC_RELAXED);
+}
+
+/* the following function counts one overflow of a client's queue       */
+void count_overflow(struct Client *my_client, int policy)
+{
+    my_client->overflows[policy]++;
+    overflow_totals[policy]++;
+}
+
+/* the following function puts everything in out_buffer at the end of  *
+ * a client's outbound queue and sends as much of it as it can          */
+void queue_output(struct Client *my_client)
+{
+    // a socket connection takes each frame as one packet, so big
+    // replies have to be broken up into FRAGMENT frames:
+    if(my_client->transport == TRANSPORT_SOCKET)
+        queue_frame_pieces(&(my_client->outbound), &out_buffer, MAX_PACKET_SIZE, SYSCALL_FRAGMENT);
+    else
+    {
+        queue_record(&(my_client->outbound), out_buffer.data, out_buffer.size);
+        out_buffer.size = 0;
+    }
+    flush_output(my_client, false);
+}
+
+/* the following function sends everything in out_buffer to a client,  *
+ * through its outbound queue, unless the client has fallen too far     *
+ * behind; it returns false if the output had to be thrown away         */
+bool send_output(struct Client *my_client)
+{
+    // output built by a shard goes to the main thread to be sent:
+    if(my_shard != NULL)
+    {
+        post_answer(LOAD(my_client->PID), false, false);
+        return true;
+    }
+    if(my_client->PID == UNUSED || my_client->disconnecting || my_client->closing)
+    {
+        out_buffer.size = 0;
+        return false;
+    }
+    if(falling_behind(my_client))
+    {
+        if(my_client->overflow_policy == OVERFLOW_DISCONNECT)
+        {
+            printf("YAMSD: client %d is too far behind; disconnecting it\n", my_client->PID);
+            count_overflow(my_client, OVERFLOW_DISCONNECT);
+            clear_queue(&(my_client->outbound));
+            disconnect_later(my_client);
+            out_buffer.size = 0;
+            return false;
+        }
+        // (SPAM that could be dropped has been by now; see drop_spam)
+        printf("YAMSD: client %d is too far behind; waiting for it to catch up\n", my_client->PID);
+        count_overflow(my_client, OVERFLOW_BLOCK);
+        flush_output(my_client, true);
+        if(my_client->disconnecting)
+        {
+            out_buffer.size = 0;
+            return false;
+        }
+    }
+    queue_output(my_client);
+    return true;
+}
+
+/* the following functions build and send a v2 reply frame; the reply   *
+ * answers the client's current (or pending) request and its payload    *
+ * starts with the status code, followed by whatever the caller packs   *
+ * in between begin_reply and send_reply                                */
+void begin_reply(struct Client *my_client, int status)
+{
+    int opcode, request_id;
+    int PID = LOAD(my_client->PID);
+    // a shard answers either the request it is on or a waiting RECV
+    // (the client may have sent the main thread more since then):
+    if(my_shard == NULL)
+    {
+        opcode = my_client->opcode;
+        request_id = my_client->request_id;
+    }
+    else if(my_waiter != NULL && my_waiter->PID == PID)
+    {
+        opcode = my_waiter->opcode;
+        request_id = my_waiter->request_id;
+    }
+    else
+    {
+        opcode = my_job->opcode;
+        request_id = my_job->request_id;
+    }
+    reply_start = begin_frame(&out_buffer, opcode, PID, request_id);
+    pack_int(&out_buffer, status);
+}
+
+void send_reply(struct Client *my_client)
+{
+    end_frame(&out_buffer, reply_start);
+    send_output(my_client);
+}
+
+/* the following function answers a request whose v1 response is a     *
+ * single int: v1 clients get the int itself, v2 clients get a reply    *
+ * frame with the given status followed by the int (if 'with_value')    */
+void reply_int(struct Client *my_client, int status, bool with_value, int value)
+{
+    if(my_client->protocol == PROTOCOL_V1)
+    {
+        buffer_int(&out_buffer, &value);
+        send_output(my_client);
+    }
+    else
+    {
+        begin_reply(my_client, status);
+        if(with_value)
+            pack_int(&out_buffer, value);
+        send_reply(my_client);
+    }
+}
+
+/* the following function answers a request whose v1 response is a     *
+ * human-readable string; v2 clients get a status-only reply frame      */
+void reply_text(struct Client *my_client, int status, char *text)
+{
+    if(my_client->protocol == PROTOCOL_V1)
+    {
+        buffer_string(&out_buffer, text);
+        send_output(my_client);
+    }
+    else
+    {
+        begin_reply(my_client, status);
+        send_reply(my_client);
+    }
+}
+
+/* the following function decides whether a message for a client       *
+ * should be dropped rather than delivered: only SPAM is, and only to   *
+ * v2 clients that have asked for it and are too far behind (v1 clients *
+ * would have no way of finding out); the shards call it as they        *
+ * deliver, going by what the main thread last saw of the queue         */
+bool drop_spam(struct Client *my_client, int priority)
+{
+    if(priority != PRIORITY_SPAM || my_client->protocol != PROTOCOL_V2 || LOAD(my_client->overflow_policy) != OVERFLOW_DROP_SPAM || !__atomic_load_n(&(my_client->behind), __ATOMIC_RELAXED))
+        return false;
+    int PID = LOAD(my_client->PID);
+    printf("YAMSD: client %d is too far behind; dropping SPAM message for it\n", PID);
+    // (the main thread does the counting when the answer gets there)
+    // the client still has to hear about it, but that takes next to no room:
+    begin_reply(my_client, STATUS_DROPPED);
+    end_frame(&out_buffer, reply_start);
+    post_answer(PID, false, true);
+    return true;
+}
+
+/* the following function closes a client's fd_outgoing once whatever  *
+ * is queued for it has gone out (or cannot go out without waiting)     */
+void close_outgoing(struct Client *my_client)
+{
+    if(!my_client->disconnecting)
+        flush_queue(my_client->fd_outgoing, &(my_client->outbound), my_client->transport == TRANSPORT_SOCKET, false);
+    clear_queue(&(my_client->outbound));
+    my_client->watching_output = false;
+    fio_close(my_client->fd_outgoing);
+}
+
+/* the following function tells whether a CONFIGURE key is one for the *
+ * client's mailbox, which the mailbox's shard applies                  */
+bool mailbox_key(char *key)
+{
+    return strcmp(key, "delivery") == 0 || strcmp(key, "aging") == 0 || strcmp(key, "ttl") == 0;
+}
+
+/* the following function applies one CONFIGURE setting ("key:value")  */
+void configure_client(struct Client *my_client, char *setting)
+{
+    char *value = strchr(setting, ':');
+    if(value == NULL)
+    {
+        printf("YAMSD: ignoring setting %s, which is not of the form key:value\n", setting);
+        return;
+    }
+    *value++ = '\0';
+    if(strcmp(setting, "outbound") == 0 && atoi(value) > 0)
+        my_client->outbound_limit = atoi(value);
+    else if(strcmp(setting, "overflow") == 0 && strcmp(value, "block") == 0)
+        STORE(my_client->overflow_policy, OVERFLOW_BLOCK);
+    else if(strcmp(setting, "overflow") == 0 && strcmp(value, "drop-spam") == 0)
+        STORE(my_client->overflow_policy, OVERFLOW_DROP_SPAM);
+    else if(strcmp(setting, "overflow") == 0 && strcmp(value, "disconnect") == 0)
+        STORE(my_client->overflow_policy, OVERFLOW_DISCONNECT);
+    else if(!mailbox_key(setting))
+        printf("YAMSD: ignoring unknown setting %s:%s\n", setting, value);
+}
+
+/* the following function maps one of the shared-memory rings that a  *
+ * client set up for itself before CONNECTing                          */
+struct Ring * attach_ring(char *name_format, int linux_PID, int size)
+{
+    char ring_name[STRING_SIZE];
+    sprintf(ring_name, name_format, linux_PID);
+    struct Ring *ring = malloc(sizeof(struct Ring));
+    if(!ring_attach(ring, ring_name, size))
+    {
+        printf("YAMSD: could not map ring %s\n", ring_name);
+        free(ring);
+        return NULL;
+    }
+    printf("YAMSD: mapped %d-byte ring %s\n", size, ring_name);
+    // the client holds one reference, and each message
+    // whose lines are still in the ring holds another:
+    ring->refs = 1;
+    return ring;
+}
+
+/* the following function drops one reference to a ring, unmapping it  *
+ * once neither its client nor any waiting message is using it          */
+void drop_ring(struct Ring *ring)
+{
+    // (shards drop message references to the same ring at the same time)
+    if(__atomic_sub_fetch(&(ring->refs), 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        ring_detach(ring);
+        free(ring);
+    }
+}
+
+/* the following function lets go of a client's rings (messages still  *
+ * waiting to be delivered keep its send ring mapped)                   */
+void drop_rings(struct Client *my_client)
+{
+    if(my_client->send_ring != NULL)
+        drop_ring(my_client->send_ring);
+    if(my_client->recv_ring != NULL)
+        drop_ring(my_client->recv_ring);
+    my_client->send_ring = NULL;
+    my_client->recv_ring = NULL;
+}
+
+/* the following function finishes connecting a client once its         *
+ * FIFO or socket is open: the client gets its PID, and hears of it     */
+void finish_connect(struct Client *my_client)
+{
+    // output goes out without waiting, and whatever does not fit is queued:
+    fcntl(my_client->fd_outgoing, F_SETFL, fcntl(my_client->fd_outgoing, F_GETFL) | O_NONBLOCK);
+    my_client->outbound_limit = OUTBOUND_LIMIT;
+    my_client->overflow_policy = OVERFLOW_BLOCK;
+    memset(my_client->overflows, 0, sizeof(my_client->overflows));
+    my_client->behind = false;
+    // give client process a new PID (the rest of its record is set by now):
+    STORE(my_client->PID, my_client->slot | (my_client->generation << CLIENT_SLOT_BITS));
+    // assign client process a start time:
+    time(&(my_client->start_time));
+    // report client connection:
+    printf("YAMSD: client process #%d has connected with mailbox %s at time %s\n", my_client->PID, my_client->mailbox_name, ctime(&(my_client->start_time)));
+    if(my_client->transport == TRANSPORT_FIFO)
+        printf("YAMSD: opened client FIFO at %s\n", my_client->fifo_name);
+    // send PID back to client to confirm connection:
+    printf("YAMSD: sending PID %d to client\n", my_client->PID);
+    if(my_client->protocol == PROTOCOL_V1)
+        reply_int(my_client, STATUS_OK, true, my_client->PID);
+    else
+    {
+        begin_reply(my_client, STATUS_OK);
+        pack_int(&out_buffer, my_client->PID);
+        pack_int(&out_buffer, my_client->protocol);
+        pack_int(&out_buffer, my_client->send_ring != NULL);
+        send_reply(my_client);
+    }
+    // note that we are now connected to one additional client process:
+    connections++;
+    printf("YAMSD: connected to %d clients\n", connections);
+}
+
+/* the following function reads information from the server FIFO     *
+ * to set up a new client struct and connect to a new client process; *
+ * 'fd_socket' is the client's socket connection, or UNUSED if the    *
+ * client came in through the FIFOs. It returns false, with errno     *
+ * set, if a FIFO client's FIFO could not be opened (yet)             */
+bool connect_process(struct Client *my_client, struct Request *req, int fd_socket)
+{
+    // CONNECT has two parameters -- int: linux PID, C-string: mailbox name
+    // (v2 clients also send the highest protocol version they speak)
+    int processLinuxPID = req->PID;
+    int version = PROTOCOL_V1;
+    int ring_size = 0;
+    char mbox_name[STRING_SIZE];
+    // construct client FIFO name:
+    my_client->transport = (fd_socket == UNUSED) ? TRANSPORT_FIFO : TRANSPORT_SOCKET;
+    if(my_client->transport == TRANSPORT_FIFO)
+    {
+        sprintf(my_client->fifo_name, CLIENT_FIFO, processLinuxPID);
+        printf("YAMSD: connecting Host-OS process #%d on named pipe %s\n", processLinuxPID, my_client->fifo_name);
+    }
+    else
+    {
+        sprintf(my_client->fifo_name, "socket %d", fd_socket);
+        printf("YAMSD: connecting Host-OS process #%d on %s\n", processLinuxPID, my_client->fifo_name);
+    }
+    // read protocol version and mailbox name:
+    unpack_int(&(req->params), &version);
+    unpack_string(&(req->params), mbox_name, STRING_SIZE);
+    my_client->mailbox_id = intern_name(mbox_name);
+    my_client->mailbox_name = name_of(my_client->mailbox_id);
+    // the ring size is optional, for clients that have none:
+    if(unpack_int(&(req->params), &ring_size) && ring_size > 0)
+    {
+        my_client->send_ring = attach_ring(SEND_RING_NAME, processLinuxPID, ring_size);
+        my_client->recv_ring = attach_ring(RECV_RING_NAME, processLinuxPID, ring_size);
+        // it takes both rings or neither:
+        if(my_client->send_ring == NULL || my_client->recv_ring == NULL)
+            drop_rings(my_client);
+    }
+    // settle on the newest protocol version that we both speak:
+    my_client->protocol = (version < PROTOCOL_VERSION) ? version : PROTOCOL_VERSION;
+    my_client->opcode = SYSCALL_CONNECT;
+    my_client->request_id = req->request_id;
+    printf("YAMSD: client speaks protocol version %d; using version %d\n", version, my_client->protocol);
+    // (the mailbox itself is registered by its shard when first used)
+    // open client FIFO (socket clients already have their connection);
+    // the client may not have opened its end yet, and we must not wait:
+    if(my_client->transport == TRANSPORT_FIFO)
+    {
+        my_client->fd_outgoing = open(my_client->fifo_name, O_WRONLY | O_NONBLOCK);
+        if(my_client->fd_outgoing < 0)
+        {
+            my_client->fd_outgoing = UNUSED;
+            return false;
+        }
+    }
+    else
+        my_client->fd_outgoing = fd_socket;
+    finish_connect(my_client);
+    return true;
+}
+
+/* handle connection failure gracefully: the client is told that it  *
+ * was turned away (v1 clients get -1 for a PID), and then hung up on */
+void connect_fail(struct Request *req, int fd_socket)
+{
+    char param_string[STRING_SIZE];
+    printf("YAMSD: rejecting connection from Linux process %d -- too many clients connected\n", req->PID);
+    int version = PROTOCOL_V1;
+    unpack_int(&(req->params), &version);
+    unpack_string(&(req->params), param_string, STRING_SIZE);
+    printf("YAMSD: rejecting request to connect mailbox %s\n", param_string);
+    // FIFO clients are waiting to hear back on their own FIFO:
+    int fd = fd_socket;
+    if(fd == UNUSED)
+    {
+        char fifo_name[STRING_SIZE];
+        sprintf(fifo_name, CLIENT_FIFO, req->PID);
+        fd = open(fifo_name, O_WRONLY | O_NONBLOCK);
+    }
+    // (a client that has not opened its FIFO cannot be told, and we do
+    // not wait for it)
+    if(fd < 0)
+    {
+        printf("YAMSD: could not open %s to turn it away\n", (fd_socket == UNUSED) ? "client FIFO" : "client socket");
+        return;
+    }
+    out_buffer.size = 0;
+    if(version == PROTOCOL_V1)
+    {
+        int no_PID = -1;
+        buffer_int(&out_buffer, &no_PID);
+    }
+    else
+    {
+        int frame_start = begin_frame(&out_buffer, SYSCALL_CONNECT, UNUSED, req->request_id);
+        pack_int(&out_buffer, STATUS_FULL);
+        end_frame(&out_buffer, frame_start);
+    }
+    write_buffer(fd, &out_buffer);
+    fio_close(fd);
+}
+
+/* the following function returns the current tick of the timer wheel */
+unsigned long current_tick()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000UL + now.tv_nsec / 1000000) / TIMER_TICK;
+}
+
+/* the following function starts a timer that runs out 'timeout'        *
+ * milliseconds from now (rounded up to whole ticks) on the client's    *
+ * current request, and returns it; 'timeout' may not be negative       */
+struct Timer * start_timer(struct Client *my_client, int timeout)
+{
+    struct Timer *timer = malloc(sizeof(struct Timer));
+    timer->kind = my_client->opcode;
+    timer->PID = my_client->PID;
+    timer->request_id = my_client->request_id;
+    timer->waiter = NULL;
+    // (the current tick is partly over, so count from the next one)
+    // (as an unsigned long, so that the rounding cannot overflow)
+    unsigned long ticks = ((unsigned long)timeout + TIMER_TICK - 1) / TIMER_TICK;
+    wheel_add(&timers, timer, current_tick() + ticks + 1);
+    return timer;
+}
 
-/* create a hash table of mailboxes */
-struct Mailbox *mboxes[LIST_SIZE];
+/* the following function stops the timer on a client's JOINPID or     *
+ * WAIT, if there is one                                                */
+void stop_timer(struct Client *my_client)
+{
+    if(my_client->timer == NULL)
+        return;
+    wheel_remove(&timers, my_client->timer);
+    free(my_client->timer);
+    my_client->timer = NULL;
+}
+
+/* the following function stops the timer on a timed RECV that a shard  *
+ * is done with. Only the main thread frees a RECV's timer: one that is  *
+ * still in the wheel (in a slot) goes at once, but one that has gone   *
+ * off has a JOB_TIMEOUT that may still look at it, so it goes only     *
+ * once that JOB_TIMEOUT says it is done ('timed_out')                  */
+void cancel_timer(struct Timer *timer, bool timed_out)
+{
+    if(timer->slot != NULL)
+    {
+        wheel_remove(&timers, timer);
+        free(timer);
+    }
+    else if(timed_out)
+        free(timer);
+}
+
+/* the following function frees a disconnected client's array slot once *
+ * the shards are done with it                                          */
+void release_client(struct Client *my_client)
+{
+    printf("YAMSD: releasing client %d\n", my_client->PID);
+    drop_rings(my_client);
+    STORE(my_client->PID, UNUSED);
+    STORE(my_client->closing, false);
+    // the next client in this slot gets a different PID:
+    my_client->generation = (my_client->generation + 1) & GENERATION_MASK;
+    my_client->next_free = UNUSED;
+    if(last_free == UNUSED)
+        first_free = my_client->slot;
+    else
+        get_client(last_free)->next_free = my_client->slot;
+    last_free = my_client->slot;
+}
+
+/* the following function tries a FIFO client's FIFO again on the next  *
+ * tick; the timer carries the client's slot, as it has no PID yet      */
+void await_fifo(struct Client *my_client)
+{
+    my_client->timer = start_timer(my_client, 0);
+    my_client->timer->PID = my_client->slot;
+}
+
+/* the following function tries again to open the FIFO of a client that *
+ * had not opened it when it CONNECTed, and gives up on the client once *
+ * its time is up                                                       */
+void retry_connect(struct Client *my_client)
+{
+    my_client->timer = NULL;
+    my_client->fd_outgoing = open(my_client->fifo_name, O_WRONLY | O_NONBLOCK);
+    if(my_client->fd_outgoing >= 0)
+        finish_connect(my_client);
+    else if(errno == ENXIO && current_tick() < my_client->open_by)
+    {
+        my_client->fd_outgoing = UNUSED;
+        await_fifo(my_client);
+    }
+    else
+    {
+        printf("YAMSD: client FIFO %s was never opened; giving up on the client\n", my_client->fifo_name);
+        my_client->fd_outgoing = UNUSED;
+        release_client(my_client);
+    }
+}
+
+/* the following function turns the timer wheel and times out whatever  *
+ * has run out of time: JOINPIDs and WAITs straight away, and RECVs by   *
+ * the shard that has them waiting                                      */
+void run_timers()
+{
+    struct Timer *timer = wheel_advance(&timers, current_tick());
+    while(timer != NULL)
+    {
+        struct Timer *next = timer->next;
+        struct Client *my_client = live(timer->PID) ? get_client(timer->PID) : NULL;
+        if(timer->kind == SYSCALL_CONNECT)
+            retry_connect(get_client(timer->PID));
+        else if(timer->kind == SYSCALL_RECV_TIMED)
+        {
+            // (even for a client that is going away, as its waiter may
+            // still point at the timer; the timer is freed once the
+            // JOB_TIMEOUT is done with it, see cancel_timer)
+            struct Request expire = {PROTOCOL_V2, JOB_TIMEOUT, timer->PID, timer->request_id, 0, {NULL, 0, 0, 0}};
+            post_timed_job(&expire, get_client(timer->PID)->mailbox_name, timer);
+            timer = next;
+            continue;
+        }
+        else if(my_client != NULL && my_client->timer == timer)
+        {
+            printf("YAMSD: %s of process %d timed out\n", (my_client->join_PID != UNUSED) ? "JOINPID" : "WAIT", timer->PID);
+            my_client->timer = NULL;
+            my_client->join_PID = UNUSED;
+            my_client->wait_PID = UNUSED;
+            reply_int(my_client, STATUS_TIMEOUT, false, 0);
+        }
+        free(timer);
+        timer = next;
+    }
+}
+
+/* the following function disconnects from a client process     */
+void disconnect_process(struct Client *my_client)
+{
+    // first, find out if any process has JOINed my_client
+    // and send any that have a no-error (0) signal:
+    for(int i = 0; i < client_slots; i++)
+    {
+        struct Client *joiner = get_client(i);
+        if(live(joiner->PID) && joiner->join_PID == my_client->PID)
+        {
+            joiner->join_PID = UNUSED;
+            stop_timer(joiner);
+            reply_int(joiner, STATUS_OK, false, 0);
+        }
+    }
+    // now, disconnect my_client by closing FIFOs and 
+    // marking its file descriptor as UNUSED:
+    printf("YAMSD: disconnecting from client %d.\n", my_client->PID);
+    if(!my_client->disconnecting)
+        reply_text(my_client, STATUS_OK, "DISCONNECTING. Goodbye.");
+    if(my_client->overflows[OVERFLOW_BLOCK] + my_client->overflows[OVERFLOW_DROP_SPAM] + my_client->overflows[OVERFLOW_DISCONNECT] > 0)
+        printf("YAMSD: client %d fell behind %d times: %d waited for, %d SPAM messages dropped, %d disconnected\n", my_client->PID,
+               my_client->overflows[OVERFLOW_BLOCK] + my_client->overflows[OVERFLOW_DROP_SPAM] + my_client->overflows[OVERFLOW_DISCONNECT],
+               my_client->overflows[OVERFLOW_BLOCK], my_client->overflows[OVERFLOW_DROP_SPAM], my_client->overflows[OVERFLOW_DISCONNECT]);
+    close_outgoing(my_client);
+    my_client->fd_outgoing = UNUSED;
+    my_client->join_PID = UNUSED;
+    my_client->wait_PID = UNUSED;
+    stop_timer(my_client);
+    free_inbuffer(&(my_client->fragments));
+    my_client->fragments_id = UNUSED;
+    my_client->fragments_refused = false;
+    my_client->disconnecting = false;
+    // the array slot stays taken until the shards are done with the
+    // client, starting with the one that may have it waiting in RECV:
+    STORE(my_client->closing, true);
+    struct Request forget = {my_client->protocol, SYSCALL_EXIT, my_client->PID, 0, 0, {NULL, 0, 0, 0}};
+    post_job(&forget, my_client->mailbox_name);
+    // note that we are now connected to one fewer client process:
+    connections--;
+    printf("YAMSD: connected to %d clients\n", connections);
+}
+
+/* the following function disconnects the clients whose connection     *
+ * failed or who fell too far behind, now that nobody is in the middle  *
+ * of answering them                                                    */
+void run_disconnects()
+{
+    while(running && first_disconnecting != UNUSED)
+    {
+        struct Client *my_client = get_client(first_disconnecting);
+        first_disconnecting = my_client->next_disconnecting;
+        if(live(my_client->PID) && my_client->disconnecting)
+            disconnect_process(my_client);
+    }
+}
+
+/* the following function takes the free slot in the client table that *
+ * has been free the longest, making a new chunk of slots if there are  *
+ * none; it returns NULL if the table is as big as it gets              */
+struct Client * take_client()
+{
+    if(first_free == UNUSED && client_slots < MAX_CLIENTS)
+    {
+        struct Client *chunk = malloc(CLIENT_CHUNK * sizeof(struct Client));
+        for(int i = 0; i < CLIENT_CHUNK; i++)
+        {
+            struct Client *my_client = &(chunk[i]);
+            my_client->PID = UNUSED;
+            my_client->slot = client_slots + i;
+            my_client->generation = 0;
+            my_client->next_free = (i + 1 < CLIENT_CHUNK) ? my_client->slot + 1 : UNUSED;
+            my_client->join_PID = UNUSED;
+            my_client->wait_PID = UNUSED;
+            my_client->timer = NULL;
+            my_client->fd_outgoing = UNUSED;
+            my_client->fragments = (struct InBuffer){NULL, 0, 0, 0};
+            my_client->fragments_id = UNUSED;
+            my_client->fragments_refused = false;
+            my_client->send_ring = NULL;
+            my_client->recv_ring = NULL;
+            my_client->outbound = (struct OutQueue){{NULL, 0, 0}, 0, 0};
+            my_client->watching_output = false;
+            my_client->disconnecting = false;
+            my_client->pending_jobs = 0;
+            my_client->closing = false;
+        }
+        client_chunks[client_slots / CLIENT_CHUNK] = chunk;
+        first_free = client_slots;
+        last_free = client_slots + CLIENT_CHUNK - 1;
+        STORE(client_slots, client_slots + CLIENT_CHUNK);
+        printf("YAMSD: client table grown to %d slots\n", client_slots);
+    }
+    if(first_free == UNUSED)
+        return NULL;
+    struct Client *my_client = get_client(first_free);
+    first_free = my_client->next_free;
+    if(first_free == UNUSED)
+        last_free = UNUSED;
+    return my_client;
+}
+
+/* the following function checks that the body of a SEND is what it   *
+ * says it is -- as many lines as it promises, all there in the payload *
+ * or in a reserved slot of the sender's ring -- without moving on past *
+ * it in the payload                                                    */
+bool valid_body(struct Request *req)
+{
+    int start = req->params.pos;
+    int lines = 0, offset = RING_INLINE, length = 0;
+    bool valid;
+    get_int(req, &lines);
+    if(req->opcode == SYSCALL_SEND_SHARED)
+    {
+        struct Ring *ring = get_client(req->PID)->send_ring;
+        get_int(req, &offset);
+        get_int(req, &length);
+        valid = (ring != NULL && lines >= 0 && ring_valid(ring, offset, length));
+    }
+    else
+    {
+        int counted = 0, line_length;
+        char *line;
+        while(counted < lines && unpack_chars(&(req->params), &line, &line_length))
+            counted++;
+        valid = (lines >= 0 && counted == lines);
+    }
+    req->params.pos = start;
+    return valid;
+}
+
+/* the following function confirms a SEND to the client that made it   */
+void acknowledge_send(struct Request *req, int status, int lines)
+{
+    if(get_client(req->PID)->protocol == PROTOCOL_V1)
+    {
+        char response_string[STRING_SIZE * 2];
+        sprintf(response_string, "Received %d message lines", lines);
+        reply_text(get_client(req->PID), status, response_string);
+    }
+    else
+        reply_int(get_client(req->PID), status, status == STATUS_OK, lines);
+}
+
+void read_message(struct Request *req, struct Message *msg)
+{
+    int lines = 0;
+    int status = STATUS_OK;
+    if(req->opcode == SYSCALL_SEND_SHARED)
+    {
+        // the lines are already packed in the sender's ring, so just
+        // note where they are (once we are sure they really are there):
+        int num_lines = 0, offset = RING_INLINE, length = 0;
+        struct Ring *ring = get_client(req->PID)->send_ring;
+        get_int(req, &num_lines);
+        get_int(req, &offset);
+        get_int(req, &length);
+        if(ring != NULL && num_lines >= 0 && ring_valid(ring, offset, length))
+        {
+            msg->ring = ring;
+            msg->ring_offset = offset;
+            msg->ring_length = length;
+            __atomic_add_fetch(&(ring->refs), 1, __ATOMIC_RELAXED);
+            lines = num_lines;
+            printf("YAMSD: received %d lines (%d bytes) at offset %d of client %d's ring\n", lines, length, offset, req->PID);
+        }
+        else
+            status = STATUS_BAD_REQUEST;
+        msg->num_lines = lines;
+    }
+    else
+    {
+        // the line count comes first (v1 clients end their lines with an
+        // empty one instead, but collect_v1_params takes care of that),
+        // and the lines are packed just as the message keeps them:
+        int num_lines = 0;
+        struct InBuffer *params = &(req->params);
+        get_int(req, &num_lines);
+        if(set_body(msg, params->data + params->pos, params->size - params->pos, num_lines))
+        {
+            lines = num_lines;
+            printf("YAMSD: received %d lines (%d bytes)\n", lines, msg->body->length);
+        }
+        else
+            status = STATUS_BAD_REQUEST;
+    }
+    // client expects a confirmation, so...
+    acknowledge_send(req, status, lines);
+    printf("YAMSD: finished receiving %d lines of text\n", lines);
+}
+
+/* the following function adds already-packed message lines to the   *
+ * reply being built for a v1 client, which only understands loose     *
+ * strings; a malformed body still has to produce as many of them as   *
+ * we promised                                                          */
+void add_loose_lines(char *lines, int length, int num_lines)
+{
+    struct InBuffer body = {lines, length, 0, 0};
+    for(int i = 0; i < num_lines; i++)
+    {
+        char *line = "";
+        int line_length = 0;
+        unpack_chars(&body, &line, &line_length);
+        buffer_chars(&out_buffer, line, line_length);
+    }
+}
+
+/* the following function adds already-packed message lines to the v2 *
+ * reply being built for a client: straight into the client's receive  *
+ * ring if they are big and there is room, otherwise inline            */
+void add_packed_lines(struct Client *my_client, char *lines, int length)
+{
+    int offset = RING_INLINE;
+    if(my_client->recv_ring != NULL)
+    {
+        if(length >= RING_THRESHOLD)
+            offset = ring_reserve(my_client->recv_ring, length);
+        if(offset != RING_INLINE)
+            memcpy(ring_data(my_client->recv_ring, offset), lines, length);
+        pack_int(&out_buffer, offset);
+    }
+    if(offset != RING_INLINE)
+        pack_int(&out_buffer, length);
+    else
+        // the lines are packed already, so they go in as they are:
+        pack_bytes(&out_buffer, lines, length);
+}
+
+/* the following function adds the lines of a message that are packed  *
+ * in its sender's ring to the reply being built for a client, then it *
+ * hands the slot in the sender's ring back                            */
+void add_ring_lines(struct Client *my_client, struct Message *msg)
+{
+    char *lines = ring_data(msg->ring, msg->ring_offset);
+    if(my_client->protocol == PROTOCOL_V1)
+        add_loose_lines(lines, msg->ring_length, msg->num_lines);
+    else
+        add_packed_lines(my_client, lines, msg->ring_length);
+    ring_release(msg->ring, msg->ring_offset);
+    drop_ring(msg->ring);
+}
+
+/* the following function adds a message (see write_message) to the v2 *
+ * reply being built for a client, then disposes of it                  */
+void add_message_fields(struct Client *my_client, struct Message *msg)
+{
+    pack_int(&out_buffer, msg->priority);
+    pack_int(&out_buffer, msg->type);
+    pack_string(&out_buffer, name_of(msg->sender_id));
+    pack_int(&out_buffer, msg->num_lines);
+    if(msg->ring != NULL)
+        add_ring_lines(my_client, msg);
+    else
+        // the body is packed for v2 clients already:
+        add_packed_lines(my_client, body_lines(msg->body), msg->body->length);
+    free_message(msg);
+}
+
+void write_message(int clientPID, struct Message *msg)
+{
+    /* response takes the following form (v2: after the status code)        *
+     * - int: priority                                                      *
+     * - int: message type                                                  *
+     * - C-string: sender mailbox name                                      *
+     * - int: number of lines                                               *
+     * - (n) C-strings: the message                                         */
+    // gather the whole response into one buffer so that it goes
+    // out to the client in a single write() call:
+    bool v1 = (get_client(clientPID)->protocol == PROTOCOL_V1);
+    int lines = msg->num_lines;
+    // a client that has fallen too far behind may not get SPAM at all:
+    if(drop_spam(get_client(clientPID), msg->priority))
+    {
+        // (nor does the sender's ring slot need keeping any more)
+        if(msg->ring != NULL)
+        {
+            ring_release(msg->ring, msg->ring_offset);
+            drop_ring(msg->ring);
+        }
+        free_message(msg);
+        return;
+    }
+    printf("YAMSD: sending %d message lines to client %d\n", lines, clientPID);
+    if(!v1)
+    {
+        // (which also disposes of the message)
+        begin_reply(get_client(clientPID), STATUS_OK);
+        add_message_fields(get_client(clientPID), msg);
+        send_reply(get_client(clientPID));
+        printf("YAMSD: message sent\n");
+        return;
+    }
+    buffer_int(&out_buffer, &(msg->priority));
+    buffer_int(&out_buffer, &(msg->type));
+    buffer_string(&out_buffer, name_of(msg->sender_id));
+    // let the client know how many lines we are about to send:
+    buffer_int(&out_buffer, &lines);
+    if(msg->ring != NULL)
+        add_ring_lines(get_client(clientPID), msg);
+    else
+    {
+        // v1 clients take the lines one at a time:
+        for (int i = 0; i < lines; i++)
+        {
+            int length;
+            char *line = message_line(msg, i, &length);
+            buffer_chars(&out_buffer, line, length);
+        }
+    }
+    send_output(get_client(clientPID));
+    printf("YAMSD: message sent\n");
+
+    // we are now done with this message, so we have to 
+    // dispose of the memory that we used to hold it
+    free_message(msg);
+}
+
+
+/* the following function hands a message straight from its sender to *
+ * a client that is already blocked in RECV for it, without filing it  *
+ * in a mailbox or copying its lines into a struct Message on the way  */
+void stream_message(struct Request *req, struct Waiter *waiter, int priority, int type)
+{
+    int receiverPID = waiter->PID;
+    struct Client *sender = get_client(req->PID);
+    struct Client *receiver = get_client(receiverPID);
+    bool v1 = (receiver->protocol == PROTOCOL_V1);
+
+    // the lines arrive packed (and checked; see valid_body), and can
+    // go out just as they are:
+    char *packed = NULL;
+    int lines = 0, length = 0, offset = RING_INLINE;
+    get_int(req, &lines);
+    if(req->opcode == SYSCALL_SEND_SHARED)
+    {
+        get_int(req, &offset);
+        get_int(req, &length);
+        packed = ring_data(sender->send_ring, offset);
+    }
+    else
+    {
+        int start = req->params.pos, line_length;
+        char *line;
+        for(int i = 0; i < lines; i++)
+            unpack_chars(&(req->params), &line, &line_length);
+        packed = req->params.data + start;
+        length = req->params.pos - start;
+    }
+
+    // a receiver that has fallen too far behind may not get SPAM at all:
+    if(!drop_spam(receiver, priority))
+    {
+        // build the receiver's reply:
+        if(v1)
+        {
+            buffer_int(&out_buffer, &priority);
+            buffer_int(&out_buffer, &type);
+            buffer_string(&out_buffer, sender->mailbox_name);
+            buffer_int(&out_buffer, &lines);
+            add_loose_lines(packed, length, lines);
+            send_output(receiver);
+        }
+        else
+        {
+            // (this is the answer to the waiting RECV, not to the SEND)
+            my_waiter = waiter;
+            begin_reply(receiver, STATUS_OK);
+            pack_int(&out_buffer, priority);
+            pack_int(&out_buffer, type);
+            pack_string(&out_buffer, sender->mailbox_name);
+            pack_int(&out_buffer, lines);
+            add_packed_lines(receiver, packed, length);
+            send_reply(receiver);
+            my_waiter = NULL;
+        }
+        printf("YAMSD: streamed %d message lines straight to waiting client %d\n", lines, receiverPID);
+    }
+    if(offset != RING_INLINE)
+        ring_release(sender->send_ring, offset);
+    // the sender expects a confirmation, too:
+    acknowledge_send(req, STATUS_OK, lines);
+}
+
+/* the following function takes a RECV that is over off its mailbox,    *
+ * and has the main thread stop its timer if it was a timed one         */
+void end_wait(struct Mailbox *mbox, struct Waiter *waiter)
+{
+    if(waiter->timer != NULL)
+    {
+        // (should the timer have gone off already, its JOB_TIMEOUT
+        // finds nothing left to time out)
+        waiter->timer->waiter = NULL;
+        post_cancel(waiter->PID, waiter->timer, false);
+    }
+    remove_waiter(mbox, waiter);
+}
+
+/* the following function receives a client message             */
+void receive_message(struct Request *req)
+{
+    /* SEND takes these parameters:                                         *
+     * - C-string: destination mailbox name                                 *
+     * - int: priority                                                      *
+     * - int: message type                                                  *
+     * - (n) C-strings: the message                                         *
+     * - one empty C-string as a message terminator                         *
+     * (v2 sends the number of lines before the message instead of the     *
+     * terminator after it)                                                 */
+    int clientPID = req->PID;
+
+    // read the mailbox name:
+    char mbox_name[STRING_SIZE];
+    get_string(req, mbox_name, STRING_SIZE);
+
+    // read the message priority and type:
+    int priority, type;
+    char pri[SHORT_STRING], typ[SHORT_STRING];
+    get_int(req, &priority);
+    pri_str(pri, priority);
+    get_int(req, &type);
+    typ_str(typ, type);
+
+    printf("YAMSD: receiving priority %s, type %s message from client %d for mailbox %s\n", pri, typ, clientPID, mbox_name);
+
+    // a body that is not what it claims to be is turned away before it
+    // can reach anyone, whether or not a RECV is waiting for it:
+    if(!valid_body(req))
+    {
+        printf("YAMSD: message from client %d is malformed\n", clientPID);
+        acknowledge_send(req, STATUS_BAD_REQUEST, 0);
+        return;
+    }
+
+    // find the mailbox, creating it if it does not yet exist:
+    struct Mailbox * mbox = register_mbox(mbox_name);
+
+    // before we store the message, find out if a client is waiting for it
+    // (the one that has waited longest, if several are):
+    struct Waiter *waiter = find_waiter(mbox, priority, type, get_client(clientPID)->mailbox_id);
+    if (waiter != NULL)
+    {
+        // if we get here, we found a waiting client *and* 
+        // the priority, type, and sender match the wait requirements,
+        // so the message can go straight to the waiting client:
+        stream_message(req, waiter, priority, type);
+
+        // and then mark the RECV as no longer waiting:
+        end_wait(mbox, waiter);
+        return;
+    }
+
+    // if we get here, there is no waiting client
+    // that matches P, T, and S criteria, so we file this message:
+
+    // add a message to the list:
+    struct Message * msg = add_message(mbox, priority, type, get_client(clientPID)->mailbox_id);
+
+    // now read the actual message:
+    read_message(req, msg);
+}
+
+/* the following function tells whether a SEND_MULTI target is a name   *
+ * pattern rather than a mailbox name                                   */
+bool is_pattern(char *target)
+{
+    return strpbrk(target, "*?[") != NULL;
+}
+
+/* the following function hands a multicast body to the shards that   *
+ * own its targets ('names' holds the targets packed for each shard,   *
+ * and 'counts' how many there are); whichever shard finishes last     *
+ * answers the request                                                  */
+void post_copies(struct Request *req, struct Body *body, int priority, int type, struct OutBuffer *names, int *counts)
+{
+    // every shard has to be counted before any of them can finish:
+    struct Multicast *cast = malloc(sizeof(struct Multicast));
+    cast->body = body;
+    cast->serial = ++multicasts;
+    cast->shards_left = 0;
+    cast->delivered = 0;
+    for(int s = 0; s < num_shards; s++)
+        if(counts[s] > 0)
+            cast->shards_left++;
+    if(cast->shards_left == 0)
+    {
+        reply_int(get_client(req->PID), STATUS_OK, true, 0);
+        drop_body(body);
+        free(cast);
+        return;
+    }
+    // each shard's job: priority, type, and then its own targets:
+    struct OutBuffer job_params = {NULL, 0, 0};
+    for(int s = 0; s < num_shards; s++)
+    {
+        if(counts[s] == 0)
+            continue;
+        job_params.size = 0;
+        pack_int(&job_params, priority);
+        pack_int(&job_params, type);
+        pack_int(&job_params, counts[s]);
+        pack_bytes(&job_params, names[s].data, names[s].size);
+        struct Request job = *req;
+        job.params = (struct InBuffer){job_params.data, job_params.size, job_params.capacity, 0};
+        post_to_shard(&(shards[s]), &job, cast, NULL);
+    }
+    free_buffer(&job_params);
+}
+
+/* the following function splits a multicast SEND up among the shards  *
+ * that own its targets: each one gets the names it owns, plus every    *
+ * pattern (any shard may own mailboxes that match one), and the body   *
+ * is copied out of the request just once for all of them              */
+void post_multicast(struct Request *req)
+{
+    struct Client *my_client = get_client(req->PID);
+    struct InBuffer *params = &(req->params);
+    char target[STRING_SIZE];
+    int priority = 0, type = 0, num_targets = 0, num_lines = 0;
+    get_int(req, &priority);
+    get_int(req, &type);
+    get_int(req, &num_targets);
+    // the body comes after the targets:
+    int targets_start = params->pos;
+    int i;
+    for(i = 0; i < num_targets && unpack_string(params, target, STRING_SIZE); i++)
+        ;
+    get_int(req, &num_lines);
+    struct Body *body = NULL;
+    if(num_targets >= 0 && i == num_targets)
+        body = new_body(params->data + params->pos, params->size - params->pos, num_lines);
+    if(body == NULL)
+    {
+        reply_int(my_client, STATUS_BAD_REQUEST, false, 0);
+        return;
+    }
+    printf("YAMSD: received %d lines (%d bytes) for %d targets from client %d\n", num_lines, body->length, num_targets, req->PID);
+
+    // sort the targets out by shard:
+    struct OutBuffer names[MAX_SHARDS];
+    int counts[MAX_SHARDS];
+    for(int s = 0; s < num_shards; s++)
+    {
+        names[s] = (struct OutBuffer){NULL, 0, 0};
+        counts[s] = 0;
+    }
+    params->pos = targets_start;
+    for(i = 0; i < num_targets; i++)
+    {
+        unpack_string(params, target, STRING_SIZE);
+        int first = 0, last = num_shards - 1;
+        if(!is_pattern(target))
+            first = last = mbox_shard(name_hash(target));
+        for(int s = first; s <= last; s++)
+        {
+            pack_string(&(names[s]), target);
+            counts[s]++;
+        }
+    }
+    post_copies(req, body, priority, type, names, counts);
+    for(int s = 0; s < num_shards; s++)
+        free_buffer(&(names[s]));
+}
+
+/* the following function publishes a message to a topic: it goes to   *
+ * every mailbox subscribed to the topic whose filter it passes, just   *
+ * as a multicast SEND would take it there                              */
+void publish_message(struct Request *req)
+{
+    /* PUBLISH takes these parameters:                                      *
+     * - C-string: topic name                                               *
+     * - int: priority                                                      *
+     * - int: message type                                                  *
+     * - int: number of lines                                               *
+     * - (n) C-strings: the message                                         */
+    struct InBuffer *params = &(req->params);
+    char topic_name[STRING_SIZE];
+    int priority = 0, type = 0, num_lines = 0;
+    get_string(req, topic_name, STRING_SIZE);
+    get_int(req, &priority);
+    get_int(req, &type);
+    get_int(req, &num_lines);
+    struct Body *body = new_body(params->data + params->pos, params->size - params->pos, num_lines);
+    if(body == NULL)
+    {
+        reply_int(get_client(req->PID), STATUS_BAD_REQUEST, false, 0);
+        return;
+    }
+    struct Topic *topic = get_topic(find_name(topic_name));
+    int subscribers = (topic != NULL) ? topic->count : 0;
+    printf("YAMSD: publishing %d lines (%d bytes) from client %d to the %d subscribers of topic %s\n", num_lines, body->length, req->PID, subscribers, topic_name);
+
+    // sort the subscribers that want it out by shard:
+    struct OutBuffer names[MAX_SHARDS];
+    int counts[MAX_SHARDS];
+    for(int s = 0; s < num_shards; s++)
+    {
+        names[s] = (struct OutBuffer){NULL, 0, 0};
+        counts[s] = 0;
+    }
+    for(int i = 0; i < subscribers; i++)
+    {
+        struct Subscription *sub = &(topic->subscriptions[i]);
+        if(!wants(sub, priority, type))
+            continue;
+        char *mbox_name = name_of(sub->mailbox_id);
+        int s = mbox_shard(name_hash(mbox_name));
+        pack_string(&(names[s]), mbox_name);
+        counts[s]++;
+    }
+    post_copies(req, body, priority, type, names, counts);
+    for(int s = 0; s < num_shards; s++)
+        free_buffer(&(names[s]));
+}
+
+/* the following function subscribes a client's mailbox to a topic, or  *
+ * ends its subscription                                                */
+void subscribe_topic(struct Request *req)
+{
+    /* SUBSCRIBE takes these parameters:                                    *
+     * - C-string: topic name                                               *
+     * - int: priority to subscribe to                                      *
+     * - int: message type to subscribe to                                  *
+     * UNSUBSCRIBE takes just the topic name                                */
+    struct Client *my_client = get_client(req->PID);
+    char topic_name[STRING_SIZE];
+    int priority, type;
+    get_string(req, topic_name, STRING_SIZE);
+    // (only a SUBSCRIBE makes a topic, so only it interns the name)
+    int topic_id = (req->opcode == SYSCALL_SUBSCRIBE) ? intern_name(topic_name) : find_name(topic_name);
+    if(req->opcode == SYSCALL_SUBSCRIBE)
+    {
+        get_int(req, &priority);
+        get_int(req, &type);
+        int subscribers = subscribe(topic_id, my_client->mailbox_id, priority, type);
+        printf("YAMSD: mailbox %s subscribed to topic %s, which now has %d subscribers\n", my_client->mailbox_name, topic_name, subscribers);
+        reply_int(my_client, STATUS_OK, true, subscribers);
+    }
+    else if(unsubscribe(topic_id, my_client->mailbox_id))
+    {
+        printf("YAMSD: mailbox %s unsubscribed from topic %s\n", my_client->mailbox_name, topic_name);
+        reply_int(my_client, STATUS_OK, true, get_topic(topic_id)->count);
+    }
+    else
+        reply_int(my_client, STATUS_ERROR, false, 0);
+}
+
+/* the following function files a copy of a multicast message in one  *
+ * mailbox (unless it has one already), handing it straight on if a    *
+ * client is waiting for it; it returns whether the mailbox got a copy  */
+bool deliver_copy(struct Mailbox *mbox, int priority, int type, int sender, struct Multicast *cast)
+{
+    if(mbox->last_multicast == cast->serial)
+        return false;
+    mbox->last_multicast = cast->serial;
+    struct Message *msg = add_message(mbox, priority, type, sender);
+    share_body(msg, cast->body);
+    struct Waiter *waiter = find_waiter(mbox, priority, type, sender);
+    if(waiter != NULL)
+    {
+        // nothing else in the mailbox matched the RECV, or it would not
+        // be waiting, so this is the message that it gets:
+        msg = fetch_first_message(mbox, waiter->priority, waiter->type, waiter->sender);
+        my_waiter = waiter;
+        write_message(waiter->PID, msg);
+        my_waiter = NULL;
+        end_wait(mbox, waiter);
+    }
+    return true;
+}
+
+/* the following function delivers this shard's share of a multicast   *
+ * SEND or a PUBLISH                                                    */
+void multicast_message(struct Request *req, struct Multicast *cast)
+{
+    /* SEND_MULTI reaches a shard with these parameters:                    *
+     * - int: priority                                                      *
+     * - int: message type                                                  *
+     * - int: number of targets                                             *
+     * - (n) C-strings: the targets (mailbox names, or for SEND_MULTI also  *
+     *   patterns) that this shard owns                                     *
+     * (the body is in 'cast')                                              */
+    int priority, type, num_targets, reached = 0;
+    char target[STRING_SIZE];
+    get_int(req, &priority);
+    get_int(req, &type);
+    get_int(req, &num_targets);
+    int sender = get_client(req->PID)->mailbox_id;
+    for(int i = 0; i < num_targets; i++)
+    {
+        get_string(req, target, STRING_SIZE);
+        if(req->opcode == SYSCALL_SEND_MULTI && is_pattern(target))
+        {
+            // a pattern only reaches mailboxes that exist already:
+            int pos = 0;
+            struct Mailbox *mbox;
+            while((mbox = next_mbox(&(my_shard->mboxes), &pos)) != NULL)
+                if(fnmatch(target, mbox->mbox_name, 0) == 0 && deliver_copy(mbox, priority, type, sender, cast))
+                    reached++;
+        }
+        else if(deliver_copy(register_mbox(target), priority, type, sender, cast))
+            reached++;
+    }
+    printf("YAMSD: multicast from client %d reached %d mailboxes in this shard\n", req->PID, reached);
+    __atomic_add_fetch(&(cast->delivered), reached, __ATOMIC_RELAXED);
+    // the last shard to finish answers the sender:
+    if(__atomic_sub_fetch(&(cast->shards_left), 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        reply_int(get_client(req->PID), STATUS_OK, true, cast->delivered);
+        drop_body(cast->body);
+        free(cast);
+    }
+}
+
+/* the following function throws out up to 'max' of the messages in a  *
+ * mailbox that have outlived its TTL and returns how many went         */
+int expire_messages(struct Mailbox *mbox, time_t now, int max)
+{
+    int count = 0;
+    struct Message *msg;
+    while(count < max && (msg = expire_first_message(mbox, now)) != NULL)
+    {
+        // (the sender's ring slot is not needed any more either)
+        if(msg->ring != NULL)
+        {
+            ring_release(msg->ring, msg->ring_offset);
+            drop_ring(msg->ring);
+        }
+        free_message(msg);
+        count++;
+    }
+    if(count > 0)
+    {
+        my_shard->expired += count;
+        printf("YAMSD: expired %d messages from mailbox %s (%ld in all)\n", count, mbox->mbox_name, mbox->expired);
+    }
+    return count;
+}
+
+/* the following function turns the sender name of a CHECK or RECV     *
+ * into what the mailbox code matches on ("*" means any sender)         */
+int sender_filter(char *sender)
+{
+    // (a name that has never been interned has sent nothing, and a
+    // client's filter is no reason to keep it for good)
+    return strcmp(sender, "*") == 0 ? ANY_SENDER : find_name(sender);
+}
+
+void check_messages(struct Request *req)
+{
+    int clientPID = req->PID;
+    printf("YAMSD: received CHECK request for mailbox %s\n", get_client(clientPID)->mailbox_name);
+    /* CHECK takes these parameters:                                        *
+     * - int: priority to check for                                         *
+     * - int: message type to check for                                     *
+     * - C-string: sender mailbox name to check for                         */
+    int priority, type;
+    char pri[SHORT_STRING], typ[SHORT_STRING], sender[STRING_SIZE];
+    get_int(req, &priority);
+    pri_str(pri, priority);
+    get_int(req, &type);
+    typ_str(typ, type);
+    get_string(req, sender, STRING_SIZE);
+                    
+    printf("YAMSD: checking for messages of priority %s and type %s from sender %s\n", pri, typ, sender);
+    // first, get the mailbox (creating one if it does not exist)
+    struct Mailbox * mbox = register_mbox(get_client(clientPID)->mailbox_name);
+    // (messages that have outlived the mailbox's TTL do not count)
+    expire_messages(mbox, time(NULL), EXPIRY_SLICE);
+    int sender_id = sender_filter(sender);
+    int num_waiting = (sender_id == NO_NAME) ? 0 : num_waiting_msgs(mbox, priority, type, sender_id);
+    printf("YAMSD: found %d matching messages\n", num_waiting);
+    if (get_client(clientPID)->protocol == PROTOCOL_V1)
+    {
+        char response_string[STRING_SIZE*2];
+        sprintf(response_string, "You have %d messages of priority %s and type %s from sender %s", num_waiting, pri, typ, sender);
+        reply_text(get_client(clientPID), STATUS_OK, response_string);
+    }
+    else
+        reply_int(get_client(clientPID), STATUS_OK, true, num_waiting);
+}
+
+void fetch_message(struct Request *req, struct Timer *timer)
+{
+    int clientPID = req->PID;
+    /* RECV takes these parameters:                                         *
+     * - int: priority                                                      *
+     * - int: message type                                                  *
+     * - C-string: sender mailbox name                                      */
+    int priority, type;
+    char pri[SHORT_STRING], typ[SHORT_STRING], sender[STRING_SIZE];
+    get_int(req, &priority);
+    pri_str(pri, priority);
+    get_int(req, &type);
+    typ_str(typ, type);
+    get_string(req, sender, STRING_SIZE);
+
+    printf("YAMSD: received FETCH(P: %s, T: %s, S: %s) request from client %d for mailbox %s\n", pri, typ, sender, clientPID, get_client(clientPID)->mailbox_name);
+    // fetch the mailbox for the current client:
+    struct Mailbox *mbox = register_mbox(get_client(clientPID)->mailbox_name);
+    // (nor are they delivered)
+    expire_messages(mbox, time(NULL), EXPIRY_SLICE);
+    // fetch the first qualifying message:
+    int sender_id = sender_filter(sender);
+    struct Message *msg = (sender_id == NO_NAME) ? NULL : fetch_first_message(mbox, priority, type, sender_id);
+    if (msg == NULL)
+    {
+        // no message found, so the RECV waits in line for one:
+        printf("YAMSD: marking process %d as waiting for a message\n", clientPID);
+        struct Waiter *waiter = add_waiter(mbox, clientPID, req->opcode, req->request_id, priority, type, sender_id, sender);
+        // (a timed RECV's timer leads its JOB_TIMEOUT straight here)
+        if(timer != NULL)
+        {
+            waiter->timer = timer;
+            timer->waiter = waiter;
+        }
+    }
+    else
+    {
+        // message found, so send it: 
+        write_message(clientPID, msg);       
+        if(timer != NULL)
+            post_cancel(clientPID, timer, false);
+    }
+}
+
+/* the following function hands a client as many of the messages that  *
+ * match its filter as it asked for, all in one reply; unlike RECV, it   *
+ * never waits                                                          */
+void fetch_batch(struct Request *req)
+{
+    int clientPID = req->PID;
+    struct Client *my_client = get_client(clientPID);
+    /* RECV_BATCH takes these parameters:                                   *
+     * - int: priority                                                      *
+     * - int: message type                                                  *
+     * - C-string: sender mailbox name                                      *
+     * - int: most messages to return                                       *
+     * - int: byte budget (0 for none)                                      */
+    int priority, type, max_msgs, max_bytes;
+    char pri[SHORT_STRING], typ[SHORT_STRING], sender[STRING_SIZE];
+    get_int(req, &priority);
+    pri_str(pri, priority);
+    get_int(req, &type);
+    typ_str(typ, type);
+    get_string(req, sender, STRING_SIZE);
+    get_int(req, &max_msgs);
+    get_int(req, &max_bytes);
+    if(my_client->protocol != PROTOCOL_V2 || max_msgs < 0 || max_bytes < 0)
+    {
+        reply_int(my_client, STATUS_BAD_REQUEST, false, 0);
+        return;
+    }
 
-/* the following function computes the hash code for a mailbox          */
-int mbox_hash(char *mbox_name)
-{
-    // initialize sum to 0, then add each character value in turn
-    int sum = 0;
-    for(int i = 0; i < strlen(mbox_name); i++)
-        sum += (int)mbox_name[i];
-    // the hash code is the remainder when divided by the array size
-    return sum % LIST_SIZE;
+    printf("YAMSD: received FETCH(P: %s, T: %s, S: %s) request for up to %d messages from client %d for mailbox %s\n", pri, typ, sender, max_msgs, clientPID, my_client->mailbox_name);
+    struct Mailbox *mbox = register_mbox(my_client->mailbox_name);
+    expire_messages(mbox, time(NULL), EXPIRY_SLICE);
+    int sender_id = sender_filter(sender);
+    begin_reply(my_client, STATUS_OK);
+    // the count goes first, but we only know it at the end:
+    int count_offset = out_buffer.size;
+    int count = 0;
+    pack_int(&out_buffer, 0);
+    // (the first message always goes, however big it is)
+    while(sender_id != NO_NAME && count < max_msgs && (max_bytes == 0 || out_buffer.size - count_offset - (int)sizeof(int) < max_bytes))
+    {
+        struct Message *msg = fetch_first_message(mbox, priority, type, sender_id);
+        if(msg == NULL)
+            break;
+        add_message_fields(my_client, msg);
+        count++;
+    }
+    memcpy(out_buffer.data + count_offset, &count, sizeof(int));
+    printf("YAMSD: sending %d messages (%d bytes) to client %d\n", count, out_buffer.size - count_offset - (int)sizeof(int), clientPID);
+    send_reply(my_client);
 }
 
-/* the following function registers a new mailbox and returns       *
- * a pointer to it                                                  */
-struct Mailbox * register_mbox(char *mbox_name)
+/* the following function applies the CONFIGURE settings that belong  *
+ * to a client's mailbox and answers the CONFIGURE (run by the shard    *
+ * that owns the mailbox; the main thread has seen to the rest)         */
+void configure_mailbox(struct Request *req)
 {
-    int hash = mbox_hash(mbox_name);
-    if(mboxes[hash]==NULL)
+    int clientPID = req->PID;
+    int num_settings = 0;
+    char setting[STRING_SIZE];
+    struct Mailbox *mbox = register_mbox(get_client(clientPID)->mailbox_name);
+    get_int(req, &num_settings);
+    for(int i = 0; i < num_settings; i++)
     {
-        mboxes[hash] = new_mbox(mbox_name, NULL);
-        printf("YAMSD: new mailbox %s created at hash %d\n", mbox_name, hash);
-        return mboxes[hash];
-    }
-    else
-    {
-        int list_posn = find_mbox(mboxes[hash], mbox_name);
-        if(list_posn < 0)
+        get_string(req, setting, STRING_SIZE);
+        char *value = strchr(setting, ':');
+        if(value == NULL)
+            continue;
+        *value++ = '\0';
+        if(!mailbox_key(setting))
+            continue;
+        if(strcmp(setting, "delivery") == 0 && strcmp(value, "fifo") == 0)
+            mbox->delivery = DELIVERY_FIFO;
+        else if(strcmp(setting, "delivery") == 0 && strcmp(value, "priority") == 0)
+            mbox->delivery = DELIVERY_PRIORITY;
+        else if(strcmp(setting, "aging") == 0 && atoi(value) >= 0)
+            mbox->aging = atoi(value);
+        else if(strcmp(setting, "ttl") == 0 && atoi(value) >= 0)
         {
-            int list_len = add_mbox(mboxes[hash], mbox_name);
-            printf("YAMSD: new mailbox %s added at hash %d to form a list of length %d\n", mbox_name, hash, list_len);
-            // since list positions are zero-based, return mailbox at list_len - 1:
-            return get_mbox_at(mboxes[hash], list_len - 1);
+            // the shard only sweeps while some mailbox has a TTL:
+            my_shard->expiring += (atoi(value) > 0) - (mbox->ttl > 0);
+            mbox->ttl = atoi(value);
+            // (the next expiry works out which messages are stale now)
+            mbox->fresh_since = 0;
         }
         else
         {
-            printf("YAMSD: mailbox %s already registered at hash %d, position %d\n", mbox_name, hash, list_posn);
-            return get_mbox_at(mboxes[hash], list_posn);
+            printf("YAMSD: ignoring unknown setting %s:%s\n", setting, value);
+            continue;
         }
+        printf("YAMSD: mailbox %s now has %s:%s\n", mbox->mbox_name, setting, value);
+    }
+    if(get_client(clientPID)->protocol == PROTOCOL_V2)
+    {
+        // ...along with how many messages the mailbox's TTL has cost it:
+        begin_reply(get_client(clientPID), STATUS_OK);
+        pack_int(&out_buffer, num_settings);
+        pack_int(&out_buffer, (mbox->expired > INT_MAX) ? INT_MAX : (int)mbox->expired);
+        send_reply(get_client(clientPID));
     }
 }
 
-/* the following function reads information from the server FIFO     *
- * to set up a new client struct and connect to a new client process */
-void connect_process(struct Client *my_client)
+/* the following function answers a timed RECV that is still waiting    *
+ * when its time runs out, and then tells the main thread that it is    *
+ * done with the RECV's timer                                           */
+void expire_recv(struct Request *req, struct Timer *timer)
 {
-    // CONNECT has two parameters -- int: linux PID, C-string: mailbox name
-    int processLinuxPID;
-    // read first parameter:
-    read_int(fd_syscall, &processLinuxPID);
-    // construct client FIFO name:
-    sprintf(my_client->fifo_name, CLIENT_FIFO, processLinuxPID);
-    printf("YAMSD: connecting Host-OS process #%d on named pipe %s\n", processLinuxPID, my_client->fifo_name);
-    // read mailbox name:
-    read_string(fd_commchannel, my_client->mailbox_name, STRING_SIZE);
-    struct Mailbox * mbox = register_mbox(my_client->mailbox_name);
-    int waiting = num_waiting_msgs(mbox, PRIORITY_ALL, TYPE_ALL, "*");
-    printf("YAMSD: mailbox %s registered successfully; it has %d waiting messages\n", my_client->mailbox_name, waiting);
-    // give client process a new PID:
-    my_client->PID = nextPID;
-    nextPID = (nextPID + 1) % LIST_SIZE;
-    // assign client process a start time:
-    time(&(my_client->start_time));
-    // report client connection:
-    printf("YAMSD: client process #%d has connected with mailbox %s at time %s\n", my_client->PID, my_client->mailbox_name, ctime(&(my_client->start_time)));
-    // open client FIFO:
-    my_client->fd_outgoing = open(my_client->fifo_name, O_WRONLY);
-    // report successful client connection:
-    printf("YAMSD: opened client FIFO at %s\n", my_client->fifo_name);
-    // send PID back to client to confirm connection:
-    printf("YAMSD: sending PID %d to client\n", my_client->PID);
-    write_int(my_client->fd_outgoing, &(my_client->PID));
-    // note that we are now connected to one additional client process:
-    connections++;
-    printf("YAMSD: connected to %d clients\n", connections);
+    struct Waiter *waiter = timer->waiter;
+    post_cancel(req->PID, timer, true);
+    // (the RECV may have been answered while the timer ran out)
+    if(waiter == NULL)
+        return;
+    struct Client *my_client = get_client(req->PID);
+    printf("YAMSD: RECV of process %d timed out\n", req->PID);
+    my_waiter = waiter;
+    reply_int(my_client, STATUS_TIMEOUT, false, 0);
+    my_waiter = NULL;
+    remove_waiter(register_mbox(my_client->mailbox_name), waiter);
 }
 
-/* handle connection failure gracefully */
-void connect_fail()
+/* the following function stops a disconnected client from waiting on *
+ * its mailbox (run by the shard that owns the mailbox)                 */
+void forget_client(struct Request *req)
 {
-    int clientPID;
-    char param_string[STRING_SIZE];
-    // we need to flush the info from the server FIFO so we can
-    // service the next system call:
-    read_int(fd_syscall, &clientPID);
-    printf("YAMSD: rejecting connection from Linux process %d -- too many clients connected", clientPID);
-    read_string(fd_syscall, param_string, STRING_SIZE);
-    printf("YAMSD: rejecting request to connect mailbox %s", param_string);
-    // TODO: add code to connect client FIFO long enough to send an error code
+    int clientPID = req->PID;
+    char *mbox_name = get_client(clientPID)->mailbox_name;
+    struct Mailbox *mbox = get_mbox(&(my_shard->mboxes), mbox_name, name_hash(mbox_name));
+    if(mbox == NULL)
+        return;
+    // the other clients sharing the mailbox keep their places in line:
+    struct Waiter *waiter = mbox->first_waiter, *next;
+    for(; waiter != NULL; waiter = next)
+    {
+        next = waiter->next;
+        if(waiter->PID == clientPID)
+            end_wait(mbox, waiter);
+    }
 }
 
-/* the following function disconnects from a client process     */
-void disconnect_process(struct Client *my_client)
+/* the following function carries out one job for a shard               */
+void run_job(struct Job *job)
 {
-    // first, find out if any process has JOINed my_client
-    // and send any that have a no-error (0) signal:
-    for(int i = 0; i < LIST_SIZE; i++)
-        if(clients[i].join_PID == my_client->PID)
+    struct Request *req = &(job->req);
+    my_job = req;
+    switch(req->opcode)
+    {
+    case SYSCALL_SEND:
+    case SYSCALL_SEND_SHARED:
+        receive_message(req);
+        break;
+    case SYSCALL_SEND_MULTI:
+    case SYSCALL_PUBLISH:
+        multicast_message(req, job->cast);
+        break;
+    case SYSCALL_CHECK:
+        check_messages(req);
+        break;
+    case SYSCALL_RECV:
+    case SYSCALL_RECV_TIMED:
+        fetch_message(req, job->timer);
+        break;
+    case JOB_TIMEOUT:
+        expire_recv(req, job->timer);
+        break;
+    case SYSCALL_RECV_BATCH:
+        fetch_batch(req);
+        break;
+    case SYSCALL_CONFIGURE:
+        configure_mailbox(req);
+        break;
+    case SYSCALL_EXIT:
+        forget_client(req);
+        break;
+    }
+    // let the main thread know that this job is done:
+    post_answer(req->PID, true, false);
+    my_job = NULL;
+}
+
+/* the following function carries a shard's expiry sweep (see          *
+ * EXPIRY_PERIOD) one slice further; it returns true once the sweep has *
+ * been through every mailbox                                           */
+bool expire_slice()
+{
+    time_t now = time(NULL);
+    int budget = EXPIRY_SLICE;
+    struct Mailbox *mbox;
+    // (mailboxes that move while the table grows in between slices may
+    // be missed this time round, but the next sweep will get them)
+    for(int i = 0; i < EXPIRY_MBOXES && budget > 0; i++)
+    {
+        mbox = next_mbox(&(my_shard->mboxes), &(my_shard->expiry_pos));
+        if(mbox == NULL)
         {
-            clients[i].join_PID == UNUSED;
-            int response_int = 0;
-            write_int(clients[i].fd_outgoing, &response_int);
+            my_shard->expiry_pos = 0;
+            return true;
         }
-    // now, disconnect my_client by closing FIFOs and 
-    // marking this array slot and its file descriptor as UNUSED:
-    printf("YAMSD: disconnecting from client %d.\n", my_client->PID);
-    write_string(my_client->fd_outgoing, "DISCONNECTING. Goodbye.");
-    close(my_client->fd_outgoing);
-    my_client->PID = UNUSED;
-    my_client->fd_outgoing = UNUSED;
-    // note that we are now connected to one fewer client process:
-    connections--;
-    printf("YAMSD: connected to %d clients\n", connections);
+        if(mbox->ttl > 0)
+            budget -= expire_messages(mbox, now, budget);
+    }
+    return false;
 }
 
-void read_message(int clientPID, struct Message *msg)
+/* the following function is the body of each shard's worker thread    */
+void * run_shard(void *arg)
 {
-    char message_line[STRING_SIZE];
-    int lines = 0;
-    do {
-        read_string(fd_commchannel, message_line, STRING_SIZE);
-        printf("YAMSD: received line %d = '%s'\n", ++lines, message_line);
-        if(strlen(message_line) > 0)
-            add_line(msg, message_line);
-    } while(strlen(message_line) > 0);
-    // we actually over-count lines by one because of the
-    // last empty line, so...
-    lines--;
-    // client expects a confirmation, so...
-    char response_string[STRING_SIZE * 2];
-    sprintf(response_string, "Received %d message lines", lines);
-    write_string(clients[clientPID].fd_outgoing, response_string);
-    printf("YAMSD: finished receiving %d lines of text\n", lines);
+    my_shard = arg;
+    pthread_mutex_lock(&(my_shard->lock));
+    while(true)
+    {
+        // with mailboxes to sweep, the shard wakes up for the next sweep
+        // even if no job comes in:
+        bool due = false;
+        while(my_shard->first_job == NULL && !my_shard->stopping && !due)
+        {
+            if(my_shard->expiring == 0)
+                pthread_cond_wait(&(my_shard->wakeup), &(my_shard->lock));
+            else if(time(NULL) < my_shard->next_expiry)
+            {
+                struct timespec until = {my_shard->next_expiry, 0};
+                pthread_cond_timedwait(&(my_shard->wakeup), &(my_shard->lock), &until);
+            }
+            else
+                due = true;
+        }
+        struct Job *job = my_shard->first_job;
+        if(job == NULL && my_shard->stopping)
+            break;
+        if(job != NULL)
+        {
+            my_shard->first_job = job->next;
+            if(my_shard->first_job == NULL)
+                my_shard->last_job = NULL;
+        }
+        pthread_mutex_unlock(&(my_shard->lock));
+        if(job != NULL)
+        {
+            run_job(job);
+            free(job->req.params.data);
+            free(job);
+        }
+        // a sweep that is under way goes one slice further between jobs:
+        if(my_shard->expiring > 0 && time(NULL) >= my_shard->next_expiry && expire_slice())
+            my_shard->next_expiry = time(NULL) + EXPIRY_PERIOD;
+        pthread_mutex_lock(&(my_shard->lock));
+    }
+    pthread_mutex_unlock(&(my_shard->lock));
+    return NULL;
 }
 
-void write_message(int clientPID, struct Message *msg)
+/* the following function sends out everything the shards have handed  *
+ * back, in the order each shard produced it                            */
+void read_answers()
 {
-    /* response takes the following form                                    *
-     * - int: priority                                                      *
-     * - int: message type                                                  *
-     * - C-string: sender mailbox name                                      *
-     * - int: number of lines                                               *
-     * - (n) C-strings: the message                                         */
-    write_int(clients[clientPID].fd_outgoing, &(msg->priority));
-    write_int(clients[clientPID].fd_outgoing, &(msg->type));
-    write_string(clients[clientPID].fd_outgoing, msg->sender_mbox);
-    // let the client know how many lines we are about to send:
-    int lines = msg->num_lines;
-    write_int(clients[clientPID].fd_outgoing, &lines);
-    printf("YAMSD: sending %d message lines to client %d\n", lines, clientPID);
-    // now send lines one at a time:
-    struct Line *this_line = msg->first_line;
-    for (int i = 0; i < lines; i++)
+    uint64_t count;
+    read(fd_answers, &count, sizeof(count));
+    for(int i = 0; i < num_shards; i++)
     {
-        // send the line of text and then advance the pointer
-        write_string(clients[clientPID].fd_outgoing, this_line->text);
-        this_line = this_line->next;
+        pthread_mutex_lock(&(shards[i].lock));
+        struct Answer *answer = shards[i].first_answer;
+        shards[i].first_answer = shards[i].last_answer = NULL;
+        pthread_mutex_unlock(&(shards[i].lock));
+        while(answer != NULL)
+        {
+            struct Answer *next = answer->next;
+            struct Client *my_client = get_client(answer->PID);
+            // (clients that have gone away in the meantime get nothing)
+            if(answer->size > 0 && live(answer->PID))
+            {
+                out_buffer.size = 0;
+                pack_bytes(&out_buffer, answer->data, answer->size);
+                if(answer->forced)
+                {
+                    count_overflow(my_client, OVERFLOW_DROP_SPAM);
+                    queue_output(my_client);
+                }
+                else
+                    send_output(my_client);
+            }
+            if(answer->cancel != NULL)
+                cancel_timer(answer->cancel, answer->timed_out);
+            if(answer->finished && --(my_client->pending_jobs) == 0 && my_client->closing)
+                release_client(my_client);
+            free(answer);
+            answer = next;
+        }
     }
-    printf("YAMSD: message sent\n");
+}
 
-    // we are now done with this message, so we have to 
-    // dispose of the memory that we used to hold it
-    struct Line *next_line;
-    this_line = msg->first_line;
-    // first, free all of the memory allocated to the lines of text
-    while (this_line != NULL)
+/* the following function starts one worker thread per shard, as many   *
+ * as there are processors to run them (but at least one)               */
+void start_shards()
+{
+    num_shards = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_shards < 1)
+        num_shards = 1;
+    if(num_shards > MAX_SHARDS)
+        num_shards = MAX_SHARDS;
+    fd_answers = eventfd(0, EFD_NONBLOCK);
+    for(int i = 0; i < num_shards; i++)
     {
-        next_line = this_line->next;
-        free(this_line);
-        this_line = next_line;
+        pthread_mutex_init(&(shards[i].lock), NULL);
+        pthread_cond_init(&(shards[i].wakeup), NULL);
+        shards[i].first_job = shards[i].last_job = NULL;
+        shards[i].first_answer = shards[i].last_answer = NULL;
+        shards[i].stopping = false;
+        init_mbox_table(&(shards[i].mboxes));
+        shards[i].expiring = shards[i].expiry_pos = 0;
+        shards[i].next_expiry = 0;
+        shards[i].expired = 0;
+        pthread_create(&(shards[i].thread), NULL, run_shard, &(shards[i]));
     }
-    // now it is safe to free the message record itself
-    free(msg);
+    printf("YAMSD: started %d mailbox shards\n", num_shards);
 }
 
-/* the following function receives a client message             */
-void receive_message(int clientPID)
+/* the following function lets each worker thread finish the jobs it   *
+ * has and then stops it                                                */
+void stop_shards()
 {
-    /* SEND takes these parameters:                                         *
-     * - C-string: destination mailbox name                                 *
-     * - int: priority                                                      *
-     * - int: message type                                                  *
-     * - (n) C-strings: the message                                         *
-     * - one empty C-string as a message terminator                         */
-
-    // read the mailbox name:
-    char mbox_name[STRING_SIZE];
-    read_string(fd_commchannel, mbox_name, STRING_SIZE);
-
-    // read the message priority and type:
-    int priority, type;
-    char pri[SHORT_STRING], typ[SHORT_STRING];
-    read_int(fd_commchannel, &priority);
-    pri_str(pri, priority);
-    read_int(fd_commchannel, &type);
-    typ_str(typ, type);
+    for(int i = 0; i < num_shards; i++)
+    {
+        pthread_mutex_lock(&(shards[i].lock));
+        shards[i].stopping = true;
+        pthread_cond_signal(&(shards[i].wakeup));
+        pthread_mutex_unlock(&(shards[i].lock));
+        pthread_join(shards[i].thread, NULL);
+    }
+    close(fd_answers);
+}
 
-    printf("YAMSD: receiving priority %s, type %s message from client %d for mailbox %s\n", pri, typ, clientPID, mbox_name);
+/* the following function checks who a (non-CONNECT) request came from *
+ * and carries it out, whichever transport it arrived on               */
+void handle_request(struct Request *req)
+{
+    // set up some communication variables:
+    int clientPID; // which client process we are currently communicating with
+    int param_int; // several syscalls send integer parameters
+    char param_string[STRING_SIZE]; // several syscalls send a string parameter
+    char response_string[STRING_SIZE*2]; // this is the response we echo back to the client process
+    int response_int;
+    int timeout; // (timed calls only)
+    struct Ring *ring; // (SEND_SHARED only)
 
-    // before we store the message, find out if the client is waiting for it
-    int i = 0;
-    bool P = false, T = false, S = false;
-    // step through the list until we find a match for this mailbox name
-    // or run out of list entries
-    while (i < LIST_SIZE && strcmp(clients[i].mailbox_name, mbox_name) != 0)
+    // if this is not a new process connecting, 
+    // the request carries the process' PID:
+    clientPID = req->PID;
+    if(!live(clientPID))
     {
-        i++;
+        printf("YAMSD: received request from invalid process ID number %d\n", clientPID);
+        return;
     }
-    if (i != LIST_SIZE)
+    // (v1 clients were issued their comm-channel "lock" in run_v1_calls)
+    if(req->protocol == PROTOCOL_V2 && req->opcode == SYSCALL_FRAGMENT)
     {
-        // if we get here, we found a matching mailbox
-        P = clients[i].recv_wait_priority == PRIORITY_ALL || clients[i].recv_wait_priority == priority;
-        T = clients[i].recv_wait_type == TYPE_ALL || clients[i].recv_wait_type == type;
-        S = strcmp(clients[i].recv_wait_sender, "*") == 0 || strcmp(clients[i].recv_wait_sender, clients[clientPID].mailbox_name) == 0;
+        // v2 clients send big payloads in pieces, so keep
+        // this one until the rest of the request arrives:
+        collect_fragment(get_client(clientPID), req);
+        return;
     }
-    if (P && T && S)
+    // remember which request we are answering:
+    get_client(clientPID)->opcode = req->opcode;
+    get_client(clientPID)->request_id = req->request_id;
+    if(req->protocol == PROTOCOL_V2 && !finish_fragments(get_client(clientPID), req))
     {
-        // if we get here, we found a matching mailbox *and* 
-        // the priority, type, and sender match the wait requirements
-        struct Message * msg = new_message(priority, type, clients[clientPID].mailbox_name, NULL);
-
-        // client expects a response at this point:
-        char response_string[STRING_SIZE*2];
-        sprintf(response_string, "Ready to receive priority %s, type %s message for mailbox %s", pri, typ, mbox_name);
-        write_string(clients[clientPID].fd_outgoing, response_string);
-
-        // now read the actual message:
-        read_message(clientPID, msg);
+        reply_int(get_client(clientPID), STATUS_BAD_REQUEST, false, 0);
+        return;
+    }
 
-        // and write it to the waiting client:
-        write_message(i, msg);
+    switch(req->opcode)
+    {
+    case SYSCALL_SHUTDOWN:
+        printf("YAMSD: received shutdown request\n");
+        // if there is only one connection, we can safely shut down
+        if(connections == 1)
+        {
+            printf("YAMSD: disconnecting last client and shutting down process server\n");
+            reply_text(get_client(clientPID), STATUS_OK, "SHUTTING DOWN. Goodbye.");
+            close_outgoing(get_client(clientPID));
+            connections = 0;
+            running = false;
+        }
+        else
+            // otherwise, we just disconnect the client process.
+            disconnect_process(get_client(clientPID));
+        break;
+    case SYSCALL_EXIT:
+        disconnect_process(get_client(clientPID));
+        break;
+    case SYSCALL_PING:
+        // syscall PING has one parameter: the integer code that we are to
+        // "bounce" back to the client
+        get_int(req, &param_int);
+        printf("YAMSD: received ping from process %d with code %d\n", clientPID, param_int);
+        if(get_client(clientPID)->protocol == PROTOCOL_V1)
+        {
+            sprintf(response_string, "Received PING with code %d", param_int);
+            reply_text(get_client(clientPID), STATUS_OK, response_string);
+        }
+        else
+            reply_int(get_client(clientPID), STATUS_OK, true, param_int);
+        break;
+    case SYSCALL_CONFIGURE:
+        printf("YAMSD: received CONFIGURE request for mailbox %s\n", get_client(clientPID)->mailbox_name);
+        // syscall CONFIGURE has n + 1 parameters, where n is the first byte after the syscall
+        get_int(req, &param_int);
+        printf("YAMSD: receiving %d configuration strings...\n", param_int);
+        // (v1 clients had each string acknowledged as it came in)
+        for(int i = 0; i < param_int; i++)
+        {
+            get_string(req, param_string, STRING_SIZE);
+            printf("YAMSD: configuring %s.\n", param_string);
+            configure_client(get_client(clientPID), param_string);
+        }
+        // the mailbox's own settings are up to the shard that owns it,
+        // which also sends the reply:
+        req->params.pos = 0;
+        post_job(req, get_client(clientPID)->mailbox_name);
+        break;
+    case SYSCALL_SEND:
+    case SYSCALL_SEND_SHARED:
+        // a client that has corrupted its send ring gets no more use of
+        // it (shards still on its earlier SENDs may be looking at it,
+        // though, so until they are done it just stays broken):
+        ring = get_client(clientPID)->send_ring;
+        if(ring != NULL && __atomic_load_n(&(ring->broken), __ATOMIC_ACQUIRE) && get_client(clientPID)->pending_jobs == 0)
+        {
+            printf("YAMSD: client %d has corrupted its send ring; dropping it\n", clientPID);
+            drop_ring(ring);
+            get_client(clientPID)->send_ring = NULL;
+        }
+        // these go to the shard that owns the destination mailbox:
+        get_string(req, param_string, STRING_SIZE);
+        req->params.pos = 0;
+        post_job(req, param_string);
+        break;
+    case SYSCALL_SEND_MULTI:
+        // ...and this one to every shard that owns one of its targets:
+        printf("YAMSD: received multicast SEND from client %d\n", clientPID);
+        post_multicast(req);
+        break;
+    case SYSCALL_PUBLISH:
+        // (the topics are kept by the main thread)
+        publish_message(req);
+        break;
+    case SYSCALL_SUBSCRIBE:
+    case SYSCALL_UNSUBSCRIBE:
+        subscribe_topic(req);
+        break;
+    case SYSCALL_CHECK:
+    case SYSCALL_RECV:
+    case SYSCALL_RECV_BATCH:
+        // ...and these to the one that owns the client's own:
+        post_job(req, get_client(clientPID)->mailbox_name);
+        break;
+    case SYSCALL_RECV_TIMED:
+        // (the timeout is ours; the shard goes on from after it)
+        get_int(req, &timeout);
+        if(timeout < 0)
+            reply_int(get_client(clientPID), STATUS_BAD_REQUEST, false, 0);
+        else
+            post_timed_job(req, get_client(clientPID)->mailbox_name, start_timer(get_client(clientPID), timeout));
+        break;
+    case SYSCALL_GETPID:
+        // look up process PID:
+        response_int = get_client(clientPID)->PID;
+        printf("YAMSD: received GETPID request from process %d; returning value %d\n", clientPID, response_int);
+        reply_int(get_client(clientPID), STATUS_OK, true, response_int);
+        break;
+    case SYSCALL_GETAGE:
+        // determine process age:
+        response_int = time(NULL) - get_client(clientPID)->start_time;
+        printf("YAMSD: received GETAGE request from process %d; process has been alive %d seconds\n", clientPID, response_int);
+        reply_int(get_client(clientPID), STATUS_OK, true, response_int);
+        break;
+    case SYSCALL_JOINPID:
+    case SYSCALL_JOINPID_TIMED:
+        // syscall JOINPID has one parameter: the PID of the process to "join"
+        // (and a timed one has its timeout ahead of that)
+        if(req->opcode == SYSCALL_JOINPID_TIMED)
+            get_int(req, &timeout);
+        get_int(req, &param_int);
+        if(req->opcode == SYSCALL_JOINPID_TIMED && timeout < 0)
+            reply_int(get_client(clientPID), STATUS_BAD_REQUEST, false, 0);
+        // only proceed if the specified PID is a "live" process:
+        else if(live(param_int))
+        {
+            printf("YAMSD: received request from process %d to JOIN process %d\n", clientPID, param_int);
+            get_client(clientPID)->join_PID = param_int;
+            // (a JOINPID or WAIT that was still timed gives way to this one)
+            stop_timer(get_client(clientPID));
+            if(req->opcode == SYSCALL_JOINPID_TIMED)
+                get_client(clientPID)->timer = start_timer(get_client(clientPID), timeout);
+        }
+        else
+        {
+            printf("YAMSD: received request from process %d to JOIN invalid process ID %d\n", clientPID, param_int);
+            reply_int(get_client(clientPID), STATUS_ERROR, false, -1);
+        }
+        break;
+    case SYSCALL_WAIT:
+    case SYSCALL_WAIT_TIMED:
+        // syscall WAIT has one parameter: the PID of the process 
+        // to "wait" for a signal from (again, after any timeout):
+        if(req->opcode == SYSCALL_WAIT_TIMED)
+            get_int(req, &timeout);
+        get_int(req, &param_int);
+        if(req->opcode == SYSCALL_WAIT_TIMED && timeout < 0)
+            reply_int(get_client(clientPID), STATUS_BAD_REQUEST, false, 0);
+        // only proceed if the specified PID is a "live" process:
+        else if(live(param_int))
+        {
+            printf("YAMSD: received request from process %d to WAIT for SIGNAL from process %d\n", clientPID, param_int);
+            get_client(clientPID)->wait_PID = param_int;
+            stop_timer(get_client(clientPID));
+            if(req->opcode == SYSCALL_WAIT_TIMED)
+                get_client(clientPID)->timer = start_timer(get_client(clientPID), timeout);
+        }
+        else
+        {
+            printf("YAMSD: received request from process %d to WAIT on invalid process ID %d\n", clientPID, param_int);
+            reply_int(get_client(clientPID), STATUS_ERROR, false, -1);
+        }
+        break;
+    case SYSCALL_SIGNAL:
+        // syscall SIGNAL has one parameter: the PID of the process 
+        // to send a "signal" to:
+        get_int(req, &param_int);
+        // only proceed if the specified PID is actually waiting for a signal from this client:
+        if(live(param_int) && get_client(param_int)->wait_PID == clientPID)
+        {
+            printf("YAMSD: received SIGNAL from process %d to WAITing process %d\n", clientPID, param_int);
+            // clear the wait_PID for the WAITing client:
+            get_client(param_int)->wait_PID = UNUSED;
+            stop_timer(get_client(param_int));
+            // send success (0) signals back to both clients:
+            reply_int(get_client(param_int), STATUS_OK, false, 0);
+            reply_int(get_client(clientPID), STATUS_OK, false, 0);
+        }
+        else
+        {
+            printf("YAMSD: received request from process %d to SIGNAL non-waiting process ID %d\n", clientPID, param_int);
+            reply_int(get_client(clientPID), STATUS_ERROR, false, -1);
+        }
+        break;
+    default:
+        printf("YAMSD: received unknown system call %03o from process %d\n", req->opcode, clientPID);
+        sprintf(response_string, "Received unknown system call %o", req->opcode);
+        reply_text(get_client(clientPID), STATUS_UNKNOWN_SYSCALL, response_string);
+    }
+}
 
-        // and then mark the process as no longer waiting:
-        clients[i].recv_wait_priority = UNUSED;
-        clients[i].recv_wait_type = UNUSED;
-        strcpy(clients[i].recv_wait_sender, "");
+/* the following function registers a freshly read CONNECT, from either *
+ * the FIFOs (fd_socket UNUSED) or a socket, and watches the socket     */
+void connect_request(struct Request *req, int fd_socket)
+{
+    // if there are any available slots, we get one:
+    struct Client *my_client = take_client();
+    if(my_client != NULL)
+    {
+        if(connect_process(my_client, req, fd_socket))
+        {
+            if(fd_socket != UNUSED)
+                watch(fd_socket, WATCH_CLIENT_SOCKET, my_client->slot, my_client->watching_output ? EPOLLIN | EPOLLOUT : EPOLLIN);
+        }
+        else if(errno == ENXIO)
+        {
+            // the client opens its FIFO only after its CONNECT, so we
+            // try again shortly rather than wait for it:
+            printf("YAMSD: client FIFO %s is not open yet; trying again\n", my_client->fifo_name);
+            my_client->open_by = current_tick() + FIFO_OPEN_TIMEOUT / TIMER_TICK;
+            await_fifo(my_client);
+        }
+        else
+        {
+            printf("YAMSD: could not open client FIFO %s\n", my_client->fifo_name);
+            release_client(my_client);
+        }
     }
     else
+        // otherwise, handle the failure gracefully:
+        connect_fail(req, fd_socket);
+}
+
+/* the following function puts a v1 system call in line for the         *
+ * comm-channel FIFO                                                    */
+void queue_v1_call(struct Request *req)
+{
+    if(v1_count == v1_capacity)
     {
-        // if we get here, there is no waiting client
-        // that matches P, T, and S criteria, so we file this message:
+        // make the queue twice as big, with the first call in line first:
+        int capacity = (v1_capacity > 0) ? 2 * v1_capacity : V1_QUEUE_SIZE;
+        struct V1Call *calls = malloc(capacity * sizeof(struct V1Call));
+        for(int i = 0; i < v1_count; i++)
+            calls[i] = v1_calls[(v1_first + i) % v1_capacity];
+        free(v1_calls);
+        v1_calls = calls;
+        v1_capacity = capacity;
+        v1_first = 0;
+    }
+    struct V1Call *call = &(v1_calls[(v1_first + v1_count) % v1_capacity]);
+    call->opcode = req->opcode;
+    call->PID = req->PID;
+    call->step = 0;
+    call->count = 0;
+    v1_count++;
+}
 
-        // find the mailbox, creating it if it does not yet exist:
-        struct Mailbox * mbox = register_mbox(mbox_name);
-    
-        // add a message to the list:
-        struct Message * msg = add_message(mbox, priority, type, clients[clientPID].mailbox_name);
+/* the following function takes as many of the first v1 call's         *
+ * parameters off the comm channel as have arrived, answering the       *
+ * client along the way where the v1 protocol calls for it; it packs    *
+ * them into v1_params just as a v2 client would have, and returns      *
+ * true once it has all of them                                         */
+bool collect_v1_params(struct V1Call *call)
+{
+    struct InBuffer *in = &comm_input;
+    // (a CONNECT has no client yet; its PID is the host-OS one)
+    struct Client *my_client = (call->opcode == SYSCALL_CONNECT) ? NULL : get_client(call->PID);
+    char param_string[STRING_SIZE];
+    char response_string[STRING_SIZE*2];
+    int param_int;
+    switch(call->opcode)
+    {
+    case SYSCALL_CONNECT:
+        // mailbox name (v1 clients do not say which version they speak):
+        if(!take_string(in, param_string, STRING_SIZE))
+            return false;
+        pack_int(&v1_params, PROTOCOL_V1);
+        pack_string(&v1_params, param_string);
+        return true;
+    case SYSCALL_PING:
+    case SYSCALL_JOINPID:
+    case SYSCALL_WAIT:
+    case SYSCALL_SIGNAL:
+        // one int:
+        if(!take_int(in, &param_int))
+            return false;
+        pack_int(&v1_params, param_int);
+        return true;
+    case SYSCALL_CHECK:
+    case SYSCALL_RECV:
+        // priority, type, sender mailbox name:
+        for(; call->step < 2; call->step++)
+        {
+            if(!take_int(in, &param_int))
+                return false;
+            pack_int(&v1_params, param_int);
+        }
+        if(!take_string(in, param_string, STRING_SIZE))
+            return false;
+        pack_string(&v1_params, param_string);
+        return true;
+    case SYSCALL_SEND:
+        // mailbox name, priority, and type; then the client waits to
+        // be told to go ahead before it sends the message lines:
+        if(call->step == 0)
+        {
+            if(!take_string(in, call->mbox_name, STRING_SIZE))
+                return false;
+            pack_string(&v1_params, call->mbox_name);
+            call->step++;
+        }
+        if(call->step == 1)
+        {
+            if(!take_int(in, &(call->priority)))
+                return false;
+            pack_int(&v1_params, call->priority);
+            call->step++;
+        }
+        if(call->step == 2)
+        {
+            char pri[SHORT_STRING], typ[SHORT_STRING];
+            if(!take_int(in, &(call->type)))
+                return false;
+            pack_int(&v1_params, call->type);
+            pri_str(pri, call->priority);
+            typ_str(typ, call->type);
+            sprintf(response_string, "Ready to receive priority %s, type %s message for mailbox %s", pri, typ, call->mbox_name);
+            reply_text(my_client, STATUS_OK, response_string);
+            // the line count goes here, once we know it:
+            call->count_offset = v1_params.size;
+            pack_int(&v1_params, 0);
+            call->step++;
+        }
+        // the lines end with an empty one:
+        char *line;
+        int line_length;
+        while(take_chars(in, &line, &line_length))
+        {
+            if(line_length == 0)
+            {
+                memcpy(v1_params.data + call->count_offset, &(call->count), sizeof(int));
+                return true;
+            }
+            pack_chars(&v1_params, line, line_length);
+            call->count++;
+        }
+        return false;
+    case SYSCALL_CONFIGURE:
+        // n, acknowledged; then n strings, each acknowledged:
+        if(call->step == 0)
+        {
+            if(!take_int(in, &(call->count)))
+                return false;
+            pack_int(&v1_params, call->count);
+            sprintf(response_string, "Received CONFIGURE request for mailbox %s with %d configuration strings", my_client->mailbox_name, call->count);
+            reply_text(my_client, STATUS_OK, response_string);
+            call->step++;
+        }
+        for(; call->step <= call->count; call->step++)
+        {
+            if(!take_string(in, param_string, STRING_SIZE))
+                return false;
+            pack_string(&v1_params, param_string);
+            sprintf(response_string, "Configuring %s", param_string);
+            reply_text(my_client, STATUS_OK, response_string);
+        }
+        return true;
+    default:
+        // everything else has no parameters:
+        return true;
+    }
+}
 
-        // client expects a response at this point:
-        char response_string[STRING_SIZE*2];
-        sprintf(response_string, "Ready to receive priority %s, type %s message for mailbox %s", pri, typ, mbox_name);
-        write_string(clients[clientPID].fd_outgoing, response_string);
+/* the following function hands the comm channel to each waiting v1     *
+ * call in turn, and carries out every call whose parameters are all in */
+void run_v1_calls()
+{
+    while(running && v1_count > 0)
+    {
+        struct V1Call *call = &(v1_calls[v1_first]);
+        if(!v1_active)
+        {
+            if(call->opcode != SYSCALL_CONNECT)
+            {
+                if(!live(call->PID))
+                {
+                    printf("YAMSD: received request from invalid process ID number %d\n", call->PID);
+                    v1_first = (v1_first + 1) % v1_capacity;
+                    v1_count--;
+                    continue;
+                }
+                // v1 clients need to be issued a "lock" for the 
+                // comm-channel FIFO for sending subsequent parameters;
+                // this is simply done by echoing the client PID:
+                printf("YAMSD: issuing lock to client %d to complete syscall %03o\n", call->PID, call->opcode);
+                reply_int(get_client(call->PID), STATUS_OK, true, call->PID);
+            }
+            v1_active = true;
+            v1_params.size = 0;
+        }
+        if(!collect_v1_params(call))
+            break;
+        // all in, so the next call in line can have the comm channel:
+        struct Request v1_request = {PROTOCOL_V1, call->opcode, call->PID, 0, v1_params.size, {v1_params.data, v1_params.size, v1_params.capacity, 0}};
+        v1_first = (v1_first + 1) % v1_capacity;
+        v1_count--;
+        v1_active = false;
+        if(v1_request.opcode == SYSCALL_CONNECT)
+            connect_request(&v1_request, UNUSED);
+        else
+            handle_request(&v1_request);
+    }
+    compact_inbuffer(&comm_input);
+}
 
-        // now read the actual message:
-        read_message(clientPID, msg);
+/* the following function takes every whole request that has arrived    *
+ * on the syscall FIFO and handles it (or puts it in line, for v1)      */
+void read_syscall_fifo()
+{
+    while(fill_inbuffer(fd_syscall, &syscall_input) > 0)
+        ;
+    while(running && take_request(&request))
+    {
+        printf("YAMSD: read syscall %03o (protocol v%d) from server FIFO\n", request.opcode, request.protocol);
+        if(request.protocol == PROTOCOL_V1)
+            queue_v1_call(&request);
+        else if(request.opcode == SYSCALL_CONNECT)
+            connect_request(&request, UNUSED);
+        else
+            handle_request(&request);
     }
-    
-    
+    compact_inbuffer(&syscall_input);
+    run_v1_calls();
 }
 
-void check_messages(int clientPID)
+/* the following function takes in whatever v1 parameters have arrived  *
+ * on the comm-channel FIFO                                             */
+void read_comm_channel()
 {
-    printf("YAMSD: received CHECK request for mailbox %s\n", clients[clientPID].mailbox_name);
-    /* CHECK takes these parameters:                                        *
-     * - int: priority to check for                                         *
-     * - int: message type to check for                                     *
-     * - C-string: sender mailbox name to check for                         */
-    int priority, type;
-    char pri[SHORT_STRING], typ[SHORT_STRING], sender[STRING_SIZE];
-    read_int(fd_commchannel, &priority);
-    pri_str(pri, priority);
-    read_int(fd_commchannel, &type);
-    typ_str(typ, type);
-    read_string(fd_commchannel, sender, STRING_SIZE);
-                    
-    printf("YAMSD: checking for messages of priority %s and type %s from sender %s\n", pri, typ, sender);
-    // first, get the mailbox (creating one if it does not exist)
-    struct Mailbox * mbox = register_mbox(clients[clientPID].mailbox_name);
-    int num_waiting = num_waiting_msgs(mbox, priority, type, sender);
-    printf("YAMSD: found %d matching messages\n", num_waiting);
-    char response_string[STRING_SIZE*2];
-    sprintf(response_string, "You have %d messages of priority %s and type %s from sender %s", num_waiting, pri, typ, sender);
-    write_string(clients[clientPID].fd_outgoing, response_string);
+    while(fill_inbuffer(fd_commchannel, &comm_input) > 0)
+        ;
+    run_v1_calls();
 }
 
-void fetch_message(int clientPID)
+/* the following function takes the next request off a socket that has  *
+ * been accepted but has not sent its CONNECT yet                       */
+void handle_new_socket(int fd)
 {
-    /* RECV takes these parameters:                                         *
-     * - int: priority                                                      *
-     * - int: message type                                                  *
-     * - C-string: sender mailbox name                                      */
-    int priority, type;
-    char pri[SHORT_STRING], typ[SHORT_STRING], sender[STRING_SIZE];
-    read_int(fd_commchannel, &priority);
-    pri_str(pri, priority);
-    read_int(fd_commchannel, &type);
-    typ_str(typ, type);
-    read_string(fd_commchannel, sender, STRING_SIZE);
+    errno = 0;
+    if(!read_socket_request(fd, &request))
+    {
+        // the event may have come without a packet to go with it:
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        printf("YAMSD: closing socket %d, which did not start with a CONNECT\n", fd);
+        new_sockets[fd] = false;
+        fio_close(fd);
+        return;
+    }
+    if(request.opcode != SYSCALL_CONNECT)
+    {
+        printf("YAMSD: closing socket %d, which did not start with a CONNECT\n", fd);
+        new_sockets[fd] = false;
+        fio_close(fd);
+        return;
+    }
+    printf("YAMSD: read syscall %03o on socket %d\n", request.opcode, fd);
+    new_sockets[fd] = false;
+    connect_request(&request, fd);
+}
 
-    printf("YAMSD: received FETCH(P: %s, T: %s, S: %s) request from client %d for mailbox %s\n", pri, typ, sender, clientPID, clients[clientPID].mailbox_name);
-    // fetch the mailbox for the current client:
-    struct Mailbox *mbox = register_mbox(clients[clientPID].mailbox_name);
-    // fetch the first qualifying message:
-    struct Message *msg = fetch_first_message(mbox, priority, type, sender);
-    if (msg == NULL)
+/* the following function takes the next request off a connected        *
+ * client's socket; end-of-file means the client has gone away          */
+void handle_socket_request(struct Client *my_client)
+{
+    errno = 0;
+    if(!read_socket_request(my_client->fd_outgoing, &request))
     {
-        // no message found, so mark the process as waiting:
-        printf("YAMSD: marking process %d as waiting for a message\n", clientPID);
-        clients[clientPID].recv_wait_priority = priority;
-        clients[clientPID].recv_wait_type = type;
-        strcpy(clients[clientPID].recv_wait_sender, sender);
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+        printf("YAMSD: lost connection to client %d\n", my_client->PID);
+        disconnect_process(my_client);
+        return;
     }
-    else
+    printf("YAMSD: read syscall %03o from client %d's socket\n", request.opcode, my_client->PID);
+    if(request.opcode == SYSCALL_CONNECT)
     {
-        // message found, so send it: 
-        write_message(clientPID, msg);       
+        printf("YAMSD: ignoring repeat CONNECT from client %d\n", my_client->PID);
+        return;
     }
+    // the connection itself says who is calling:
+    request.PID = my_client->PID;
+    handle_request(&request);
 }
 
 int main()
@@ -357,240 +2750,149 @@ int main()
     // this is almost as arbitrary a number as any, so 
     // use it to seed my random number generator:
     srand(my_linux_PID);
+    // a client that hangs up on us should not take the server down:
+    signal(SIGPIPE, SIG_IGN);
 
-    // initialize all client records and mailboxes:
-    for(int i = 0; i < LIST_SIZE; i++)
+    // (client records are made as the clients turn up; see take_client)
+
+    // "start up" the process server by creating 
+    // named FIFO's for incoming connections:
+    mkfifo(SERVER_FIFO_1, FIFO_MODE);
+    printf("YAMSD: creating syscall FIFO at %s\n", SERVER_FIFO_1);
+    mkfifo(SERVER_FIFO_2, FIFO_MODE);
+    printf("YAMSD: creating comm-channel FIFO at %s\n", SERVER_FIFO_2);
+
+    // open both FIFOs for reading without waiting for a writer to show up
+    // (clients may just as well come in on the socket), and leave them that
+    // way, since the event loop only ever takes what is already there; we
+    // also hold each one open for writing ourselves, so that they never hit
+    // end-of-file when the last FIFO client goes away:
+    printf("YAMSD: opening syscall FIFO at %s\n", SERVER_FIFO_1);
+    fd_syscall = open(SERVER_FIFO_1, O_RDONLY | O_NONBLOCK);
+    int keep_syscall = open(SERVER_FIFO_1, O_WRONLY);
+    printf("YAMSD: opening comm-channel FIFO at %s\n", SERVER_FIFO_2);
+    fd_commchannel = open(SERVER_FIFO_2, O_RDONLY | O_NONBLOCK);
+    int keep_commchannel = open(SERVER_FIFO_2, O_WRONLY);
+
+    // set up the socket for SOCK_SEQPACKET clients:
+    printf("YAMSD: listening for socket connections at %s\n", SERVER_SOCKET);
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, SERVER_SOCKET, sizeof(address.sun_path) - 1);
+    unlink(SERVER_SOCKET);
+    fd_listen = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if(fd_listen < 0 || bind(fd_listen, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd_listen, SOMAXCONN) < 0)
     {
-        clients[i].PID = UNUSED;
-        clients[i].join_PID = UNUSED;
-        clients[i].wait_PID = UNUSED;
-        clients[i].fd_outgoing = UNUSED;
-        clients[i].recv_wait_priority = UNUSED;
-        clients[i].recv_wait_type = UNUSED;
-        strcpy(clients[i].recv_wait_sender, "");
-        mboxes[i] = NULL;
+        printf("YAMSD: error -- could not set up socket at %s\n", SERVER_SOCKET);
+        return -1;
     }
 
+    // watch the server FIFOs and the listening socket; client sockets are
+    // added as they turn up:
+    fd_epoll = epoll_create1(0);
+    watch(fd_syscall, WATCH_SYSCALL, 0, EPOLLIN);
+    watch(fd_commchannel, WATCH_COMMCHANNEL, 0, EPOLLIN);
+    watch(fd_listen, WATCH_LISTEN, 0, EPOLLIN);
+
+    // start the threads that look after the mailboxes:
+    start_shards();
+    wheel_init(&timers, current_tick());
+    watch(fd_answers, WATCH_ANSWERS, 0, EPOLLIN);
+
+    // go into loop to read and respond to client requests:
     while(running)
     {
-        // "start up" the process server by creating 
-        // named FIFO's for incoming connections:
-        mkfifo(SERVER_FIFO_1, FIFO_MODE);
-        printf("YAMSD: creating syscall FIFO at %s\n", SERVER_FIFO_1);
-        mkfifo(SERVER_FIFO_2, FIFO_MODE);
-        printf("YAMSD: creating comm-channel FIFO at %s\n", SERVER_FIFO_2);
-
-        // if we get here, we have no open connections, so...
-        // open FIFO for reading incoming connections:
-        printf("YAMSD: opening syscall FIFO at %s\n", SERVER_FIFO_1);
-        fd_syscall = open(SERVER_FIFO_1, O_RDONLY);
-        printf("YAMSD: opening comm-channel FIFO at %s\n", SERVER_FIFO_2);
-        fd_commchannel = open(SERVER_FIFO_2, O_RDONLY);
-
-        // keep reading from request pipeline until we get a CONNECT request
-        // or we get 10 bad requests:
-        int bad_requests = 0;
-        do {
-            printf("YAMSD: attempting read from server FIFO...");
-            read_int(fd_syscall, &syscall_code);
-            printf("read syscall %03o\n", syscall_code);
-            bad_requests++;
-        }
-        while(syscall_code != SYSCALL_CONNECT && bad_requests == 10);
-        
-        if(syscall_code != SYSCALL_CONNECT)
-        {
-            printf("YAMSD: error -- too many bad connect requests\n");
-            return -1;
-        }
-        
-        // if we get here, we have received a CONNECT request, so...
-        // connect to our first process:
-        connect_process(&(clients[nextPID]));
-
-        // go into loop to read and respond to client requests:
-        while(connections > 0)
-        {
-            // set up some communication variables:
-            int clientPID; // which client process we are currently communicating with
-            int param_int, param_int_2; // several syscalls send integer parameters
-            char param_string[STRING_SIZE]; // several syscalls send a string parameter
-            char mailbox_name[STRING_SIZE]; // the SEND syscall also identifies a target mailbox
-            char response_string[STRING_SIZE*2]; // this is the response we echo back to the client process
-            int response_int;
-            
-            // read a system call from the FIFO:
-            printf("YAMSD: attempting read from server FIFO...");
-            read_int(fd_syscall, &syscall_code);
-            printf("read syscall %03o\n", syscall_code);
-            
-            if(syscall_code != SYSCALL_CONNECT) {
-                // if this is not a new process connecting, 
-                // we also need to read the process' PID:
-                printf("YAMSD: reading client PID...");
-                read_int(fd_syscall, &clientPID); 
-                printf("read PID %d\n", clientPID); 
-                // and then we need to issue the client a "lock" for the 
-                // comm-channel FIFO for sending subsequent parameters;
-                // this is simply done by echoing the client PID:
-                printf("YAMSD: issuing lock to client %d to complete syscall %03o\n", clientPID, syscall_code);
-                write_int(clients[clientPID].fd_outgoing, &clientPID);
-            }
-            else
+        struct epoll_event events[EVENT_BATCH];
+        // (the wheel only needs turning while something is timed)
+        int nevents = epoll_wait(fd_epoll, events, EVENT_BATCH, timers.count > 0 ? TIMER_TICK : -1);
+        run_timers();
+        run_disconnects();
+        for(int e = 0; running && e < nevents; e++)
+        {
+            int fd = events[e].data.u64 >> 32;
+            int kind = (events[e].data.u64 >> 16) & 0xffff;
+            int owner = events[e].data.u64 & 0xffff;
+            switch(kind)
             {
-                // if there are any available slots, clients[nextPID].PID will equal the UNUSED flag
-                if(clients[nextPID].PID == UNUSED)
-                    connect_process(&(clients[nextPID]));
-                else
-                    // otherwise, handle the failure gracefully:
-                    connect_fail();
-            }
-            
-
-            if(clientPID < LIST_SIZE && clients[clientPID].PID != UNUSED)
+            case WATCH_SYSCALL:
+                read_syscall_fifo();
+                break;
+            case WATCH_COMMCHANNEL:
+                read_comm_channel();
+                break;
+            case WATCH_LISTEN:
             {
-                switch(syscall_code)
-                {
-                case SYSCALL_CONNECT:
-                    // nothing to do here
-                    break;
-                case SYSCALL_SHUTDOWN:
-                    printf("YAMSD: received shutdown request\n");
-                    // if there is only one connection, we can safely shut down
-                    if(connections == 1)
-                    {
-                        printf("YAMSD: disconnecting last client and shutting down process server\n");
-                        write_string(clients[clientPID].fd_outgoing, "SHUTTING DOWN. Goodbye.");
-                        close(clients[clientPID].fd_outgoing);
-                        connections = 0;
-                        running = false;
-                    }
-                    else
-                        // otherwise, we just disconnect the client process.
-                        disconnect_process(&(clients[clientPID]));
-                    break;
-                case SYSCALL_EXIT:
-                    disconnect_process(&(clients[clientPID]));
-                    break;
-                case SYSCALL_PING:
-                    // syscall PING has one parameter: the integer code that we are to
-                    // "bounce" back to the client
-                    read_int(fd_commchannel, &param_int);
-                    printf("YAMSD: received ping from process %d with code %d\n", clientPID, param_int);
-                    sprintf(response_string, "Received PING with code %d", param_int);
-                    write_string(clients[clientPID].fd_outgoing, response_string);
-                    break;
-                case SYSCALL_CONFIGURE:
-                    printf("YAMSD: received CONFIGURE request for mailbox %s\n", clients[clientPID].mailbox_name);
-                    // syscall CONFIGURE has n + 1 parameters, where n is the first byte after the syscall
-                    read_int(fd_commchannel, &param_int);
-                    printf("YAMSD: receiving %d configuration strings...\n", param_int);
-                    sprintf(response_string, "Received CONFIGURE request for mailbox %s with %d configuration strings", clients[clientPID].mailbox_name, param_int);
-                    write_string(clients[clientPID].fd_outgoing, response_string);
-                    for(int i = 0; i < param_int; i++)
-                    {
-                        read_string(fd_commchannel, param_string, STRING_SIZE);
-                        printf("YAMSD: configuring %s.\n", param_string);
-                        sprintf(response_string, "Configuring %s", param_string);
-                        write_string(clients[clientPID].fd_outgoing, response_string);
-                    }
-                    break;
-                case SYSCALL_SEND:
-                    receive_message(clientPID);
-                    break;
-                case SYSCALL_CHECK:
-                    check_messages(clientPID);
+                int fd_new = accept(fd_listen, NULL, NULL);
+                if(fd_new < 0)
                     break;
-                case SYSCALL_RECV:
-                    fetch_message(clientPID);
-                    break;
-                case SYSCALL_GETPID:
-                    // look up process PID:
-                    response_int = clients[clientPID].PID;
-                    printf("YAMSD: received GETPID request from process %d; returning value %d\n", clientPID, response_int);
-                    write_int(clients[clientPID].fd_outgoing, &response_int);
-                    break;
-                case SYSCALL_GETAGE:
-                    // determine process age:
-                    response_int = time(NULL) - clients[clientPID].start_time;
-                    printf("YAMSD: received GETAGE request from process %d; process has been alive %d seconds\n", clientPID, response_int);
-                    write_int(clients[clientPID].fd_outgoing, &response_int);
-                    break;
-                case SYSCALL_JOINPID:
-                    // syscall JOINPID has one parameter: the PID of the process to "join"
-                    read_int(fd_commchannel, &param_int);
-                    // only proceed if the specified PID is a "live" process:
-                    if(clients[param_int].PID != UNUSED)
-                    {
-                        printf("YAMSD: received request from process %d to JOIN process %d\n", clientPID, param_int);
-                        clients[clientPID].join_PID = param_int;
-                    }
-                    else
-                    {
-                        printf("YAMSD: received request from process %d to JOIN invalid process ID %d\n", clientPID, param_int);
-                        response_int = -1;
-                        write_int(clients[clientPID].fd_outgoing, &response_int);
-                    }
-                    break;
-                case SYSCALL_WAIT:
-                    // syscall WAIT has one parameter: the PID of the process 
-                    // to "wait" for a signal from:
-                    read_int(fd_commchannel, &param_int);
-                    // only proceed if the specified PID is a "live" process:
-                    if(clients[param_int].PID != UNUSED)
-                    {
-                        printf("YAMSD: received request from process %d to WAIT for SIGNAL from process %d\n", clientPID, param_int);
-                        clients[clientPID].wait_PID = param_int;
-                    }
-                    else
-                    {
-                        printf("YAMSD: received request from process %d to WAIT on invalid process ID %d\n", clientPID, param_int);
-                        response_int = -1;
-                        write_int(clients[clientPID].fd_outgoing, &response_int);
-                    }
-                    break;
-                case SYSCALL_SIGNAL:
-                    // syscall SIGNAL has one parameter: the PID of the process 
-                    // to send a "signal" to:
-                    read_int(fd_commchannel, &param_int);
-                    // only proceed if the specified PID is actually waiting for a signal from this client:
-                    if(clients[param_int].wait_PID == clientPID)
-                    {
-                        printf("YAMSD: received SIGNAL from process %d to WAITing process %d\n", clientPID, param_int);
-                        // clear the wait_PID for the WAITing client:
-                        clients[param_int].wait_PID = UNUSED;
-                        // send success (0) signals back to both clients:
-                        response_int = 0;
-                        write_int(clients[param_int].fd_outgoing, &response_int);
-                        write_int(clients[clientPID].fd_outgoing, &response_int);
-                    }
-                    else
-                    {
-                        printf("YAMSD: received request from process %d to SIGNAL non-waiting process ID %d\n", clientPID, param_int);
-                        response_int = -1;
-                        write_int(clients[clientPID].fd_outgoing, &response_int);
-                    }
-                    break;
-                default:
-                    printf("YAMSD: received unknown system call %03o from process %d\n", syscall_code, clientPID);
-                    sprintf(response_string, "Received unknown system call %o", syscall_code);
-                    write_string(clients[clientPID].fd_outgoing, response_string);
+                if(fd_new >= new_sockets_size)
+                {
+                    int size = (new_sockets_size > 0) ? new_sockets_size : EVENT_BATCH;
+                    while(size <= fd_new)
+                        size *= 2;
+                    new_sockets = realloc(new_sockets, size * sizeof(bool));
+                    memset(new_sockets + new_sockets_size, 0, (size - new_sockets_size) * sizeof(bool));
+                    new_sockets_size = size;
                 }
+                new_sockets[fd_new] = true;
+                watch(fd_new, WATCH_NEW_SOCKET, 0, EPOLLIN);
+                break;
             }
-            else
-            {
-                printf("YAMSD: received request from invalid process ID number %d\n", clientPID);
+            case WATCH_NEW_SOCKET:
+                // skip sockets that were closed while we handled an
+                // earlier event in this batch:
+                if(fd < new_sockets_size && new_sockets[fd])
+                    handle_new_socket(fd);
+                break;
+            case WATCH_CLIENT_SOCKET:
+                // (and clients that went away in the meantime)
+                if(get_client(owner)->PID == UNUSED || get_client(owner)->fd_outgoing != fd || get_client(owner)->transport != TRANSPORT_SOCKET)
+                    break;
+                if(events[e].events & EPOLLOUT)
+                    flush_output(get_client(owner), false);
+                if(events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    handle_socket_request(get_client(owner));
+                break;
+            case WATCH_ANSWERS:
+                read_answers();
+                break;
+            case WATCH_CLIENT_FIFO:
+                if(get_client(owner)->PID != UNUSED && get_client(owner)->fd_outgoing == fd && get_client(owner)->transport == TRANSPORT_FIFO)
+                    flush_output(get_client(owner), false);
+                break;
             }
+            run_disconnects();
         }
-
-        // if we reach this point there are no current connections, 
-        // input will be undefined, so we need to close and re-open server FIFOs
-        printf("YAMSD: resetting FIFO communication channels\n");
-        close(fd_syscall);
-        close(fd_commchannel);
-        unlink(SERVER_FIFO_1);
-        unlink(SERVER_FIFO_2);
     }
 
+    printf("YAMSD: clients fell behind %d times: %d waited for, %d SPAM messages dropped, %d disconnected\n",
+           overflow_totals[OVERFLOW_BLOCK] + overflow_totals[OVERFLOW_DROP_SPAM] + overflow_totals[OVERFLOW_DISCONNECT],
+           overflow_totals[OVERFLOW_BLOCK], overflow_totals[OVERFLOW_DROP_SPAM], overflow_totals[OVERFLOW_DISCONNECT]);
+
+    stop_shards();
+
+    struct PoolStats message_stats;
+    get_pool_stats(&message_stats);
+    printf("YAMSD: message pool: %ld slabs, %ld messages handed out, %ld still queued\n",
+           message_stats.slabs, message_stats.allocs, message_stats.allocs - message_stats.frees);
+    long expired = 0;
+    for(int i = 0; i < num_shards; i++)
+        expired += shards[i].expired;
+    printf("YAMSD: %ld messages expired\n", expired);
+
+    // we are shutting down, so tear down all the communication channels:
+    printf("YAMSD: closing communication channels\n");
+    for(int fd = 0; fd < new_sockets_size; fd++)
+        if(new_sockets[fd])
+            fio_close(fd);
+    fio_close(fd_syscall);
+    fio_close(fd_commchannel);
+    close(keep_syscall);
+    close(keep_commchannel);
+    close(fd_listen);
+    close(fd_epoll);
+    unlink(SERVER_FIFO_1);
+    unlink(SERVER_FIFO_2);
+    unlink(SERVER_SOCKET);
+
     return 0;
-}
\ No newline at end of file
+}